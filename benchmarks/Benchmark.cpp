@@ -0,0 +1,104 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Benchmark.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace bench {
+
+namespace {
+
+constexpr std::chrono::milliseconds MIN_TIME {300};
+
+struct Entry {
+    std::string name;
+    Function function;
+};
+
+std::vector<Entry> &registry()
+{
+    static std::vector<Entry> entries;
+    return entries;
+}
+
+} // namespace
+
+
+Registration::Registration(std::string const &name, Function function)
+{
+    registry().push_back(Entry {name, std::move(function)});
+}
+
+
+int Main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : "";
+
+    // Library logs go to stdout, so results can be written to a file instead
+    FILE *out = stdout;
+    if (argc > 2 && (out = std::fopen(argv[2], "w")) == nullptr) {
+        std::perror(argv[2]);
+        return 1;
+    }
+
+    for (auto const &entry : registry()) {
+        if (std::strstr(entry.name.c_str(), filter) == nullptr)
+            continue;
+
+        // Warm up caches and lazily built inputs
+        State warm_up;
+        entry.function(warm_up);
+
+        State total;
+        uint64_t runs = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed {};
+
+        do {
+            State state;
+            entry.function(state);
+            total.operations += state.operations;
+            total.bytes += state.bytes;
+            ++runs;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed < MIN_TIME);
+
+        double seconds = elapsed.count();
+        std::fprintf(out, "{\"name\": \"%s\", \"runs\": %llu, \"operations\": %llu, \"seconds\": %.6f, "
+                    "\"ns_per_op\": %.3f, \"ops_per_sec\": %.1f, \"bytes_per_sec\": %.1f}\n",
+                    entry.name.c_str(), (unsigned long long)runs, (unsigned long long)total.operations, seconds,
+                    total.operations ? seconds * 1e9 / total.operations : 0.0,
+                    total.operations / seconds, total.bytes / seconds);
+        std::fflush(out);
+    }
+
+    if (out != stdout)
+        std::fclose(out);
+
+    return 0;
+}
+
+} // namespace bench
+
+
+int main(int argc, char *argv[])
+{
+    return bench::Main(argc, argv);
+}
@@ -0,0 +1,60 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/* Minimal benchmark harness. Every benchmark runs a batch of operations and
+ * reports how many it did; the harness repeats it until MIN_TIME elapsed and
+ * prints one JSON object per line, so results can be diffed or gated on.
+ *
+ * Usage: benchmarks [name filter] [output file]
+ */
+namespace bench {
+
+struct State {
+    uint64_t operations = 0; // Operations done by the run (e.g. frames)
+    uint64_t bytes = 0;      // Bytes processed by the run, optional
+};
+
+using Function = std::function<void (State &)>;
+
+struct Registration {
+    Registration(std::string const &name, Function function);
+};
+
+int Main(int argc, char *argv[]);
+
+// Prevents the compiler from dropping a computed value
+template <typename T>
+inline void DoNotOptimize(T const &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+} // namespace bench
+
+#define BENCHMARK(name) \
+    static void name(bench::State &); \
+    static bench::Registration name##_registration(#name, name); \
+    static void name(bench::State &state)
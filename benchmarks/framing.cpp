@@ -0,0 +1,165 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Benchmark.h"
+#include "Common.h"
+#include "FrameReader.h"
+#include "FrameScanner.h"
+
+#include <random>
+
+namespace {
+
+// Broadcast frames of random length and content, like a busy scan mode stick
+std::vector<uint8_t> const &synthetic_stream()
+{
+    static std::vector<uint8_t> stream;
+
+    if (stream.empty()) {
+        std::mt19937 random(42);
+        while (stream.size() < (8 << 20)) {
+            std::vector<uint8_t> data(1 + random() % 17);
+            for (auto &byte : data)
+                byte = static_cast<uint8_t>(random());
+            auto frame = Message(ant::BROADCAST_DATA, data);
+            stream.insert(stream.end(), frame.begin(), frame.end());
+        }
+    }
+
+    return stream;
+}
+
+
+void feed_framer(bench::State &state, size_t chunk_size)
+{
+    auto const &stream = synthetic_stream();
+
+    FrameReader framer;
+    FrameView frame;
+
+    for (size_t offset = 0; offset < stream.size(); offset += chunk_size) {
+        size_t size = std::min(chunk_size, stream.size() - offset);
+        size_t written = 0;
+        while (written < size) {
+            written += framer.Write(&stream[offset + written], size - written);
+            while (framer.Next(frame)) {
+                bench::DoNotOptimize(frame.Id());
+                ++state.operations;
+            }
+        }
+    }
+
+    state.bytes = stream.size();
+}
+
+
+void feed_framer_batch(bench::State &state, size_t chunk_size)
+{
+    auto const &stream = synthetic_stream();
+
+    FrameReader framer;
+    FrameView frames[64];
+
+    for (size_t offset = 0; offset < stream.size(); offset += chunk_size) {
+        size_t size = std::min(chunk_size, stream.size() - offset);
+        size_t written = 0;
+        while (written < size) {
+            written += framer.Write(&stream[offset + written], size - written);
+            while (size_t count = framer.NextBatch(frames, 64)) {
+                for (size_t i = 0; i < count; ++i)
+                    bench::DoNotOptimize(frames[i].Id());
+                state.operations += count;
+            }
+        }
+    }
+
+    state.bytes = stream.size();
+}
+
+} // namespace
+
+
+BENCHMARK(MessageChecksum_18B)
+{
+    std::vector<uint8_t> frame(17, 0x5A);
+
+    for (int i = 0; i < 100000; ++i) {
+        frame[3] = static_cast<uint8_t>(i);
+        bench::DoNotOptimize(MessageChecksum(frame));
+    }
+
+    state.operations = 100000;
+    state.bytes = state.operations * frame.size();
+}
+
+
+BENCHMARK(Message_SetChannelPeriod)
+{
+    for (int i = 0; i < 100000; ++i) {
+        auto msg = Message(ant::SET_CHANNEL_PERIOD, {static_cast<uint8_t>(i & 7), 0x86, 0x1F});
+        bench::DoNotOptimize(msg.data());
+    }
+
+    state.operations = 100000;
+}
+
+
+BENCHMARK(MakeMessage_SetChannelPeriod)
+{
+    for (int i = 0; i < 100000; ++i) {
+        auto msg = MakeMessage<ant::SET_CHANNEL_PERIOD>(i & 7, 0x86, 0x1F);
+        bench::DoNotOptimize(msg.data());
+    }
+
+    state.operations = 100000;
+}
+
+
+BENCHMARK(FrameReader_8MB_Chunk64)
+{
+    feed_framer(state, 64);
+}
+
+
+BENCHMARK(FrameReader_8MB_Chunk4096)
+{
+    feed_framer(state, 4096);
+}
+
+
+// Checksum validated, see FrameScanner::Implementation() for the kernels used
+BENCHMARK(FrameReader_NextBatch_8MB_Chunk4096)
+{
+    feed_framer_batch(state, 4096);
+}
+
+
+BENCHMARK(FrameScanner_FindSync_8MB)
+{
+    auto const &stream = synthetic_stream();
+    uint32_t positions[1024];
+
+    for (size_t offset = 0; offset < stream.size();) {
+        size_t size = std::min<size_t>(4096, stream.size() - offset);
+        size_t found = FrameScanner::FindSync(&stream[offset], size, positions, 1024);
+        state.operations += found;
+        offset += found == 1024 ? positions[found - 1] + 1 : size;
+    }
+
+    state.bytes = stream.size();
+}
@@ -0,0 +1,240 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Benchmark.h"
+#include "Capture.h"
+#include "HrmDecoder.h"
+#include "HrmJson.h"
+#include "ReplayDevice.h"
+#include "Stick.h"
+
+#include <unistd.h>
+
+namespace {
+
+constexpr unsigned STREAM_FRAMES = 100000;
+
+// Stick attached to an unthrottled replay device with HRM broadcast traffic
+std::unique_ptr<Stick> replay_stick(size_t chunk_size)
+{
+    auto device = new ReplayDevice(ReplayDevice::UNTHROTTLED);
+
+    for (unsigned i = 0; i < 256; ++i) {
+        uint8_t page = static_cast<uint8_t>((i & 0x80) | 4);
+        device->AddFrame(Message(ant::BROADCAST_DATA, {
+            0, page, 0, 0, 0, static_cast<uint8_t>(i * 7), static_cast<uint8_t>(i * 3), static_cast<uint8_t>(i), 60,
+            0x80, static_cast<uint8_t>(i), 0xA3, HRM::ANT_DEVICE_TYPE, 0x01}));
+    }
+    device->SetLoops(STREAM_FRAMES / 256);
+    device->SetChunkSize(chunk_size);
+
+    auto stick = std::unique_ptr<Stick>(new Stick());
+    stick->AttachDevice(std::unique_ptr<Device>(device));
+    stick->Connect();
+
+    return stick;
+}
+
+} // namespace
+
+
+BENCHMARK(Stick_ReadNextMessage_Fragmented7B)
+{
+    auto stick = replay_stick(7);
+    std::vector<uint8_t> message;
+
+    while (stick->ReadNextMessage(message))
+        ++state.operations;
+
+    state.bytes = state.operations * 18;
+}
+
+
+BENCHMARK(Stick_ReadExtendedMsg)
+{
+    auto stick = replay_stick(4096);
+    ExtendedMessage msg;
+
+    while (stick->ReadExtendedMsg(msg)) {
+        bench::DoNotOptimize(msg.device_number);
+        ++state.operations;
+    }
+
+    state.bytes = state.operations * 18;
+}
+
+
+BENCHMARK(Stick_ReadExtendedBatch)
+{
+    auto stick = replay_stick(4096);
+    std::vector<ExtendedMessage> batch;
+
+    while (stick->ReadExtendedBatch(batch, 256)) {
+        bench::DoNotOptimize(batch.data());
+        state.operations += batch.size();
+    }
+
+    state.bytes = state.operations * 18;
+}
+
+
+BENCHMARK(Stick_ReadExtendedMsg_Capture)
+{
+    auto stick = replay_stick(4096);
+    std::string base_path = "/tmp/antservice_benchmark_" + std::to_string(getpid());
+    if (!stick->StartCapture(base_path, STREAM_FRAMES))
+        return;
+
+    ExtendedMessage msg;
+
+    while (stick->ReadExtendedMsg(msg)) {
+        bench::DoNotOptimize(msg.device_number);
+        ++state.operations;
+    }
+
+    stick->StopCapture();
+    for (auto const &segment : CaptureReader::Segments(base_path))
+        unlink(segment.c_str());
+
+    state.bytes = state.operations * 18;
+}
+
+
+BENCHMARK(Capture_WriteAndRead)
+{
+    std::string base_path = "/tmp/antservice_benchmark_" + std::to_string(getpid());
+    {
+        CaptureWriter writer(base_path, STREAM_FRAMES);
+        ExtendedMessage msg {0, {4, 0, 0, 0, 0, 0, 0, 60}, 0, HRM::ANT_DEVICE_TYPE, 0x01,
+                             ant::EXT_CHANNEL_ID, 0, 0, 0};
+        if (!writer.Open())
+            return;
+        for (unsigned i = 0; i < STREAM_FRAMES; ++i) {
+            msg.device_number = static_cast<uint16_t>(i);
+            writer.Append(msg, i);
+        }
+    }
+
+    CaptureReader reader;
+    if (reader.Open(base_path + ".000000.antcap")) {
+        uint32_t sum = 0;
+        for (auto const &record : reader)
+            sum += record.device_number;
+        bench::DoNotOptimize(sum);
+        state.operations = reader.Size();
+        state.bytes = reader.Size() * sizeof(CaptureRecord);
+    }
+
+    reader.Close();
+    unlink((base_path + ".000000.antcap").c_str());
+}
+
+
+BENCHMARK(Stick_EndToEnd_InitAndRead)
+{
+    auto device = new ReplayDevice(ReplayDevice::UNTHROTTLED);
+    device->AddResponse(Message(ant::REQUEST_MESSAGE, {0, ant::RESPONSE_SERIAL_NUMBER}),
+                        Message(ant::RESPONSE_SERIAL_NUMBER, {0x83, 0x22, 0x27, 0x12}));
+    device->AddResponse(Message(ant::REQUEST_MESSAGE, {0, ant::RESPONSE_VERSION}),
+                        Message(ant::RESPONSE_VERSION, {'A', 'P', '2', 0}));
+    device->AddResponse(Message(ant::REQUEST_MESSAGE, {0, ant::RESPONSE_CAPABILITIES}),
+                        Message(ant::RESPONSE_CAPABILITIES, {8, 3, 0, 0xBA}));
+    device->AddFrame(Message(ant::BROADCAST_DATA, {
+        0, 4, 0, 0, 0, 0, 0, 0, 60, 0x80, 0xFD, 0xA3, HRM::ANT_DEVICE_TYPE, 0x61}));
+    device->SetLoops(STREAM_FRAMES);
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(device));
+    if (!stick.Connect() || !stick.Reset() || !stick.Init())
+        return;
+
+    ExtendedMessage msg;
+    while (stick.ReadExtendedMsg(msg))
+        ++state.operations;
+
+    state.bytes = state.operations * 18;
+}
+
+
+BENCHMARK(HrmJson_ExtendedMessage)
+{
+    ExtendedMessage msg {0, {4, 0, 0, 0x12, 0x34, 0x56, 7, 60}, 41981, HRM::ANT_DEVICE_TYPE, 0x61,
+                         ant::EXT_CHANNEL_ID, 0, 0, 0};
+
+    for (int i = 0; i < 10000; ++i) {
+        msg.payload[6] = static_cast<uint8_t>(i);
+        auto json = ExtendedMessageJson(msg);
+        bench::DoNotOptimize(json.data());
+    }
+
+    state.operations = 10000;
+}
+
+
+BENCHMARK(HrmDecoder_64Devices)
+{
+    HrmDecoder decoder;
+    HeartBeat beat;
+    ExtendedMessage msg {0, {4, 0, 0, 0, 0, 0, 0, 60}, 0, HRM::ANT_DEVICE_TYPE, 0x01,
+                         ant::EXT_CHANNEL_ID, 0, 0, 0};
+
+    for (unsigned i = 0; i < 100000; ++i) {
+        msg.device_number = static_cast<uint16_t>(i % 64);
+        // A new beat every other message of a device
+        uint16_t event_time = static_cast<uint16_t>((i / 128) * 800);
+        msg.payload[4] = static_cast<uint8_t>(event_time);
+        msg.payload[5] = static_cast<uint8_t>(event_time >> 8);
+        msg.payload[6] = static_cast<uint8_t>(i / 128);
+        if (decoder.Decode(msg, beat))
+            bench::DoNotOptimize(beat.rr_interval);
+    }
+
+    state.operations = 100000;
+}
+
+
+BENCHMARK(Stick_ReadBurst_1KB)
+{
+    constexpr size_t PACKETS = 128;
+    auto device = new ReplayDevice(ReplayDevice::UNTHROTTLED);
+
+    for (size_t i = 0; i < PACKETS; ++i)
+        device->AddFrame(Message(ant::BURST_TRANSFER_DATA, {
+            static_cast<uint8_t>(1 | BurstSequence(i) << BURST_SEQUENCE_SHIFT | (i + 1 == PACKETS ? BURST_LAST_PACKET : 0)),
+            static_cast<uint8_t>(i), 1, 2, 3, 4, 5, 6, 7}));
+    device->SetLoops(STREAM_FRAMES / PACKETS);
+    device->SetChunkSize(4096);
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(device));
+    stick.Connect();
+
+    size_t bytes = 0;
+    stick.SetBurstCallback([&bytes] (uint8_t, const uint8_t *data, size_t size) {
+        bench::DoNotOptimize(data);
+        bytes += size;
+    });
+
+    // Burst packets are consumed while looking for data messages, there are
+    // none so this drains the whole stream
+    std::vector<ExtendedMessage> batch;
+    stick.ReadExtendedBatch(batch, 256);
+
+    state.operations = bytes / (PACKETS * BurstAssembler::PACKET_SIZE);
+    state.bytes = bytes;
+}
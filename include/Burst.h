@@ -0,0 +1,90 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Channel byte of BURST_TRANSFER_DATA messages
+ *
+ * | bit 7       | bits 5-6        | bits 0-4       |
+ * |-------------|-----------------|----------------|
+ * | Last packet | Sequence number | Channel number |
+ *
+ * The sequence number is 0 for the first packet of a burst, then it counts
+ * 1, 2, 3, 1, 2, 3... Every packet carries 8 bytes of data.
+ */
+enum BurstChannelByte {
+    BURST_CHANNEL_MASK = 0x1F,
+    BURST_SEQUENCE_SHIFT = 5,
+    BURST_SEQUENCE_MASK = 0x60,
+    BURST_LAST_PACKET = 0x80
+};
+
+// Sequence number of the index-th packet of a burst
+inline uint8_t BurstSequence(size_t index)
+{
+    return index == 0 ? 0 : static_cast<uint8_t>((index - 1) % 3 + 1);
+}
+
+
+/* Reassembles the incoming bursts of one channel into a contiguous buffer.
+ *
+ * The buffer is allocated once, at the first burst, with the maximum burst
+ * size, so packets are only copied. A packet out of sequence drops the burst,
+ * the sender has to start it over.
+ */
+class BurstAssembler {
+public:
+    static constexpr size_t PACKET_SIZE = 8;
+    static constexpr size_t DEFAULT_MAX_SIZE = 64 * 1024;
+
+    enum Result {
+        PENDING,    // Packet stored, more to come
+        COMPLETE,   // Last packet stored, Data() holds the burst
+        FAILED,     // Out of sequence or too long, the burst is dropped
+        IGNORED     // Not a first packet and no burst in progress
+    };
+
+    BurstAssembler() = default;
+    explicit BurstAssembler(size_t max_size) : max_size_(max_size) {}
+
+    // Adds the packet received at time (ns of any monotonic clock)
+    Result Add(uint8_t channel_byte, const uint8_t *payload, uint64_t time);
+    // Drops the burst in progress, returns false if there was none
+    bool Abort();
+    bool InProgress() const { return in_progress_; }
+    static bool IsFirst(uint8_t channel_byte) { return (channel_byte & BURST_SEQUENCE_MASK) == 0; }
+
+    // The completed burst, valid until the next Add
+    const uint8_t *Data() const { return buffer_.data(); }
+    size_t Size() const { return size_; }
+    // From the first to the last packet of the completed burst, ns
+    uint64_t Duration() const { return end_time_ - start_time_; }
+
+private:
+    std::vector<uint8_t> buffer_ {};
+    size_t max_size_ = DEFAULT_MAX_SIZE;
+    size_t size_ = 0;
+    bool in_progress_ = false;
+    uint8_t sequence_ = 0;
+    uint64_t start_time_ = 0;
+    uint64_t end_time_ = 0;
+};
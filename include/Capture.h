@@ -0,0 +1,208 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Stick.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Binary capture of received messages. A capture is a series of segment
+ * files "<base>.NNNNNN.antcap", every segment is a CaptureHeader followed by
+ * a pre-allocated array of fixed size CaptureRecords. Both are memory mapped,
+ * so appending a record is a plain store and reading needs no parsing.
+ */
+struct CaptureHeader {
+    static constexpr char MAGIC[8] = {'A', 'N', 'T', 'C', 'A', 'P', 0, 0};
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    // Pre-allocated records
+    uint64_t capacity;
+    // Written records, updated after every record
+    uint64_t records;
+    // Wall clock time of the segment creation, ns since the epoch
+    uint64_t start_time;
+    uint8_t reserved[24];
+};
+static_assert(sizeof(CaptureHeader) == 64, "CaptureHeader is a part of the file format");
+
+
+struct CaptureRecord {
+    // Wall clock receive time, ns since the epoch
+    uint64_t timestamp;
+    uint8_t channel_number;
+    uint8_t device_type;
+    uint8_t trans_type;
+    // ant::ExtendedFlags of the message, 0 in captures before RSSI support
+    uint8_t flags;
+    uint16_t device_number;
+    uint8_t payload[8];
+    int8_t rssi;
+    int8_t rssi_threshold;
+    uint16_t rx_timestamp;
+    uint8_t reserved[6];
+
+    ExtendedMessage Message() const {
+        ExtendedMessage msg {};
+        msg.channel_number = channel_number;
+        std::memcpy(msg.payload, payload, sizeof(payload));
+        msg.device_number = device_number;
+        msg.device_type = device_type;
+        msg.trans_type = trans_type;
+        msg.flags = flags;
+        msg.rssi = rssi;
+        msg.rssi_threshold = rssi_threshold;
+        msg.rx_timestamp = rx_timestamp;
+        return msg;
+    }
+};
+static_assert(sizeof(CaptureRecord) == 32, "CaptureRecord is a part of the file format");
+
+
+/* Appends records to the segments of a capture. Creating, allocating and
+ * mapping a segment takes a while, so a helper thread prepares the next one
+ * as soon as the current one is half full and closes full ones, the receive
+ * path only switches the mapping.
+ */
+class CaptureWriter {
+public:
+    // 32 MiB segments
+    static constexpr size_t DEFAULT_SEGMENT_RECORDS = 1 << 20;
+
+    // max_segments > 0 keeps only the newest segments, older ones are removed
+    explicit CaptureWriter(std::string const &base_path,
+                           size_t segment_records = DEFAULT_SEGMENT_RECORDS,
+                           unsigned max_segments = 0);
+    ~CaptureWriter();
+
+    CaptureWriter(CaptureWriter const &) = delete;
+    CaptureWriter &operator=(CaptureWriter const &) = delete;
+
+    // Starts a new capture, segments left behind by an earlier one with the
+    // same base path are removed
+    bool Open();
+    // Truncates the current segment to the written records
+    void Close();
+    bool IsOpen() const { return records_ != nullptr; }
+
+    bool Append(ExtendedMessage const &msg, uint64_t timestamp) {
+        if (count_ == capacity_ && !next_segment())
+            return false;
+        if (count_ == capacity_ / 2)
+            prepare_next();
+
+        CaptureRecord &record = records_[count_++];
+        record.timestamp = timestamp;
+        record.channel_number = msg.channel_number;
+        record.device_type = msg.device_type;
+        record.trans_type = msg.trans_type;
+        record.flags = msg.flags;
+        record.device_number = msg.device_number;
+        std::memcpy(record.payload, msg.payload, sizeof(record.payload));
+        record.rssi = msg.rssi;
+        record.rssi_threshold = msg.rssi_threshold;
+        record.rx_timestamp = msg.rx_timestamp;
+        header_->records = count_;
+        ++total_;
+        return true;
+    }
+
+    uint64_t Records() const { return total_; }
+    unsigned Segment() const { return segment_; }
+    std::string SegmentPath(unsigned segment) const;
+
+private:
+    struct SegmentMap {
+        unsigned number = 0;
+        int fd = -1;
+        void *map = nullptr;
+        size_t map_size = 0;
+    };
+
+    bool next_segment();
+    // Asks the helper thread for the segment after the current one
+    void prepare_next();
+    bool open_segment(unsigned number, SegmentMap &segment);
+    // Truncates the segment to count records and closes it
+    void close_segment(SegmentMap &segment, size_t count);
+    void use_segment(SegmentMap const &segment);
+    void run_helper();
+    void stop_helper();
+
+    std::string base_path_;
+    size_t segment_records_;
+    unsigned max_segments_;
+    unsigned segment_ = 0;
+    SegmentMap current_ {};
+    CaptureHeader *header_ = nullptr;
+    CaptureRecord *records_ = nullptr;
+    size_t count_ = 0;
+    size_t capacity_ = 0;
+    uint64_t total_ = 0;
+
+    // Shared with the helper thread
+    std::thread helper_ {};
+    std::mutex mutex_ {};
+    std::condition_variable helper_wake_up_ {};
+    std::condition_variable prepared_ {};
+    bool stopping_ = false;
+    bool preparing_ = false;    // next_ is being prepared
+    unsigned next_number_ = 0;
+    bool next_ready_ = false;   // next_ is open and mapped
+    SegmentMap next_ {};
+    // Full segments and their record counts, closed by the helper
+    std::vector<std::pair<SegmentMap, size_t>> retired_ {};
+};
+
+
+class CaptureReader {
+public:
+    CaptureReader() = default;
+    ~CaptureReader();
+
+    CaptureReader(CaptureReader const &) = delete;
+    CaptureReader &operator=(CaptureReader const &) = delete;
+
+    // Segment files of a capture, oldest first
+    static std::vector<std::string> Segments(std::string const &base_path);
+
+    bool Open(std::string const &segment_path);
+    void Close();
+
+    CaptureHeader const &Header() const { return *header_; }
+    size_t Size() const { return size_; }
+    CaptureRecord const &operator[](size_t index) const { return records_[index]; }
+    CaptureRecord const *begin() const { return records_; }
+    CaptureRecord const *end() const { return records_ + size_; }
+
+private:
+    void *map_ = nullptr;
+    size_t map_size_ = 0;
+    CaptureHeader const *header_ = nullptr;
+    CaptureRecord const *records_ = nullptr;
+    size_t size_ = 0;
+};
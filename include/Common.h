@@ -20,47 +20,14 @@
 
 #pragma once
 
+#include <array>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
 #include <sstream>
 
 #include "Defaults.h"
-
-// Show debug info
-#define DEBUG
-
-#if defined(DEBUG)
-#include <string.h>
-class LogMessageObject
-{
-public:
-    LogMessageObject(std::string const &funcname, std::string const &path_to_file, unsigned line) {
-
-        auto found = path_to_file.rfind("/");
-
-        // Extra symbols make the output coloured
-        std::cout << "+ \x1b[31m" << funcname << " \x1b[33m["
-                  << (found == std::string::npos ? path_to_file : path_to_file.substr(found + 1))
-                  << ":" << std::dec << line << "]\x1b[0m" << std::endl;
-
-        this->funcname_ = funcname;
-    };
-
-    ~LogMessageObject() {
-        std::cout << "- \x1b[31m" << this->funcname_ << "\x1b[0m" << std::endl;
-    };
-
-private:
-    std::string funcname_;
-};
-#define LOG_MSG(msg) std::cout << msg << std::endl;
-#define LOG_ERR(msg) std::cerr << msg << std::endl;
-#define LOG_FUNC LogMessageObject lmsgo__(__func__, __FILE__, __LINE__);
-#else // DEBUG
-#define LOG_MSG(msg)
-#define LOG_ERR(msg)
-#define LOG_FUNC
-#endif // DEBUG
+#include "Log.h"
 
 
 inline uint8_t MessageChecksum (std::vector<uint8_t> const &msg)
@@ -79,6 +46,7 @@ inline std::vector<uint8_t> Message(ant::MessageId id, std::vector<uint8_t> cons
     LOG_FUNC;
 
     std::vector<uint8_t> yield;
+    yield.reserve(data.size() + 4);
 
     yield.push_back(static_cast<uint8_t>(ant::SYNC_BYTE));
     yield.push_back(static_cast<uint8_t>(data.size()));
@@ -90,6 +58,59 @@ inline std::vector<uint8_t> Message(ant::MessageId id, std::vector<uint8_t> cons
 }
 
 
+/* Builds a frame for a fixed number of data bytes in a std::array, without
+ * touching the heap. With constant arguments the whole frame including the
+ * checksum is computed at compile time:
+ *
+ *     constexpr auto open = MakeMessage<ant::OPEN_CHANNEL>(0);
+ */
+template <ant::MessageId Id, typename... Bytes>
+constexpr std::array<uint8_t, sizeof...(Bytes) + 4> MakeMessage(Bytes... data)
+{
+    static_assert(sizeof...(Bytes) <= ant::MAX_DATA_LENGTH, "ANT message data is too long");
+
+    std::array<uint8_t, sizeof...(Bytes) + 4> frame {
+        static_cast<uint8_t>(ant::SYNC_BYTE),
+        static_cast<uint8_t>(sizeof...(Bytes)),
+        static_cast<uint8_t>(Id),
+        static_cast<uint8_t>(data)...,
+        0
+    };
+
+    uint8_t checksum = 0;
+    for (size_t i = 0; i + 1 < frame.size(); ++i)
+        checksum ^= frame[i];
+    frame[frame.size() - 1] = checksum;
+
+    return frame;
+}
+
+
+/* Runtime counterpart of MakeMessage for messages whose id and data are
+ * only known at run time, e.g. data pages. Builds a frame of N data bytes:
+ * the channel byte, then size bytes of data padded with zeros.
+ */
+template <size_t N>
+inline std::array<uint8_t, N + 4> BuildMessage(uint8_t id, uint8_t channel, const uint8_t *data, size_t size)
+{
+    static_assert(N >= 1 && N <= ant::MAX_DATA_LENGTH, "ANT message data does not fit");
+
+    std::array<uint8_t, N + 4> frame {};
+    frame[0] = static_cast<uint8_t>(ant::SYNC_BYTE);
+    frame[1] = static_cast<uint8_t>(N);
+    frame[2] = id;
+    frame[3] = channel;
+    std::memcpy(&frame[4], data, std::min(size, N - 1));
+
+    uint8_t checksum = 0;
+    for (size_t i = 0; i + 1 < frame.size(); ++i)
+        checksum ^= frame[i];
+    frame[N + 3] = checksum;
+
+    return frame;
+}
+
+
 inline std::string MessageDump(const std::vector<uint8_t>& data)
 {
     std::stringstream dump;
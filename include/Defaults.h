@@ -21,6 +21,7 @@
 #pragma once
 
 #include <termios.h> // POSIX terminal control definitions
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 #include <bitset>
@@ -102,11 +103,51 @@ enum MessageId {
     RESPONSE_SERIAL_NUMBER = 0x61
 };
 
+// Codes of CHANNEL_RESPONSE messages. Byte 4 of the message is the id of
+// the command being answered, or 0x01 for channel events.
+enum ChannelEvent {
+    CHANNEL_EVENT = 0x01,
+
+    RESPONSE_NO_ERROR = 0x00,
+    EVENT_RX_SEARCH_TIMEOUT = 0x01,
+    EVENT_RX_FAIL = 0x02,
+    EVENT_TX = 0x03,
+    EVENT_TRANSFER_RX_FAILED = 0x04,
+    EVENT_TRANSFER_TX_COMPLETED = 0x05,
+    EVENT_TRANSFER_TX_FAILED = 0x06,
+    EVENT_CHANNEL_CLOSED = 0x07,
+    EVENT_RX_FAIL_GO_TO_SEARCH = 0x08,
+    EVENT_CHANNEL_COLLISION = 0x09,
+    EVENT_TRANSFER_TX_START = 0x0A,
+    CHANNEL_IN_WRONG_STATE = 0x15,
+    CHANNEL_NOT_OPENED = 0x16,
+    CHANNEL_ID_NOT_SET = 0x18,
+    CLOSE_ALL_CHANNELS = 0x19,
+    TRANSFER_IN_PROGRESS = 0x1F,
+    TRANSFER_SEQUENCE_NUMBER_ERROR = 0x20,
+    TRANSFER_IN_ERROR = 0x21,
+    INVALID_MESSAGE = 0x28,
+    INVALID_NETWORK_NUMBER = 0x29,
+    INVALID_PARAMETER_PROVIDED = 0x33,
+    EVENT_SERIAL_QUE_OVERFLOW = 0x34,
+    EVENT_QUE_OVERFLOW = 0x35
+};
+
+// Optional fields of flagged extended data messages, in the order they
+// follow the flag byte. Enabled with LIB_CONFIG
+enum ExtendedFlags {
+    EXT_CHANNEL_ID = 0x80,   // Device number (2B), device type, trans type
+    EXT_RSSI = 0x40,         // Measurement type, RSSI (dBm), threshold
+    EXT_RX_TIMESTAMP = 0x20  // 1/32768 s counter (2B)
+};
+
 enum error_types {
     NO_ERROR = 0,
     NOT_CONNECTED,
     UNEXPECTED_MESSAGE,
     BAD_CHANNEL_RESPONSE,
+    TRANSFER_FAILED,
+    TIMEOUT,                 // The stick did not answer in time
     _ERROR_TYPES_COUNT
 };
 
@@ -123,8 +164,14 @@ enum ChannelType {
     UNIDIRECTIONAL_TRANSMIT_ONLY = 0x50
 };
 
+// Set in every ChannelType of a master channel
+const uint8_t TRANSMIT_DIRECTION = 0x10;
+
 const uint8_t Default_network = 0;
 
+// Longest data field of a message the USB sticks accept
+const size_t MAX_DATA_LENGTH = 41;
+
 const std::vector<uint8_t> AntPlusNetworkKey {
     Default_network, 0xB9, 0xA5, 0x21, 0xFB, 0xBD, 0x72, 0xC3, 0x45 };
 
@@ -24,8 +24,25 @@ class Device {
 public:
     virtual bool Read(std::vector<uint8_t> &) = 0;
     virtual bool Write(std::vector<uint8_t> const &) = 0;
+    // Writes a complete frame. The default implementation copies it into a
+    // vector, devices override it to write without allocating
+    virtual bool Write(const uint8_t *data, size_t size) {
+        return Write(std::vector<uint8_t>(data, data + size));
+    }
+    template <size_t N>
+    bool Write(std::array<uint8_t, N> const &frame) { return Write(frame.data(), N); }
     virtual bool Connect() = 0;
+    // Turns false when the device goes away, e.g. an unplugged stick
     virtual bool IsConnected() = 0;
     virtual bool Disconnect() = 0;
+    // Waits until everything written has been passed on to the device
+    virtual bool Drain() { return true; }
+    // Identifies the device across runs (e.g. the tty node), empty if unknown
+    virtual std::string Path() const { return std::string(); }
+    // Pollable file descriptor of the device, -1 if there is none
+    virtual int Handle() { return -1; }
+    // True if Read waits for data which is not there yet. Callers which must
+    // not wait check readiness of Handle() first
+    virtual bool ReadMayBlock() const { return false; }
     virtual ~Device() {}
 };
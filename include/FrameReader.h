@@ -0,0 +1,111 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Defaults.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* View of one complete ANT frame (SYNC | LEN | ID | DATA | CHK) stored in
+ * the ring buffer of a FrameReader. A frame may wrap around the end of the
+ * ring, so it is described by up to two contiguous parts. The view stays
+ * valid until the next FrameReader::Write call.
+ */
+struct FrameView {
+    const uint8_t *first = nullptr;
+    size_t first_size = 0;
+    const uint8_t *second = nullptr;
+    size_t second_size = 0;
+
+    size_t Size() const { return first_size + second_size; }
+    uint8_t operator[](size_t index) const {
+        return index < first_size ? first[index] : second[index - first_size];
+    }
+    uint8_t Length() const { return (*this)[1]; }
+    uint8_t Id() const { return (*this)[2]; }
+
+    void CopyTo(std::vector<uint8_t> &message) const;
+    void CopyTo(uint8_t *dest) const;
+};
+
+
+// Counters of a FrameReader, see FrameReader::Stats
+struct FrameStats {
+    uint64_t frames = 0;
+    // Sync bytes which did not start a frame: implausible length or bad checksum
+    uint64_t corrupt_frames = 0;
+    // Bytes dropped while searching for the next frame
+    uint64_t dropped_bytes = 0;
+};
+
+
+/* Fixed capacity ring buffer which accumulates raw bytes read from a device
+ * and splits them into ANT frames without shifting or reallocating memory.
+ * Every frame is validated: a sync byte followed by an implausible length or
+ * a bad checksum is skipped on its own, so a good frame right behind a
+ * corrupted one is not lost.
+ */
+class FrameReader {
+public:
+    // Must be a power of two, and big enough to hold a few maximal frames
+    static constexpr size_t CAPACITY = 4096;
+    // SYNC + LEN + ID + CHK
+    static constexpr size_t FRAME_OVERHEAD = 4;
+    static constexpr size_t MAX_FRAME_SIZE = ant::MAX_DATA_LENGTH + FRAME_OVERHEAD;
+
+    size_t Size() const { return tail_ - head_; }
+    size_t FreeSpace() const { return CAPACITY - Size(); }
+    void Clear() { head_ = tail_ = 0; }
+
+    // Appends as many bytes as fit, returns the number of bytes stored
+    size_t Write(const uint8_t *data, size_t size);
+    // Pops the next complete valid frame, skipping garbage and corrupt frames
+    bool Next(FrameView &frame);
+    // Same as Next for up to max_frames frames in one vectorised pass over
+    // the buffered bytes. All views stay valid until the next Write
+    size_t NextBatch(FrameView *frames, size_t max_frames);
+
+    // May be called from any thread
+    FrameStats Stats() const;
+
+private:
+    static constexpr size_t MASK = CAPACITY - 1;
+    static_assert((CAPACITY & MASK) == 0, "FrameReader::CAPACITY must be a power of two");
+
+    uint8_t at(size_t offset) const { return buffer_[(head_ + offset) & MASK]; }
+    void skip_to_sync();
+    // Counters have a single writer, a plain load and store avoids the
+    // locked instruction of fetch_add
+    static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::array<uint8_t, CAPACITY> buffer_ {};
+    // Free running positions, the ring index is position & MASK
+    size_t head_ = 0;
+    size_t tail_ = 0;
+
+    std::atomic<uint64_t> frames_ {0};
+    std::atomic<uint64_t> corrupt_frames_ {0};
+    std::atomic<uint64_t> dropped_bytes_ {0};
+};
@@ -0,0 +1,55 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* Vectorised helpers for draining large blocks of received bytes. The
+ * implementation is selected once at run time: AVX2 or SSE2 on x86-64 and
+ * a portable scalar version everywhere else.
+ */
+namespace FrameScanner {
+
+// Position of a validated frame inside the scanned block
+struct FrameOffset {
+    uint32_t offset;
+    uint8_t size;
+};
+
+// Stores offsets of every SYNC_BYTE in data, returns how many were found
+size_t FindSync(const uint8_t *data, size_t size, uint32_t *positions, size_t max_positions);
+
+// XOR of all bytes, zero for a frame with a correct checksum
+uint8_t Xor(const uint8_t *data, size_t size);
+// Same for a single frame, available bytes starting at frame may be read
+// (but do not have to be part of it), which allows a faster masked load
+uint8_t FrameXor(const uint8_t *frame, size_t size, size_t available);
+
+// Finds complete frames with plausible length and valid checksum in one
+// pass. consumed is set to the number of leading bytes which can be dropped:
+// everything up to the first incomplete candidate (or the end of the block).
+// rejected is incremented for every sync byte which did not start a frame
+size_t Scan(const uint8_t *data, size_t size, FrameOffset *frames, size_t max_frames,
+            size_t &consumed, size_t &rejected);
+
+// Name of the selected implementation: "avx2", "sse2" or "scalar"
+const char *Implementation();
+
+} // namespace FrameScanner
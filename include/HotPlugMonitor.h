@@ -0,0 +1,58 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+/* Reports device nodes appearing in and disappearing from a directory, using
+ * inotify. Nodes are selected by a name prefix like in StickPool::Discover,
+ * e.g. "/dev/ttyUSB". Symbolic links count as nodes too, so links to pseudo
+ * terminals can stand in for sticks.
+ *
+ * Handle() becomes readable when events are pending, Dispatch() then reads
+ * them without blocking and calls the callback on the calling thread.
+ */
+class HotPlugMonitor {
+public:
+    // present is false for a removed node. A node is also reported as
+    // present when its attributes change, udev sets the permissions only
+    // after creating it
+    using Callback = std::function<void (std::string const &path, bool present)>;
+
+    HotPlugMonitor() = default;
+    ~HotPlugMonitor();
+
+    HotPlugMonitor(HotPlugMonitor const &) = delete;
+    HotPlugMonitor &operator=(HotPlugMonitor const &) = delete;
+
+    bool Watch(std::string const &prefix, Callback callback);
+    void Stop();
+
+    // Pollable inotify descriptor, -1 when not watching
+    int Handle() const { return inotify_fd_; }
+    // Reads all pending events, returns the number of reported nodes
+    size_t Dispatch();
+
+private:
+    int inotify_fd_ = -1;
+    std::string directory_ {};
+    std::string name_prefix_ {};
+    Callback callback_ {};
+};
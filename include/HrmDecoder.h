@@ -0,0 +1,72 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Stick.h"
+
+#include <array>
+
+// Result of decoding a message which carries at least one new heart beat
+struct HeartBeat {
+    uint32_t device_key;      // ExtendedMessage::DeviceKey()
+    uint16_t device_number;
+    uint8_t heart_rate;       // Computed heart rate, BPM
+    uint8_t beats;            // New beats since the previous decoded message
+    uint32_t beat_count;      // Beats since the device was first seen
+    uint16_t event_time;      // Last heart beat event time, 1/1024 s
+    uint16_t rr_interval;     // Last R-R interval, 1/1024 s, 0 if unknown
+
+    double RrMilliseconds() const { return rr_interval * 1000.0 / 1024.0; }
+};
+
+
+/* Incremental decoder of the ANT+ HRM profile (device type 0x78).
+ *
+ * Keeps per-device state in a fixed size table, so decoding is O(1) and does
+ * not allocate. Output is produced only when the beat count advances.
+ */
+class HrmDecoder {
+public:
+    static constexpr size_t MAX_DEVICES = 256;
+
+    // Returns true and fills beat when the message carries a new heart beat
+    bool Decode(ExtendedMessage const &msg, HeartBeat &beat);
+    void Reset();
+
+private:
+    // Probed slots per key, the least recently used one is replaced when
+    // all of them belong to other devices
+    static constexpr size_t PROBE_LIMIT = 8;
+
+    struct DeviceState {
+        uint32_t key;
+        bool used;
+        bool toggle_seen;     // Page byte toggles, pages other than 0 are valid
+        uint8_t last_toggle;
+        uint8_t last_beat_count;
+        uint16_t last_event_time;
+        uint32_t beat_count;
+        uint64_t last_update;
+    };
+
+    DeviceState *find_state(uint32_t key, bool &created);
+
+    std::array<DeviceState, MAX_DEVICES> states_ {};
+    uint64_t updates_ = 0;
+};
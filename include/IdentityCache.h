@@ -0,0 +1,62 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// What a stick reports about itself, which does not change between runs
+struct StickIdentity {
+    std::string path;     // Device node, Device::Path
+    unsigned serial;
+    unsigned channels;
+    unsigned networks;
+    std::string version;
+};
+
+
+/* Identities of the sticks seen by previous runs, persisted in a text file
+ * with one stick per line:
+ *
+ *     <path> <serial> <channels> <networks> <version>
+ *
+ * Stick::WarmStart then only has to confirm the serial on the same path
+ * instead of requesting version and capabilities. All methods are thread
+ * safe, so one cache can serve a whole StickPool.
+ */
+class IdentityCache {
+public:
+    explicit IdentityCache(std::string const &path) : path_(path) {}
+
+    // Replaces the cached identities with the file content, a missing file
+    // is an empty cache
+    bool Load();
+    // Writes a temporary file and renames it over the cache file
+    bool Save();
+
+    bool Find(std::string const &device_path, StickIdentity &identity) const;
+    // Adds or replaces the identity of identity.path
+    void Record(StickIdentity const &identity);
+
+private:
+    std::string path_;
+    mutable std::mutex mutex_ {};
+    std::vector<StickIdentity> identities_ {};
+};
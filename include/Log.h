@@ -0,0 +1,234 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ios>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+// Log levels, ANT_LOG_LEVEL selects the lowest level compiled in. Calls
+// below it expand to nothing, so their arguments are never evaluated.
+#define ANT_LOG_LEVEL_TRACE 0 // Function entry and exit
+#define ANT_LOG_LEVEL_DEBUG 1 // Message dumps
+#define ANT_LOG_LEVEL_INFO  2
+#define ANT_LOG_LEVEL_ERROR 3
+#define ANT_LOG_LEVEL_NONE  4
+
+#ifndef ANT_LOG_LEVEL
+#define ANT_LOG_LEVEL ANT_LOG_LEVEL_INFO
+#endif
+
+/* Asynchronous logger. Callers fill a fixed size binary record and push it
+ * into a lock-free queue; a background thread formats and writes them.
+ * Function and file names are string literals, only pointers are stored.
+ * The thread sleeps while the queue is empty and is woken by the next push.
+ */
+namespace antlog {
+
+enum RecordType : uint8_t {
+    FUNC_ENTER,
+    FUNC_EXIT,
+    DUMP,
+    TEXT,
+    ERROR_TEXT
+};
+
+// Arguments of a TEXT or ERROR_TEXT record, each one is a tag byte
+// followed by its value
+enum ArgType : uint8_t {
+    ARG_LITERAL,  // Address of a string literal
+    ARG_STRING,   // Length byte and the characters
+    ARG_CHAR,
+    ARG_SIGNED,   // int64_t
+    ARG_UNSIGNED, // uint64_t
+    ARG_DOUBLE,
+    ARG_BASE      // Number base set by std::dec, std::hex or std::oct
+};
+
+struct Record {
+    static constexpr size_t DATA_SIZE = 160;
+
+    uint64_t timestamp_ns;
+    const char *func;
+    const char *file;
+    uint32_t line;
+    RecordType type;
+    uint8_t size;
+    bool truncated; // Arguments did not fit into data
+    uint8_t data[DATA_SIZE];
+};
+
+// Records are dropped (and counted) when the queue is full
+void Push(Record &record);
+void Text(RecordType type, const char *func, const char *file, unsigned line, std::string const &text);
+void Dump(const char *prefix, const uint8_t *data, size_t size);
+// Waits until every record pushed so far is written
+void Flush();
+
+
+/* Fills a TEXT or ERROR_TEXT record with the arguments of LOG_MSG and
+ * LOG_ERR without formatting them. Numbers are stored in binary, constant
+ * character arrays are taken for string literals and only their address is
+ * stored, other strings (character buffers included) are copied. Types
+ * without a binary form are formatted right away. Arguments which do not fit end the message, it is then written
+ * with a truncation mark.
+ */
+class Writer {
+public:
+    Writer(RecordType type, const char *func, const char *file, unsigned line) {
+        record_.func = func;
+        record_.file = file;
+        record_.line = line;
+        record_.type = type;
+        record_.size = 0;
+        record_.truncated = false;
+    }
+
+    // String literals live as long as the program
+    template <size_t N>
+    Writer &operator<<(const char (&literal)[N]) {
+        const char *address = literal;
+        put(ARG_LITERAL, &address, sizeof(address));
+        return *this;
+    }
+
+    // A character buffer may change before the record is written
+    template <size_t N>
+    Writer &operator<<(char (&buffer)[N]) {
+        put_string(buffer, strnlen(buffer, N));
+        return *this;
+    }
+
+    template <typename T>
+    Writer &operator<<(T const &value) {
+        if constexpr (std::is_same<T, const char *>::value || std::is_same<T, char *>::value) {
+            put_string(value, std::strlen(value));
+        } else if constexpr (std::is_same<T, std::string>::value) {
+            put_string(value.data(), value.size());
+        } else if constexpr (std::is_same<T, char>::value || std::is_same<T, signed char>::value
+                             || std::is_same<T, unsigned char>::value) {
+            // Like a stream, uint8_t is written as a character
+            char c = static_cast<char>(value);
+            put(ARG_CHAR, &c, sizeof(c));
+        } else if constexpr (std::is_floating_point<T>::value) {
+            double number = value;
+            put(ARG_DOUBLE, &number, sizeof(number));
+        } else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) {
+            int64_t number = value;
+            put(ARG_SIGNED, &number, sizeof(number));
+        } else if constexpr (std::is_integral<T>::value) {
+            uint64_t number = value;
+            put(ARG_UNSIGNED, &number, sizeof(number));
+        } else if constexpr (std::is_enum<T>::value) {
+            int64_t number = static_cast<int64_t>(value);
+            put(ARG_SIGNED, &number, sizeof(number));
+        } else {
+            std::ostringstream stream;
+            stream << value;
+            std::string text = stream.str();
+            put_string(text.data(), text.size());
+        }
+        return *this;
+    }
+
+    // std::dec, std::hex and std::oct, other manipulators are ignored
+    Writer &operator<<(std::ios_base &(*manipulator)(std::ios_base &)) {
+        uint8_t base = manipulator == std::hex ? 16 : manipulator == std::oct ? 8 : 10;
+        if (manipulator == std::dec || base != 10)
+            put(ARG_BASE, &base, sizeof(base));
+        return *this;
+    }
+
+    void Push() { antlog::Push(record_); }
+
+private:
+    void put(ArgType type, const void *value, size_t size) {
+        size_t used = record_.size;
+        if (record_.truncated || used + 1 + size > Record::DATA_SIZE) {
+            record_.truncated = true;
+            return;
+        }
+        record_.data[used] = type;
+        std::memcpy(&record_.data[used + 1], value, size);
+        record_.size = static_cast<uint8_t>(used + 1 + size);
+    }
+
+    void put_string(const char *text, size_t size) {
+        size_t used = record_.size;
+        if (record_.truncated || used + 2 > Record::DATA_SIZE) {
+            record_.truncated = true;
+            return;
+        }
+        size_t room = Record::DATA_SIZE - used - 2;
+        if (size > room) {
+            size = room;
+            record_.truncated = true;
+        }
+        record_.data[used] = ARG_STRING;
+        record_.data[used + 1] = static_cast<uint8_t>(size);
+        std::memcpy(&record_.data[used + 2], text, size);
+        record_.size = static_cast<uint8_t>(used + 2 + size);
+    }
+
+    Record record_;
+};
+
+
+class FunctionScope {
+public:
+    FunctionScope(const char *func, const char *file, unsigned line);
+    ~FunctionScope();
+
+private:
+    const char *func_;
+};
+
+} // namespace antlog
+
+
+#if ANT_LOG_LEVEL <= ANT_LOG_LEVEL_TRACE
+#define LOG_FUNC antlog::FunctionScope lmsgo__(__func__, __FILE__, __LINE__);
+#else
+#define LOG_FUNC
+#endif
+
+#if ANT_LOG_LEVEL <= ANT_LOG_LEVEL_DEBUG
+#define LOG_DUMP_BYTES(prefix, data, size) antlog::Dump(prefix, data, size)
+#else
+#define LOG_DUMP_BYTES(prefix, data, size) do {} while (false)
+#endif
+#define LOG_DUMP(prefix, bytes) LOG_DUMP_BYTES(prefix, (bytes).data(), (bytes).size())
+
+#if ANT_LOG_LEVEL <= ANT_LOG_LEVEL_INFO
+#define LOG_MSG(msg) do { antlog::Writer lmsgw__(antlog::TEXT, __func__, __FILE__, __LINE__); \
+    lmsgw__ << msg; lmsgw__.Push(); } while (false)
+#else
+#define LOG_MSG(msg) do {} while (false)
+#endif
+
+#if ANT_LOG_LEVEL <= ANT_LOG_LEVEL_ERROR
+#define LOG_ERR(msg) do { antlog::Writer lmsgw__(antlog::ERROR_TEXT, __func__, __FILE__, __LINE__); \
+    lmsgw__ << msg; lmsgw__.Push(); } while (false)
+#else
+#define LOG_ERR(msg) do {} while (false)
+#endif
@@ -0,0 +1,251 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class Reactor;
+
+
+struct HistogramSnapshot {
+    std::vector<uint64_t> buckets;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    // Approximate value below which the given fraction (0..1) of samples lie
+    uint64_t Percentile(double fraction) const;
+    // Number of samples not larger than value (within the bucket precision)
+    uint64_t CountBelow(uint64_t value) const;
+};
+
+
+/* HDR style histogram: every power of two range is split into SUB_BUCKETS
+ * linear buckets, so the relative error stays below 1 / SUB_BUCKETS over the
+ * whole uint64_t range. Recording is lock free and can be done from any
+ * number of threads.
+ */
+class Histogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 4;
+    static constexpr unsigned SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr unsigned BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    void Record(uint64_t value) {
+        buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+    }
+    void Record(std::chrono::nanoseconds duration) {
+        Record(static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0)));
+    }
+
+    HistogramSnapshot Snapshot() const;
+
+    static unsigned BucketIndex(uint64_t value) {
+        if (value < SUB_BUCKETS)
+            return static_cast<unsigned>(value);
+        unsigned exponent = 63 - __builtin_clzll(value);
+        unsigned shift = exponent - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<unsigned>((value >> shift) - SUB_BUCKETS);
+    }
+    // Largest value which falls into the bucket
+    static uint64_t BucketLimit(unsigned index);
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets_ {};
+    std::atomic<uint64_t> count_ {0};
+    std::atomic<uint64_t> sum_ {0};
+};
+
+
+/* Fixed size lock free table of per key counters, used for frames per device.
+ * Keys are inserted with a CAS on the first use, once the table is full new
+ * keys are counted in Overflow(). Like the Metrics counters it has a single
+ * writer.
+ */
+class CounterTable {
+public:
+    static constexpr size_t CAPACITY = 256;
+
+    void Increment(uint32_t key);
+    std::vector<std::pair<uint32_t, uint64_t>> Snapshot() const;
+    uint64_t Overflow() const { return overflow_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t PROBE_LIMIT = 16;
+    static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+    struct Entry {
+        std::atomic<uint32_t> key {EMPTY};
+        std::atomic<uint64_t> count {0};
+    };
+
+    std::array<Entry, CAPACITY> entries_ {};
+    std::atomic<uint64_t> overflow_ {0};
+};
+
+
+struct MetricsSnapshot {
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+    uint64_t read_errors = 0;
+    uint64_t write_errors = 0;
+    uint64_t frames = 0;
+    uint64_t corrupt_frames = 0;
+    uint64_t dropped_bytes = 0;
+    uint64_t commands = 0;
+    uint64_t command_errors = 0;
+    uint64_t dropped_messages = 0;
+    uint64_t bursts_received = 0;
+    uint64_t burst_bytes_received = 0;
+    uint64_t burst_receive_errors = 0;
+    uint64_t bursts_sent = 0;
+    uint64_t burst_bytes_sent = 0;
+    uint64_t burst_send_errors = 0;
+    uint64_t tx_messages = 0;
+    uint64_t tx_repeats = 0;
+    uint64_t tx_acknowledged = 0;
+    uint64_t tx_ack_failures = 0;
+    uint64_t tx_errors = 0;
+    uint64_t disconnects = 0;
+    uint64_t reconnects = 0;
+    std::vector<std::pair<uint8_t, uint64_t>> channel_frames;
+    // Keyed by ExtendedMessage::DeviceKey
+    std::vector<std::pair<uint32_t, uint64_t>> device_frames;
+    uint64_t device_overflow = 0;
+    // Current depth of every delivery queue
+    std::vector<size_t> queue_depths;
+    // Phases of the last startup, ns
+    std::vector<std::pair<std::string, uint64_t>> startup;
+    // Nanoseconds
+    HistogramSnapshot command_round_trip;
+    HistogramSnapshot delivery_latency;
+    HistogramSnapshot radio_latency;
+    HistogramSnapshot burst_receive_time;
+    HistogramSnapshot burst_send_time;
+    HistogramSnapshot tx_jitter;
+    HistogramSnapshot reconnect_gap;
+};
+
+
+/* Instrumentation of one stick. Counters are relaxed atomics which can be
+ * read from any thread. They have a single writer, the thread reading the
+ * stick, so Add avoids the locked instruction of fetch_add. Histograms may
+ * be recorded from any thread.
+ */
+struct Metrics {
+    static constexpr size_t MAX_CHANNELS = 16;
+
+    std::atomic<uint64_t> bytes_read {0};
+    std::atomic<uint64_t> bytes_written {0};
+    std::atomic<uint64_t> read_errors {0};
+    std::atomic<uint64_t> write_errors {0};
+    std::atomic<uint64_t> commands {0};
+    std::atomic<uint64_t> command_errors {0};
+    std::atomic<uint64_t> bursts_received {0};
+    std::atomic<uint64_t> burst_bytes_received {0};
+    std::atomic<uint64_t> burst_receive_errors {0};
+    std::atomic<uint64_t> bursts_sent {0};
+    std::atomic<uint64_t> burst_bytes_sent {0};
+    std::atomic<uint64_t> burst_send_errors {0};
+    std::atomic<uint64_t> tx_messages {0};
+    // Transmit periods without a new payload, the stick repeated the last one
+    std::atomic<uint64_t> tx_repeats {0};
+    std::atomic<uint64_t> tx_acknowledged {0};
+    std::atomic<uint64_t> tx_ack_failures {0};
+    std::atomic<uint64_t> tx_errors {0};
+    // Device lost (unplugged) and brought back by Stick::Reconnect
+    std::atomic<uint64_t> disconnects {0};
+    std::atomic<uint64_t> reconnects {0};
+    std::array<std::atomic<uint64_t>, MAX_CHANNELS> channel_frames {};
+    CounterTable device_frames {};
+    // Write of a command to its response
+    Histogram command_round_trip {};
+    // Read from the device to the consumer (subscriber callback, pool reader),
+    // its count is the number of delivered messages
+    Histogram delivery_latency {};
+    // Stick RX timestamp to device read, above the fastest one (RxClock)
+    Histogram radio_latency {};
+    // First to last packet of a received burst, first packet written to the
+    // completion event of a sent one. With the byte counters they give the
+    // achieved throughput
+    Histogram burst_receive_time {};
+    Histogram burst_send_time {};
+    // Deviation of the EVENT_TX interval of master channels from the channel
+    // period, as seen when reading the stick
+    Histogram tx_jitter {};
+    // Last data read before the device was lost to the first data message
+    // after it was reconnected
+    Histogram reconnect_gap {};
+
+    static void Add(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    void CountFrame(uint8_t channel, uint32_t device_key) {
+        if (channel < MAX_CHANNELS)
+            Add(channel_frames[channel]);
+        device_frames.Increment(device_key);
+    }
+
+    // Fills the counters of this object, the caller adds framing and
+    // delivery queue state
+    void Fill(MetricsSnapshot &snapshot) const;
+};
+
+
+// Prometheus text exposition of the snapshots, one "stick" label per entry
+std::string PrometheusText(std::vector<MetricsSnapshot> const &sticks);
+
+
+/* Serves the Prometheus text format on a local Unix socket. Every connection
+ * gets a minimal HTTP/1.0 response and is closed, so the endpoint can be
+ * scraped with "curl --unix-socket <path> http://localhost/metrics".
+ */
+class MetricsServer {
+public:
+    using Provider = std::function<std::string()>;
+
+    explicit MetricsServer(Provider provider);
+    ~MetricsServer();
+
+    MetricsServer(MetricsServer const &) = delete;
+    MetricsServer &operator=(MetricsServer const &) = delete;
+
+    bool Start(std::string const &socket_path);
+    void Stop();
+
+private:
+    void on_connection();
+
+    Provider provider_;
+    std::string socket_path_ {};
+    int listen_fd_ = -1;
+    std::unique_ptr<Reactor> reactor_;
+    std::thread thread_ {};
+};
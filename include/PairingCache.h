@@ -0,0 +1,81 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Stick.h"
+
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A transmitter seen before and the channel parameters it was received with
+struct PairedDevice {
+    uint16_t device_number;
+    uint8_t device_type;
+    uint8_t trans_type;   // Upper nibble extends the device number to 20 bit
+    uint16_t period;
+    uint8_t frequency;
+    uint8_t network;
+    int64_t last_seen;    // Unix time, s
+
+    uint32_t Key() const {
+        return (uint32_t)device_type << 24 | (uint32_t)trans_type << 16 | device_number;
+    }
+    // Exact channel id, so the channel pairs within one message period
+    ChannelConfig Config() const;
+};
+
+
+/* Transmitters paired before, persisted in a text file with one device per
+ * line:
+ *
+ *     <device type> <device number> <trans type> <period> <frequency> <network> <last seen>
+ *
+ * Stick::Init opens channels with their exact ids instead of waiting for a
+ * wildcard search to find them again. The cache may be shared by several
+ * sticks, all methods are thread safe.
+ */
+class PairingCache {
+public:
+    static constexpr size_t MAX_DEVICES = 1024;
+
+    explicit PairingCache(std::string const &path) : path_(path) {}
+
+    // Replaces the cached devices with the file content, a missing file
+    // is an empty cache
+    bool Load();
+    // Writes a temporary file and renames it over the cache file
+    bool Save();
+
+    // Adds or refreshes a device, the oldest one is dropped when full
+    void Record(PairedDevice const &device);
+    bool Forget(uint32_t key);
+    // Drops devices not seen for max_age seconds
+    size_t Expire(int64_t max_age, int64_t now = std::time(nullptr));
+    // Most recently seen first, at most max_count of them
+    std::vector<PairedDevice> Recent(size_t max_count = MAX_DEVICES) const;
+    size_t Size() const;
+
+private:
+    std::string path_;
+    mutable std::mutex mutex_ {};
+    std::vector<PairedDevice> devices_ {};
+};
@@ -0,0 +1,72 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/* Minimal epoll based event loop. File descriptors are registered together
+ * with a callback which is invoked each time the descriptor becomes
+ * readable. Periodic timers are backed by timerfd, so one thread can serve
+ * many sticks and timers at once.
+ */
+class Reactor {
+public:
+    using Callback = std::function<void()>;
+
+    Reactor();
+    ~Reactor();
+
+    Reactor(Reactor const &) = delete;
+    Reactor &operator=(Reactor const &) = delete;
+
+    bool Add(int fd, Callback on_readable);
+    bool Remove(int fd);
+    // Returns the timer descriptor (to be passed to Remove) or -1 on error
+    int AddTimer(unsigned interval_ms, Callback on_timer);
+
+    // Waits for events once and dispatches them, returns false on error
+    bool RunOnce(int timeout_ms = -1);
+    // Dispatches events until Stop is called
+    void Run();
+    // Can be called from any thread
+    void Stop();
+    // Runs the callback once on the reactor thread, can be called from any
+    // thread
+    void Post(Callback callback);
+
+private:
+    struct Handler {
+        Callback callback;
+        bool timer;
+    };
+
+    bool add(int fd, Callback callback, bool timer);
+    void wake_up();
+
+    int epoll_fd_ = -1;
+    int wakeup_fd_ = -1;
+    std::atomic<bool> stop_requested_ {false};
+    std::unordered_map<int, Handler> handlers_ {};
+    std::mutex posted_mutex_ {};
+    std::vector<Callback> posted_ {};
+};
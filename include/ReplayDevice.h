@@ -0,0 +1,89 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Device.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+/* Device which replays recorded traffic instead of talking to a stick.
+ *
+ * Requests written by Stick are answered from a script: every known request
+ * (matched byte by byte) queues its recorded responses. Unknown
+ * configuration commands are acknowledged with RESPONSE_NO_ERROR. When no
+ * response is pending, Read returns the recorded data stream, either paced
+ * at frame_period or as fast as the caller can read it.
+ */
+class ReplayDevice: public Device {
+public:
+    enum Mode {
+        REAL_TIME,
+        UNTHROTTLED
+    };
+
+    explicit ReplayDevice(Mode mode = UNTHROTTLED) : mode_(mode) {};
+
+    // Loads "Write: 0xa4 ..." / "Read: 0xa4 ..." lines of a text log as the
+    // command script and the "Channel:N Payload: ..." lines printed by the
+    // sample application as the data stream
+    bool LoadLog(std::string const &path);
+    void AddResponse(std::vector<uint8_t> const &request, std::vector<uint8_t> const &response);
+    void AddFrame(std::vector<uint8_t> const &frame);
+
+    // Number of times the stream is replayed, 0 - forever
+    void SetLoops(unsigned loops) { loops_ = loops; }
+    // Delay between two stream frames in REAL_TIME mode
+    void SetFramePeriod(std::chrono::nanoseconds period) { frame_period_ = period; }
+    // Upper bound of bytes returned by one Read, small values fragment frames
+    void SetChunkSize(size_t chunk_size) { chunk_size_ = chunk_size; }
+
+    uint64_t FramesReplayed() const { return frames_replayed_; }
+    size_t StreamSize() const { return stream_.size(); }
+
+    using Device::Write;
+
+    virtual bool Read(std::vector<uint8_t> &) override;
+    virtual bool Write(std::vector<uint8_t> const &) override;
+    virtual bool Connect() override;
+    virtual bool IsConnected() override { return connected_; }
+    virtual bool Disconnect() override;
+
+private:
+    bool next_stream_frame(std::vector<uint8_t> &buff);
+
+    Mode mode_;
+    bool connected_ = false;
+
+    std::map<std::vector<uint8_t>, std::vector<std::vector<uint8_t>>> script_ {};
+    std::deque<uint8_t> pending_ {};
+
+    std::vector<std::vector<uint8_t>> stream_ {};
+    size_t stream_pos_ = 0;
+    unsigned loops_ = 1;
+    unsigned loop_ = 0;
+    uint64_t frames_replayed_ = 0;
+
+    std::chrono::nanoseconds frame_period_ {std::chrono::nanoseconds(1000000000LL * HRM::CHANNEL_PERIOD / 32768)};
+    std::chrono::steady_clock::time_point next_frame_time_ {};
+    size_t chunk_size_ = 4096;
+};
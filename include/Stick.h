@@ -20,11 +20,28 @@
 
 #pragma once
 
+#include "Burst.h"
 #include "Defaults.h"
 #include "Device.h"
+#include "FrameReader.h"
+#include "Metrics.h"
+#include "TxScheduler.h"
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <memory>
 #include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+class CaptureWriter;
+class IdentityCache;
+class PairingCache;
 
 struct ExtendedMessage {
     uint8_t channel_number;
@@ -32,42 +49,376 @@ struct ExtendedMessage {
     uint16_t device_number;
     uint8_t device_type;
     uint8_t trans_type;
+    // ant::ExtendedFlags present in the message, fields of absent ones are 0
+    uint8_t flags;
+    int8_t rssi;            // dBm
+    int8_t rssi_threshold;  // dBm
+    uint16_t rx_timestamp;  // Stick clock, 1/32768 s, wraps every 2 s
+
+    // Identifies the transmitter, in scan mode all messages share channel 0
+    uint32_t DeviceKey() const {
+        return (uint32_t)device_type << 24 | (uint32_t)trans_type << 16 | device_number;
+    }
+};
+
+/* Maps the RX timestamps of a stick to the host steady clock. The stick
+ * clock has an unknown epoch, so the offset between both clocks is taken as
+ * the smallest one seen recently and Latency() is the delay of a message on
+ * top of the fastest observed delivery. Offsets expire after a while to
+ * follow the drift of the stick crystal.
+ */
+class RxClock {
+public:
+    // Latency in ns of a message received at host time host_ns (steady clock)
+    uint64_t Latency(uint16_t rx_timestamp, uint64_t host_ns);
+    void Reset() { started_ = false; }
+
+private:
+    static constexpr uint64_t TICKS_PER_SECOND = 32768;
+    static constexpr uint64_t WINDOW_NS = 10000000000ULL;
+
+    bool started_ = false;
+    uint16_t last_timestamp_ = 0;
+    uint64_t last_host_ns_ = 0;
+    uint64_t ticks_ = 0;
+    // Minimum host minus stick time of the current and the previous window
+    int64_t min_offset_ = 0;
+    int64_t previous_min_offset_ = 0;
+    uint64_t window_start_ns_ = 0;
+};
+
+
+// Selects the messages delivered to a subscriber, zero fields match anything
+struct MessageFilter {
+    uint8_t device_type = 0;
+    uint16_t device_number = 0;
+
+    bool Matches(ExtendedMessage const &msg) const {
+        return (device_type == 0 || device_type == msg.device_type) &&
+               (device_number == 0 || device_number == msg.device_number);
+    }
+};
+
+struct ChannelConfig {
+    uint8_t device_type = HRM::ANT_DEVICE_TYPE;
+    uint32_t device_number = 0;  // 20 bit device number, 0 is a wildcard
+    uint8_t trans_type = 0;      // 0 is a wildcard
+    uint16_t period = HRM::CHANNEL_PERIOD;
+    uint8_t frequency = HRM::CHANNEL_FREQUENCY;
+    uint8_t search_timeout = HRM::SEARCH_TIMEOUT;
+    uint8_t network = ant::Default_network;
+    ant::ChannelType type = ant::BIDIRECTIONAL_RECEIVE;
+};
+
+
+// Time spent in each phase of bringing up a stick, ns
+struct StartupTimings {
+    uint64_t connect = 0;
+    uint64_t identify = 0;    // Serial, version and capabilities
+    uint64_t reset = 0;       // 0 when a warm start did not need it
+    uint64_t configure = 0;   // Network key, extended messages, state probing
+    uint64_t channels = 0;
+    bool warm = false;        // The stick was taken over without a reset
+
+    uint64_t Total() const { return connect + identify + reset + configure + channels; }
 };
 
 
 class Stick {
 public:
+    using MessageCallback = std::function<void (ExtendedMessage const &)>;
+    using BurstCallback = std::function<void (uint8_t channel_number, const uint8_t *data, size_t size)>;
+    using TxCallback = std::function<void (uint8_t channel_number, uint32_t tag, bool acknowledged)>;
+
+    Stick();
+    ~Stick();
 
     void AttachDevice(std::unique_ptr<Device> && device);
     bool Connect();
     bool Reset();
     bool Init();
+    // Alternative to Init: continuous RX scan mode. Channel 0 receives from
+    // every transmitter in range, the other channels cannot be used
+    bool InitScanMode(ChannelConfig const &config = ChannelConfig {});
+    // ant::ExtendedFlags requested from the stick by Init and InitScanMode,
+    // EXT_CHANNEL_ID by default
+    void SetExtendedFlags(uint8_t flags) { extended_flags_ = flags; }
+    // Set before Init: it then opens channels with the exact ids of the most
+    // recently seen cached devices and keeps them out of the wildcard search.
+    // Devices found on any channel are recorded in the cache
+    void SetPairingCache(std::shared_ptr<PairingCache> cache) { pairing_cache_ = std::move(cache); }
+    // Set before Connect: identities are recorded in the cache, WarmStart
+    // reuses them after checking the serial
+    void SetIdentityCache(std::shared_ptr<IdentityCache> cache) { identity_cache_ = std::move(cache); }
+
+    // Connect, Reset and Init in one go, reusing what a previous run left
+    // behind. Channels the stick still has open are taken over as they are,
+    // so they keep tracking their sensors, and a reset is only done when the
+    // state of the stick cannot be probed
+    bool WarmStart();
+    // Phases of the last Connect/Reset/Init sequence or WarmStart
+    StartupTimings const &Timings() const { return timings_; }
+
+    // False once the device went away (e.g. the stick was unplugged), which
+    // is noticed when reading it fails
+    bool IsConnected() { return device_ && !lost_ && device_->IsConnected(); }
+    // Closes the device after it disappeared without a read noticing it
+    void DeviceLost();
+    // Connects a lost device again, brings the stick up like WarmStart and
+    // reopens the channels which were open before, wildcard channels search
+    // again unless the stick still tracks their device. Must be called by
+    // the thread reading the stick, returns false while the device is not
+    // back or not all of the channels are open again. The next call retries
+    // the missing ones
+    bool Reconnect();
+    // Device node of the attached device, empty if unknown
+    std::string Path() const { return device_ ? device_->Path() : std::string(); }
+
+    // Assigns, configures and opens the first free channel,
+    // returns its number or -1 on failure
+    int OpenChannel(ChannelConfig const &config);
+    bool CloseChannel(uint8_t channel_number);
+    bool IsChannelOpen(uint8_t channel_number) const;
+    unsigned Channels() const { return channels_; }
+    unsigned Networks() const { return networks_; }
+    unsigned FreeChannels() const;
     bool ReadNextMessage(std::vector<uint8_t> &);
     bool ReadExtendedMsg(ExtendedMessage &);
 
+    // Non-blocking variants for reactor driven loops: they return buffered
+    // messages and whatever the device has ready, but never wait for input,
+    // not even on a blocking device
+    bool PollMessage(std::vector<uint8_t> &);
+    bool PollExtendedMsg(ExtendedMessage &);
+    // Waits for at least one data message, then drains all buffered ones
+    // without waiting again. Returns the number of messages in batch
+    size_t ReadExtendedBatch(std::vector<ExtendedMessage> &batch, size_t max_size);
+    // Waits until the device has input or timeout_ms expires (< 0 - forever),
+    // devices without a pollable descriptor are always reported ready
+    bool WaitInput(int timeout_ms);
+    // Pollable descriptor of the attached device, -1 if there is none
+    int Handle() { return device_ ? device_->Handle() : -1; }
+    // Received, corrupt and dropped data counters of the serial stream
+    FrameStats FramingStats() const { return framer_.Stats(); }
+    // Consistent copy of all counters, may be called from any thread
+    MetricsSnapshot Snapshot() const;
+    // For consumers outside of Stick which record the delivery latency
+    Metrics &Instruments() { return metrics_; }
+
+    // Calls callback for every matching message on a thread owned by the
+    // subscription. The first subscription starts the I/O thread of the stick,
+    // from then on the stick must not be read or configured directly until
+    // StopIo. Returns the subscription id or -1 on failure
+    int Subscribe(MessageFilter const &filter, MessageCallback callback);
+    // Must not be called from the callback of the same subscription
+    bool Unsubscribe(int id);
+    // Stops the I/O thread and all subscriptions
+    void StopIo();
+    // Messages lost because a subscriber could not keep up, or because too
+    // many arrived while waiting for the stick (see MAX_KEPT_MESSAGES)
+    uint64_t DroppedMessages() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Records every received data message into a binary capture (Capture.h),
+    // segment_records 0 selects the default segment size. Like channel
+    // configuration this must not race with the I/O thread
+    bool StartCapture(std::string const &base_path, size_t segment_records = 0,
+                      unsigned max_segments = 0);
+    void StopCapture();
+
+    // Called with every completed incoming burst by the thread reading the
+    // stick, data is only valid during the call. Set it before Subscribe
+    void SetBurstCallback(BurstCallback callback) { burst_callback_ = std::move(callback); }
+    // Sends data as a burst on an opened channel, the last packet is padded
+    // with zeros. Returns once the stick reports the end of the transfer,
+    // data messages received meanwhile are returned by the next reads.
+    // Like channel configuration this must not race with the I/O thread
+    ant::error SendBurst(uint8_t channel_number, const uint8_t *data, size_t size);
+
+    // Transmit channels (ChannelConfig::type with a TRANSMIT direction) hand
+    // the payload queued here to the stick at their next EVENT_TX, a newer
+    // payload replaces an unsent one. Without a new payload the stick repeats
+    // the last one. May be called from any thread, the events are served by
+    // the thread reading the stick. payload is 8 bytes
+    bool QueueBroadcast(uint8_t channel_number, const uint8_t *payload);
+    // Like QueueBroadcast, the outcome goes to the TX callback with tag
+    bool QueueAcknowledged(uint8_t channel_number, const uint8_t *payload, uint32_t tag = 0);
+    // Called by the thread reading the stick, set it before Subscribe
+    void SetTxCallback(TxCallback callback) { tx_callback_ = std::move(callback); }
+
 private:
-    ant::error do_command(const std::vector<uint8_t> &message,
+    struct Subscriber;
+    using SubscriberList = std::vector<std::shared_ptr<Subscriber>>;
+
+    ant::error init_stick();
+    // Connect and the stick part of WarmStart, without opening channels
+    bool warm_start(StartupTimings &timings);
+    bool open_scan_mode(ChannelConfig const &config);
+    // Serial, version and capabilities, recorded in the identity cache
+    ant::error identify();
+    // Network key and extended messages
+    ant::error configure_stick();
+    void reset_channel_state();
+    // Pairing cache channels and the wildcard search of Init, devices and
+    // searches which are already open are skipped
+    bool open_default_channels();
+    // Takes over the channels left open by a previous run and unassigns the
+    // ones which are not open. Needs channels_ and a clean channel state
+    ant::error adopt_channels(std::vector<uint8_t> const &states, bool &adopted);
+    // OpenChannel with up to MAX_EXCLUSIONS device keys the channel must not
+    // pair with
+    int open_configured_channel(ChannelConfig const &config, std::vector<uint32_t> const &exclusions);
+    // Tracks the device every channel pairs with, for Reconnect and the
+    // pairing cache
+    void record_pairing(ExtendedMessage const &ext_msg);
+    // Device key (see ExtendedMessage::DeviceKey) of an exact channel id
+    static uint32_t channel_key(ChannelConfig const &config);
+    void io_loop();
+    bool next_frame(FrameView &frame, bool wait = true);
+    // Moves pending or newly read bytes into framer_. Without wait the
+    // device is read at most once per device_read flag
+    bool fill_framer(bool wait, bool &device_read);
+    // Waits for the next frame until the deadline, ant::TIMEOUT when none
+    // came or ant::NOT_CONNECTED when the device went away
+    ant::error next_frame_until(FrameView &frame, std::chrono::steady_clock::time_point deadline);
+    // Appends buffered data messages using vectorised frame scanning,
+    // never waits for input
+    void poll_extended_batch(std::vector<ExtendedMessage> &batch, size_t max_size);
+    static bool parse_extended_msg(FrameView const &frame, ExtendedMessage &ext_msg);
+    // parse_extended_msg plus capture of the parsed message
+    bool decode_extended_msg(FrameView const &frame, ExtendedMessage &ext_msg);
+    // Burst packets and channel events, called for every non data message
+    void handle_channel_message(FrameView const &frame);
+    void handle_burst(FrameView const &frame);
+    void handle_channel_event(uint8_t channel_number, uint8_t event);
+    // Writes the pending payload of a transmit channel at its EVENT_TX
+    void serve_tx(uint8_t channel_number);
+    // Writes the pending payload if there is one, without ticking the channel
+    bool send_tx(uint8_t channel_number);
+    void finish_acknowledged(uint8_t channel_number, bool acknowledged);
+    // Data messages decoded while waiting for the end of a burst or for
+    // command responses are kept here, the read functions return them first
+    void keep_message(ExtendedMessage const &ext_msg);
+    bool take_kept_message(ExtendedMessage &ext_msg);
+    // Writes a BROADCAST, ACKNOWLEDGE or BURST_TRANSFER data message
+    bool write_data_message(uint8_t msg_id, uint8_t channel_byte, const uint8_t *payload, size_t size);
+    // Reads until the stick ends the outgoing burst of the channel, returns
+    // the event or response code, 0 on timeout
+    uint8_t wait_burst_end(uint8_t channel_number, int timeout_ms);
+    ant::error send_burst(uint8_t channel_number, const uint8_t *data, size_t size);
+    // Writes the command and waits for its response. Between begin_pipeline
+    // and end_pipeline commands are only written and registered in the
+    // in-flight table, end_pipeline collects all responses
+    ant::error do_command(const uint8_t *message, size_t size,
                           std::function<ant::error (const std::vector<uint8_t>&)> process,
                           uint8_t wait_response_message_type);
+    // Any contiguous frame: MakeMessage arrays or Message vectors
+    template <typename Frame>
+    ant::error do_command(Frame const &message,
+                          std::function<ant::error (const std::vector<uint8_t>&)> process,
+                          uint8_t wait_response_message_type) {
+        return do_command(message.data(), message.size(), std::move(process), wait_response_message_type);
+    }
+    ant::error wait_commands();
+    void begin_pipeline();
+    ant::error end_pipeline();
+    static uint16_t response_key(uint8_t channel, uint8_t msg_id);
+    static uint16_t response_key(const std::vector<uint8_t> &response);
     ant::error reset();
     ant::error query_info();
     ant::error get_serial(unsigned &serial);
     ant::error get_version(std::string &version);
     ant::error get_capabilities(unsigned &max_channels, unsigned &max_networks);
+    ant::error get_channel_status(uint8_t channel_number, uint8_t &status);
+    ant::error get_channel_id(uint8_t channel_number, ChannelConfig &config);
     ant::error check_channel_response(const std::vector<uint8_t> &response,
                                       uint8_t channel, uint8_t cmd, uint8_t status);
     ant::error set_network_key(std::vector<uint8_t> const &network_key);
-    ant::error set_extended_messages(bool enabled);
-    ant::error assign_channel(uint8_t channel_number, uint8_t network_key);
-    ant::error set_channel_id(uint8_t channel_number, uint32_t device_number, uint8_t device_type);
+    ant::error set_extended_messages(uint8_t flags);
+    ant::error assign_channel(uint8_t channel_number, uint8_t network_key,
+                              ant::ChannelType type = ant::BIDIRECTIONAL_RECEIVE);
+    ant::error set_channel_id(uint8_t channel_number, uint32_t device_number, uint8_t device_type,
+                              uint8_t trans_type = 0);
     ant::error configure_channel(uint8_t channel_number, uint32_t period, uint8_t timeout, uint8_t frequency);
+    ant::error set_channel_frequency(uint8_t channel_number, uint8_t frequency);
+    ant::error set_exclusion_list(uint8_t channel_number, std::vector<uint32_t> const &keys);
     ant::error open_channel(uint8_t channel_number);
+    ant::error open_rx_scan_mode();
+    ant::error close_channel(uint8_t channel_number);
+    ant::error unassign_channel(uint8_t channel_number);
+    ant::error wait_channel_event(uint8_t channel_number, uint8_t event);
 
 private:
+    // Bounded by the serial buffer of the stick
+    static constexpr size_t MAX_IN_FLIGHT_COMMANDS = 8;
+    static constexpr uint8_t NO_CHANNEL = 0xFF;
+    // Outgoing burst packets queued before waiting for the device to take them
+    static constexpr size_t BURST_WINDOW = 8;
+    // Inclusion/exclusion list size of the USB sticks
+    static constexpr size_t MAX_EXCLUSIONS = 4;
+    // About a second of a busy scan mode stick
+    static constexpr size_t MAX_KEPT_MESSAGES = 4096;
+    // Longest wait for a command response or channel event, a stick which
+    // does not answer must not block its reading thread forever
+    static constexpr int RESPONSE_TIMEOUT_MS = 2000;
+
     std::unique_ptr<Device> device_ {nullptr};
-    std::vector<uint8_t> stored_chunk_ {};
+    FrameReader framer_ {};
+    // Bytes read from the device which did not fit into framer_ yet
+    std::vector<uint8_t> read_chunk_ {};
+    size_t read_offset_ = 0;
     std::string version_ {};
     unsigned serial_ = 0;
     unsigned channels_ = 0;
     unsigned networks_ = 0;
+    // Configuration of every opened channel, indexed by channel number
+    std::vector<std::optional<ChannelConfig>> channel_configs_ {};
+    bool scan_mode_ = false;
+    // Commands waiting for a response, keyed by response_key
+    struct InFlightCommand {
+        std::function<ant::error (const std::vector<uint8_t>&)> check;
+        std::chrono::steady_clock::time_point sent;
+    };
+    std::map<uint16_t, InFlightCommand> in_flight_ {};
+    bool pipeline_ = false;
+    ant::error pipeline_status_ {};
+    std::unique_ptr<CaptureWriter> capture_ {};
+    Metrics metrics_ {};
+    uint8_t extended_flags_ = ant::EXT_CHANNEL_ID;
+    RxClock rx_clock_ {};
+    // Time of the last device read which returned data, steady clock ns
+    uint64_t read_time_ = 0;
+    std::array<BurstAssembler, BURST_CHANNEL_MASK + 1> bursts_ {};
+    // Channel of the outgoing burst in progress
+    uint8_t burst_channel_ = NO_CHANNEL;
+    std::deque<ExtendedMessage> kept_messages_ {};
+    BurstCallback burst_callback_ {};
+    TxScheduler tx_ {};
+    TxCallback tx_callback_ {};
+    std::shared_ptr<PairingCache> pairing_cache_ {};
+    std::shared_ptr<IdentityCache> identity_cache_ {};
+    StartupTimings timings_ {};
+    bool lost_ = false;
+    // Last data read before the device was lost, steady clock ns, until
+    // data arrives after Reconnect
+    uint64_t lost_since_ = 0;
+    // Channels open when the device was lost, reopened by Reconnect. key is
+    // the channel id of an exact channel or the device a wildcard channel had
+    // paired with, 0 if none
+    struct ReplayChannel {
+        ChannelConfig config;
+        uint32_t key;
+    };
+    std::vector<ReplayChannel> replay_ {};
+    bool replay_scan_mode_ = false;
+    // Device key each channel last received from, to record pairings once
+    std::array<uint32_t, BURST_CHANNEL_MASK + 1> paired_keys_ {};
+
+    // Copy on write: the I/O thread takes a snapshot for every batch of
+    // messages, Subscribe and Unsubscribe publish a new list
+    std::shared_ptr<const SubscriberList> subscribers_ {std::make_shared<SubscriberList>()};
+    std::mutex subscribers_mutex_ {};
+    int next_subscriber_id_ = 0;
+    std::thread io_thread_ {};
+    std::atomic<bool> io_running_ {false};
+    std::atomic<uint64_t> dropped_ {0};
 };
@@ -0,0 +1,187 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Defaults.h"
+#include "FrameReader.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Simulated transmitters, all of them send HRM data pages
+struct EmulatedDevices {
+    size_t count = 1000;
+    uint16_t first_device_number = 1;
+    uint8_t device_type = HRM::ANT_DEVICE_TYPE;
+    uint8_t trans_type = 1;
+    uint16_t period = HRM::CHANNEL_PERIOD;  // 1/32768 s
+    uint32_t seed = 1;                      // Phases and heart rates
+};
+
+// Probabilities (0..1) of the faults injected by StickEmulator
+struct EmulatorFaults {
+    double corrupt_frame = 0;     // A data frame gets a bad checksum
+    double lost_message = 0;      // A broadcast is not received (EVENT_RX_FAIL)
+    double garbage = 0;           // Random bytes before a data frame
+    double command_error = 0;     // A command is answered with an error code
+    double lost_response = 0;     // A command is not answered at all
+    double failed_ack = 0;        // Acknowledged data gets EVENT_TRANSFER_TX_FAILED
+    size_t max_write = 0;         // Bytes per write to the pty, 0 - all at once
+};
+
+struct EmulatorStats {
+    uint64_t commands = 0;
+    uint64_t data_frames = 0;     // Broadcasts delivered to the host
+    uint64_t bytes_written = 0;
+    uint64_t overflows = 0;       // Frames dropped because the host did not read
+    uint64_t faults = 0;          // Injected faults of any kind
+};
+
+
+/* Pretends to be an ANT USB stick behind a pseudo terminal, so a
+ * TtyUsbDevice opens it like the real thing (optionally through a symbolic
+ * link, e.g. for StickPool::Discover and HotPlugMonitor).
+ *
+ * It answers the commands Stick sends: reset, serial, version,
+ * capabilities, channel status and id requests, channel configuration with
+ * exclusion lists, scan mode, and transmit (master) channels with EVENT_TX,
+ * acknowledged data and bursts. Its simulated devices broadcast at their
+ * period: every one of them to a scan mode channel, otherwise the first
+ * matching one to each receive channel. Nothing limits the pty to the baud
+ * rate of a real stick, so it also serves throughput tests.
+ *
+ * Everything runs on a thread of the emulator. Stop and Start again look to
+ * the host like unplugging and replugging: the pty goes away and the stick
+ * comes back without channels.
+ */
+class StickEmulator {
+public:
+    explicit StickEmulator(unsigned serial = 0x12345678, unsigned channels = 8, unsigned networks = 3)
+        : serial_(serial), channel_count_(channels), networks_(networks) {}
+    ~StickEmulator();
+
+    StickEmulator(StickEmulator const &) = delete;
+    StickEmulator &operator=(StickEmulator const &) = delete;
+
+    // Set before Start
+    void SetDevices(EmulatedDevices const &devices) { devices_config_ = devices; }
+    void SetFaults(EmulatorFaults const &faults) { faults_ = faults; }
+
+    // Creates the pty, and link_path pointing to it unless empty
+    bool Start(std::string const &link_path = std::string());
+    void Stop();
+
+    // The link if there is one, the pty otherwise
+    std::string Path() const { return link_path_.empty() ? pty_path_ : link_path_; }
+    // May be called from any thread
+    EmulatorStats Stats() const;
+
+private:
+    static constexpr size_t MAX_CHANNELS = 16;
+    static constexpr size_t MAX_EXCLUSIONS = 4;
+    // Output backlog while the host does not read, frames beyond it are lost
+    static constexpr size_t MAX_BACKLOG = 64 * 1024;
+    static constexpr uint64_t TICKS_PER_SECOND = 32768;
+
+    enum ChannelState { UNASSIGNED = 0, ASSIGNED = 1, SEARCHING = 2, TRACKING = 3 };
+
+    struct Channel {
+        ChannelState state = UNASSIGNED;
+        uint8_t type = 0;
+        uint8_t network = 0;
+        uint16_t device_number = 0;
+        uint8_t device_type = 0;
+        uint8_t trans_type = 0;
+        uint16_t period = HRM::CHANNEL_PERIOD;
+        std::array<uint32_t, MAX_EXCLUSIONS> list {};
+        uint8_t list_size = 0;
+        bool exclude = false;
+        size_t paired = 0;          // Device index + 1, 0 while searching
+        // Transmit channels
+        uint64_t next_tx = 0;
+        bool ack_pending = false;
+    };
+
+    struct Device {
+        uint16_t device_number;
+        uint8_t heart_rate;
+        uint8_t beat_count;
+        uint16_t event_time;
+        uint16_t previous_event_time;
+        uint64_t next_beat;         // ns
+        uint8_t messages;           // The page toggle bit flips every 4
+        int8_t rssi;
+    };
+
+    void run();
+    void reset_state();
+    void handle_command(FrameView const &frame);
+    void handle_request(uint8_t channel, uint8_t message);
+    void broadcast(size_t index, uint64_t now);
+    void serve_transmit(uint8_t channel, uint64_t now);
+    bool accepts(Channel const &channel, size_t index) const;
+    uint32_t device_key(size_t index) const;
+
+    // CHANNEL_RESPONSE to a command, or a channel event with CHANNEL_EVENT
+    void respond(uint8_t channel, uint8_t message, uint8_t code);
+    void emit(uint8_t id, const uint8_t *data, size_t size, bool data_frame = false);
+    void flush();
+    bool chance(double probability);
+
+    unsigned serial_;
+    unsigned channel_count_;
+    unsigned networks_;
+    EmulatedDevices devices_config_ {};
+    EmulatorFaults faults_ {};
+
+    std::string pty_path_ {};
+    std::string link_path_ {};
+    int master_fd_ = -1;
+    // Keeps the pty alive while the host has it closed
+    int slave_fd_ = -1;
+    std::thread thread_ {};
+    std::atomic<bool> running_ {false};
+
+    // Owned by the emulator thread
+    FrameReader commands_ {};
+    std::vector<uint8_t> out_ {};
+    std::array<Channel, MAX_CHANNELS> channels_ {};
+    bool scan_mode_ = false;
+    uint8_t extended_flags_ = 0;
+    std::vector<Device> devices_ {};
+    // Next broadcast time (ns) and device index, earliest first
+    using Due = std::pair<uint64_t, size_t>;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> schedule_ {};
+    std::mt19937 random_ {};
+    std::uniform_real_distribution<double> uniform_ {0.0, 1.0};
+
+    std::atomic<uint64_t> commands_count_ {0};
+    std::atomic<uint64_t> data_frames_ {0};
+    std::atomic<uint64_t> bytes_written_ {0};
+    std::atomic<uint64_t> overflows_ {0};
+    std::atomic<uint64_t> faults_count_ {0};
+};
@@ -0,0 +1,131 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "HotPlugMonitor.h"
+#include "Stick.h"
+#include "Reactor.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PoolMessage {
+    size_t stick;      // Index of the stick in the pool
+    uint64_t sequence; // Position in the merged stream
+    std::chrono::steady_clock::time_point received;
+    ExtendedMessage message;
+};
+
+
+/* Drives several ANT sticks from one process. All sticks are served by one
+ * shared Reactor thread and their extended messages are merged, in arrival
+ * order, into a single bounded queue.
+ *
+ * With WatchHotPlug a stick which is unplugged is reconnected as soon as its
+ * device node is back, and its channels are reopened. The handshake runs on a
+ * thread of its own, so a stick which does not answer does not stall the
+ * others.
+ */
+class StickPool {
+public:
+    static constexpr size_t DEFAULT_QUEUE_SIZE = 4096;
+
+    explicit StickPool(size_t max_queue_size = DEFAULT_QUEUE_SIZE) : max_queue_size_(max_queue_size) {};
+    ~StickPool();
+
+    // Attaches a non-blocking TtyUsbDevice for every "<prefix>N" device node,
+    // returns the number of sticks found
+    size_t Discover(std::string const &prefix = "/dev/ttyUSB");
+    void Add(std::unique_ptr<Stick> &&stick);
+
+    // Connects, resets and initialises all sticks concurrently, or brings
+    // them up with Stick::WarmStart. Returns how many are ready
+    size_t Init(bool warm = false);
+    // Opens a channel on the ready stick with most free channels. Must be
+    // called before Start, returns false when every stick is full
+    bool OpenChannel(ChannelConfig const &config, size_t &stick, uint8_t &channel);
+    // Reconnects lost sticks when their "<prefix>N" node reappears, call it
+    // before Start. Sticks which were not in the pool are ignored
+    bool WatchHotPlug(std::string const &prefix = "/dev/ttyUSB");
+    // Starts the reactor thread, sticks must not be used directly afterwards
+    bool Start();
+    void Stop();
+
+    // Pops the next merged message, timeout_ms < 0 waits forever
+    bool Read(PoolMessage &msg, int timeout_ms = -1);
+
+    size_t Size() const { return sticks_.size(); }
+    Stick &operator[](size_t index) { return *sticks_[index]; }
+    // May be called from any thread
+    uint64_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Metrics of every stick and of the merged queue in the Prometheus text
+    // format, suitable as a MetricsServer provider
+    std::string PrometheusText();
+
+private:
+    // Retry interval of a reconnect which failed although the node exists,
+    // e.g. before udev set its permissions
+    static constexpr unsigned RECONNECT_INTERVAL_MS = 200;
+
+    void on_readable(size_t index);
+    void on_hotplug(std::string const &path, bool present);
+    void on_lost(size_t index);
+    void reconnect(size_t index);
+    // Joins finished reconnect threads and polls the sticks which are back
+    void collect_reconnects();
+    void resume(size_t index);
+    void retry_reconnects();
+
+    // The lost stick belongs to this thread until finished is set
+    struct Reconnection {
+        std::thread thread {};
+        std::atomic<bool> finished {false};
+        bool connected = false;
+    };
+
+    std::vector<std::unique_ptr<Stick>> sticks_ {};
+    std::vector<bool> ready_ {};
+    // Descriptor registered in the reactor per stick, -1 while lost
+    std::vector<int> handles_ {};
+    // Lost sticks whose node is present but which could not be reconnected
+    std::vector<bool> pending_ {};
+    // Reconnect in progress per stick, nullptr if none
+    std::vector<std::unique_ptr<Reconnection>> reconnections_ {};
+
+    Reactor reactor_ {};
+    std::thread thread_ {};
+    HotPlugMonitor hotplug_ {};
+    int retry_timer_ = -1;
+
+    std::mutex mutex_ {};
+    std::condition_variable available_ {};
+    std::deque<PoolMessage> queue_ {};
+    size_t max_queue_size_;
+    uint64_t sequence_ = 0;
+    // Only the reactor thread writes it
+    std::atomic<uint64_t> dropped_ {0};
+};
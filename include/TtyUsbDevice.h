@@ -27,18 +27,40 @@ class TtyUsbDevice: public Device {
 public:
     TtyUsbDevice() : path_to_device_(DEFAULT_TTY_USB_FULL_PATH) {};
     TtyUsbDevice(std::string const & path_to_device) : path_to_device_(path_to_device) {};
+    // In non-blocking mode Read returns immediately with whatever is buffered,
+    // the caller is expected to wait for readiness of Handle() (e.g. in a Reactor)
+    TtyUsbDevice(std::string const & path_to_device, bool non_blocking)
+        : path_to_device_(path_to_device), non_blocking_(non_blocking) {};
+    using Device::Write;
+
     virtual bool Read(std::vector<uint8_t> &) override;
     virtual bool Write(std::vector<uint8_t> const &) override;
+    virtual bool Write(const uint8_t *data, size_t size) override;
+    virtual bool Drain() override;
     virtual bool Connect() override;
     virtual bool IsConnected() override { return connected_; }
     virtual bool Disconnect() override;
+    virtual int Handle() override { return connected_ ? tty_usb_file_ : -1; }
+    virtual bool ReadMayBlock() const override { return !non_blocking_; }
+    virtual std::string Path() const override { return path_to_device_; }
 
     virtual ~TtyUsbDevice() override;
 
 private:
+    // Closes the descriptor of an unplugged or hung up device, IsConnected
+    // turns false and Connect may open the node again
+    void lost(const char *operation, int error);
+    bool hung_up() const;
+    // Waits until a full output buffer takes data again
+    bool wait_writable();
+
+    // A stick which does not take data for this long is stuck
+    static constexpr int WRITE_TIMEOUT_MS = 1000;
+
     std::string path_to_device_;
     int device_baudrate_ = DEFAULT_TTY_USB_DEVICE_BAUDRATE;
     int tty_usb_file_ = 0;
     struct termios tty_ {};
     bool connected_ = false;
+    bool non_blocking_ = false;
 };
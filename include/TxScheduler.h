@@ -0,0 +1,75 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/* Keeps the next payload of every transmit (master) channel.
+ *
+ * A master channel sends the payload buffered in the stick every channel
+ * period and reports EVENT_TX, which is the moment to hand it the next one.
+ * Queue stores that next payload ahead of time, so serving an event is one
+ * write without waiting for anything. Queue may be called from any thread,
+ * the other methods belong to the thread reading the stick.
+ */
+class TxScheduler {
+public:
+    static constexpr size_t MAX_CHANNELS = 32;
+
+    struct Payload {
+        uint8_t data[8];
+        bool acknowledged;
+        uint32_t tag;       // Reported with the outcome of acknowledged data
+    };
+
+    // Channel period in 1/32768 s, as in ChannelConfig
+    void Open(uint8_t channel, uint16_t period);
+    void Close(uint8_t channel);
+    void Reset();
+    bool IsOpen(uint8_t channel);
+    // Replaces the pending payload, false if the channel is not open
+    bool Queue(uint8_t channel, Payload const &payload);
+
+    // A transmission slot of the channel passed at time (ns): EVENT_TX or the
+    // end of an acknowledged message. Returns the deviation from the channel
+    // period in ns, or -1 for the first slot of the channel
+    int64_t Tick(uint8_t channel, uint64_t time);
+    // Takes the pending payload, false if there is none or an acknowledged
+    // payload is still in flight
+    bool Take(uint8_t channel, Payload &payload);
+    // Ends the acknowledged payload in flight, false if there was none
+    bool Complete(uint8_t channel, uint32_t &tag);
+
+private:
+    struct Channel {
+        bool open;
+        bool pending;
+        bool ack_in_flight;
+        uint32_t ack_tag;
+        uint64_t period_ns;
+        uint64_t last_tick;
+        Payload next;
+    };
+
+    std::mutex mutex_ {};
+    std::array<Channel, MAX_CHANNELS> channels_ {};
+};
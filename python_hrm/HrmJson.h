@@ -0,0 +1,26 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+
+#include "Stick.h"
+
+// JSON document handed to the Python callback for every extended message
+inline std::string ExtendedMessageJson(ExtendedMessage const &msg)
+{
+    std::stringstream json;
+
+    json << "{" << std::endl
+         << "    \"Device\": " << static_cast<int>(msg.device_number) << "," << std::endl
+         << "    \"Payload\": [";
+
+    for (int indx = 0; indx < 8; ++indx)
+        json << "\"0x" << std::hex << (unsigned)msg.payload[indx] << "\",";
+
+    // Replace the latest ','
+    json.seekp(-1, std::ios_base::end);
+    json << "]" << std::endl
+         << "}";
+
+    return json.str();
+}
@@ -1,14 +1,278 @@
 #include <Python.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include "TtyUsbDevice.h"
 #include "Stick.h"
+#include "HrmDecoder.h"
+#include "HrmJson.h"
 
 static std::shared_ptr<Stick> stick_shared;
 
+
+// Message read by the native reader thread, with the decoded heart beat
+struct HrmRecord {
+    ExtendedMessage msg;
+    bool has_beat;
+    HeartBeat beat;
+};
+
+
+// Bounded queue between the reader thread and Python, new records are
+// dropped (and counted) while it is full. An eventfd is readable exactly
+// while the queue is not empty, so event loops can wait on it.
+class HrmRecordQueue {
+public:
+    HrmRecordQueue() : event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+    ~HrmRecordQueue() { if (event_fd_ >= 0) close(event_fd_); }
+
+    int EventFd() const { return event_fd_; }
+
+    void SetCapacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+    }
+
+    void Push(std::vector<HrmRecord> const &batch) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            bool was_empty = records_.empty();
+            for (auto const &record : batch) {
+                if (records_.size() >= capacity_) {
+                    ++dropped_;
+                    continue;
+                }
+                records_.push_back(record);
+            }
+            if (was_empty && !records_.empty())
+                signal(true);
+        }
+        available_.notify_all();
+    }
+
+    // Waits up to timeout_ms for the first record, then takes up to max_items
+    size_t Pop(std::vector<HrmRecord> &batch, size_t max_items, int timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        available_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return !records_.empty(); });
+
+        batch.clear();
+        while (!records_.empty() && batch.size() < max_items) {
+            batch.push_back(records_.front());
+            records_.pop_front();
+        }
+        if (!batch.empty() && records_.empty())
+            signal(false);
+
+        return batch.size();
+    }
+
+    uint64_t Dropped() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+    }
+
+private:
+    // Called with mutex_ held
+    void signal(bool readable) {
+        uint64_t value = 1;
+        ssize_t result = readable ? write(event_fd_, &value, sizeof(value))
+                                  : read(event_fd_, &value, sizeof(value));
+        (void)result;
+    }
+
+    int event_fd_;
+    std::mutex mutex_ {};
+    std::condition_variable available_ {};
+    std::deque<HrmRecord> records_ {};
+    size_t capacity_ = 4096;
+    uint64_t dropped_ = 0;
+};
+
+static HrmRecordQueue records;
+static std::thread reader_thread;
+static std::atomic<bool> reader_running {false};
+
+// Native reader: waits for the stick, decodes and queues messages in batches
+static void reader_loop()
+{
+    HrmDecoder decoder;
+    ExtendedMessage msg;
+    std::vector<HrmRecord> batch;
+
+    while (reader_running) {
+        if (!stick_shared->WaitInput(100))
+            continue;
+
+        batch.clear();
+        while (batch.size() < 256 && stick_shared->PollExtendedMsg(msg)) {
+            HrmRecord record {msg, false, {}};
+            record.has_beat = decoder.Decode(msg, record.beat);
+            batch.push_back(record);
+        }
+
+        if (!batch.empty())
+            records.Push(batch);
+    }
+}
+
+
+static bool start_reader(size_t max_queue)
+{
+    if (reader_running)
+        return true;
+
+    if (!stick_shared) {
+        PyErr_SetString(PyExc_RuntimeError, "Error: device is not attached.");
+        return false;
+    }
+
+    records.SetCapacity(max_queue);
+    reader_running = true;
+    reader_thread = std::thread(reader_loop);
+
+    return true;
+}
+
+
+// Joins the reader when the module is unloaded, a joinable std::thread
+// must not be destroyed
+static struct ReaderGuard {
+    ~ReaderGuard() {
+        reader_running = false;
+        if (reader_thread.joinable())
+            reader_thread.join();
+    }
+} reader_guard;
+
+
+static void stop_reader()
+{
+    if (!reader_running)
+        return;
+
+    reader_running = false;
+
+    Py_BEGIN_ALLOW_THREADS
+    reader_thread.join();
+    Py_END_ALLOW_THREADS
+}
+
+
+// Waits for a batch with the GIL released. The wait is sliced, so signals
+// (e.g. Ctrl+C) are handled. Returns false if a Python exception is set.
+static bool wait_records(std::vector<HrmRecord> &batch, size_t max_items, int timeout_ms)
+{
+    constexpr int SLICE_MS = 100;
+
+    for (;;) {
+        int slice = timeout_ms < 0 ? SLICE_MS : std::min(timeout_ms, SLICE_MS);
+        size_t count;
+
+        Py_BEGIN_ALLOW_THREADS
+        count = records.Pop(batch, max_items, slice);
+        Py_END_ALLOW_THREADS
+
+        if (count > 0)
+            return true;
+        if (PyErr_CheckSignals() != 0)
+            return false;
+        if (timeout_ms >= 0 && (timeout_ms -= slice) <= 0)
+            return true;
+    }
+}
+
+
+static PyStructSequence_Field MessageFields[] = {
+    {"channel", "Channel number"},
+    {"device_number", "Device number"},
+    {"device_type", "Device type"},
+    {"trans_type", "Transmission type"},
+    {"payload", "8 byte payload"},
+    {"heart_rate", "Computed heart rate, None if the message has no new beat"},
+    {"beat_count", "Beats since the device was first seen, None if no new beat"},
+    {"rr_interval_ms", "Last R-R interval in ms, None if unknown"},
+    {"rssi", "Signal strength in dBm, None if the stick does not report it"},
+    {nullptr, nullptr}
+};
+
+static PyStructSequence_Desc MessageDesc = {
+    "hrm.Message",
+    "Extended data message read from the ANT stick",
+    MessageFields,
+    8
+};
+
+static PyTypeObject *MessageType = nullptr;
+
+static PyObject* make_message(HrmRecord const &record)
+{
+    PyObject* message = PyStructSequence_New(MessageType);
+    if (message == nullptr)
+        return nullptr;
+
+    auto const &msg = record.msg;
+    PyStructSequence_SetItem(message, 0, PyLong_FromLong(msg.channel_number));
+    PyStructSequence_SetItem(message, 1, PyLong_FromLong(msg.device_number));
+    PyStructSequence_SetItem(message, 2, PyLong_FromLong(msg.device_type));
+    PyStructSequence_SetItem(message, 3, PyLong_FromLong(msg.trans_type));
+    PyStructSequence_SetItem(message, 4, PyBytes_FromStringAndSize(
+                                 reinterpret_cast<const char*>(msg.payload), sizeof(msg.payload)));
+
+    if (record.has_beat) {
+        PyStructSequence_SetItem(message, 5, PyLong_FromLong(record.beat.heart_rate));
+        PyStructSequence_SetItem(message, 6, PyLong_FromUnsignedLong(record.beat.beat_count));
+    } else {
+        Py_INCREF(Py_None);
+        PyStructSequence_SetItem(message, 5, Py_None);
+        Py_INCREF(Py_None);
+        PyStructSequence_SetItem(message, 6, Py_None);
+    }
+
+    if (record.has_beat && record.beat.rr_interval != 0) {
+        PyStructSequence_SetItem(message, 7, PyFloat_FromDouble(record.beat.RrMilliseconds()));
+    } else {
+        Py_INCREF(Py_None);
+        PyStructSequence_SetItem(message, 7, Py_None);
+    }
+
+    if (msg.flags & ant::EXT_RSSI) {
+        PyStructSequence_SetItem(message, 8, PyLong_FromLong(msg.rssi));
+    } else {
+        Py_INCREF(Py_None);
+        PyStructSequence_SetItem(message, 8, Py_None);
+    }
+
+    return message;
+}
+
+
+static PyObject* make_message_list(std::vector<HrmRecord> const &batch)
+{
+    PyObject* list = PyList_New(batch.size());
+    if (list == nullptr)
+        return nullptr;
+
+    for (size_t indx = 0; indx < batch.size(); ++indx) {
+        PyObject* message = make_message(batch[indx]);
+        if (message == nullptr) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        PyList_SET_ITEM(list, indx, message);
+    }
+
+    return list;
+}
+
 struct DLLInitialization
 {
 	DLLInitialization(){
@@ -34,6 +298,12 @@ DLLInitialization dllinit_hook;
 PyObject* attach(PyObject* self, PyObject* args);
 PyObject* init(PyObject* self, PyObject* args);
 PyObject* set_callback(PyObject* self, PyObject* args);
+PyObject* set_batch_callback(PyObject* self, PyObject* args);
+PyObject* start(PyObject* self, PyObject* args);
+PyObject* stop(PyObject* self, PyObject* args);
+PyObject* poll(PyObject* self, PyObject* args);
+PyObject* dropped(PyObject* self, PyObject* args);
+PyObject* fileno(PyObject* self, PyObject* args);
 
 static PyMethodDef ModuleFunctions [] =
 {
@@ -46,11 +316,86 @@ static PyMethodDef ModuleFunctions [] =
 	{"set_callback", set_callback, METH_VARARGS,
 	  "Call python object that has the __call__ method, set_callback arguments: attach(PyObject* pObj*)"},
 
+	{"set_batch_callback", set_batch_callback, METH_VARARGS,
+	  "Call python object with lists of hrm.Message until it returns False, arguments: set_batch_callback(callable, max_items=64)"},
+
+	{"start", start, METH_VARARGS,
+	  "Start the native reader thread, arguments: start(max_queue=4096)"},
+
+	{"stop", stop, METH_VARARGS,
+	  "Stop the native reader thread, arguments: stop()"},
+
+	{"poll", poll, METH_VARARGS,
+	  "Return a list of up to max_items hrm.Message, waiting up to timeout_ms (-1 forever) for the first one, arguments: poll(max_items=64, timeout_ms=-1)"},
+
+	{"dropped", dropped, METH_VARARGS,
+	  "Number of messages dropped because the queue was full, arguments: dropped()"},
+
+	{"fileno", fileno, METH_VARARGS,
+	  "Descriptor which is readable while poll() has messages, for select/epoll/asyncio, arguments: fileno()"},
+
 	// indicate the end of function listing.
 	{nullptr, nullptr, 0, nullptr}
 };
 
 
+// Fans messages out to every stream() of an event loop: one reader callback
+// on fileno() per loop, each stream owns a bounded asyncio.Queue (a slow
+// consumer loses its oldest messages, not the others).
+static const char AsyncioSource[] = R"PY(
+class _Hub:
+    def __init__(self, loop):
+        self.loop = loop
+        self.queues = set()
+
+    def subscribe(self, maxsize):
+        import asyncio
+        queue = asyncio.Queue(maxsize)
+        if not self.queues:
+            self.loop.add_reader(fileno(), self.on_readable)
+        self.queues.add(queue)
+        return queue
+
+    def unsubscribe(self, queue):
+        self.queues.discard(queue)
+        if not self.queues:
+            self.loop.remove_reader(fileno())
+
+    def on_readable(self):
+        batch = poll(256, 0)
+        for queue in self.queues:
+            for message in batch:
+                if queue.full():
+                    queue.get_nowait()
+                queue.put_nowait(message)
+
+_hubs = {}
+
+async def stream(device_number=None, maxsize=1024):
+    """Asynchronous iterator over hrm.Message, optionally of one device:
+
+        async for msg in hrm.stream():
+            ...
+    """
+    import asyncio
+    loop = asyncio.get_running_loop()
+    hub = _hubs.get(loop)
+    if hub is None:
+        hub = _hubs[loop] = _Hub(loop)
+    start()
+    queue = hub.subscribe(maxsize)
+    try:
+        while True:
+            message = await queue.get()
+            if device_number is None or message.device_number == device_number:
+                yield message
+    finally:
+        hub.unsubscribe(queue)
+        if not hub.queues:
+            del _hubs[loop]
+)PY";
+
+
 // Module definition
 static struct PyModuleDef ModuleDefinitions {
 	PyModuleDef_HEAD_INIT,
@@ -70,6 +415,21 @@ PyMODINIT_FUNC PyInit_hrm(void)
 	Py_Initialize();
 	PyObject* pModule = PyModule_Create(&ModuleDefinitions);
 	PyModule_AddObject(pModule, "version", Py_BuildValue("s", "version 0.1-Prototype"));
+
+	MessageType = PyStructSequence_NewType(&MessageDesc);
+	if (MessageType == nullptr)
+		return nullptr;
+	Py_INCREF(MessageType);
+	PyModule_AddObject(pModule, "Message", reinterpret_cast<PyObject*>(MessageType));
+
+	// asyncio helpers are plain Python, executed in the module namespace
+	PyObject* pDict = PyModule_GetDict(pModule);
+	PyDict_SetItemString(pDict, "__builtins__", PyEval_GetBuiltins());
+	PyObject* pResult = PyRun_String(AsyncioSource, Py_file_input, pDict, pDict);
+	if (pResult == nullptr)
+		return nullptr;
+	Py_DECREF(pResult);
+
 	return pModule;
 }
 
@@ -84,8 +444,10 @@ PyObject* attach(PyObject* self, PyObject* args)
 
     std::cout << "Attach Ant USB Stick: " << path_to_device << std::endl;
 
+    stop_reader();
+
     stick_shared = std::make_shared<Stick>();
-    stick_shared->AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(path_to_device)));
+    stick_shared->AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(path_to_device, true)));
 
     Py_RETURN_NONE;
 }
@@ -93,6 +455,9 @@ PyObject* attach(PyObject* self, PyObject* args)
 
 PyObject* init(PyObject* self, PyObject* args)
 {
+    // The reader thread must not read the stick while it is reset
+    stop_reader();
+
     if (!stick_shared->Connect())
         return Py_False;
 
@@ -116,41 +481,131 @@ PyObject* set_callback(PyObject* self, PyObject* args)
 		PyErr_SetString(PyExc_RuntimeError, "Error: invalid None object.");
 		return nullptr;
 	}
-	PyObject* pArgs  = nullptr;
-	PyObject* pResult = nullptr;
+	if (!start_reader(4096))
+		return nullptr;
+
+	std::vector<HrmRecord> batch;
 
     while (true) {
 
-        ExtendedMessage msg;
+        // One record at a time, whatever follows the last accepted message
+        // stays queued for the next consumer
+        if (!wait_records(batch, 1, -1))
+            return nullptr;
 
-        if (stick_shared->ReadExtendedMsg(msg)) {
+        for (auto const &record : batch) {
 
-            std::stringstream json;
+            PyObject* pResult = PyObject_CallFunction(pObj, "s", ExtendedMessageJson(record.msg).c_str());
 
-            json << "{" << std::endl
-                 << "    \"Device\": " << static_cast<int>(msg.device_number) << "," << std::endl
-                 << "    \"Payload\": [";
+            if (pResult == nullptr)
+                return nullptr;
 
-            for (int indx = 0; indx < 8; ++indx)
-                json << "\"0x" << std::hex << (unsigned)msg.payload[indx] << "\",";
+            bool stop = PyBool_Check(pResult) && pResult == Py_False;
+            Py_DECREF(pResult);
 
-            // Replace the latest ','
-            json.seekp(-1, std::ios_base::end);
-            json << "]" << std::endl
-                 << "}";
+            if (stop)
+                Py_RETURN_NONE;
+        }
+    }
+};
 
-            pArgs = Py_BuildValue("(s)", json.str().c_str());
-            pResult = PyObject_CallObject(pObj, pArgs);
 
-            if (PyBool_Check(pResult) && pResult == Py_False) break;
+PyObject* set_batch_callback(PyObject* self, PyObject* args)
+{
+    PyObject* pObj = nullptr;
+    Py_ssize_t max_items = 64;
+
+    if (!PyArg_ParseTuple(args, "O|n", &pObj, &max_items))
+        return nullptr;
+    if (max_items <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_items must be positive");
+        return nullptr;
+    }
+    if (!start_reader(4096))
+        return nullptr;
 
-            if(PyErr_Occurred() != nullptr){
-                PyErr_SetString(PyExc_RuntimeError, "Error: Invalid command.");
+    std::vector<HrmRecord> batch;
 
-                return nullptr;
-            }
-        }
+    while (true) {
+
+        if (!wait_records(batch, max_items, -1))
+            return nullptr;
+
+        PyObject* pList = make_message_list(batch);
+        if (pList == nullptr)
+            return nullptr;
+
+        PyObject* pResult = PyObject_CallFunctionObjArgs(pObj, pList, nullptr);
+        Py_DECREF(pList);
+
+        if (pResult == nullptr)
+            return nullptr;
+
+        bool stop = PyBool_Check(pResult) && pResult == Py_False;
+        Py_DECREF(pResult);
+
+        if (stop)
+            Py_RETURN_NONE;
     }
+}
+
+
+PyObject* start(PyObject* self, PyObject* args)
+{
+    Py_ssize_t max_queue = 4096;
+
+    if (!PyArg_ParseTuple(args, "|n", &max_queue))
+        return nullptr;
+    if (max_queue <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_queue must be positive");
+        return nullptr;
+    }
+    if (!start_reader(max_queue))
+        return nullptr;
 
     Py_RETURN_NONE;
-};
+}
+
+
+PyObject* stop(PyObject* self, PyObject* args)
+{
+    stop_reader();
+
+    Py_RETURN_NONE;
+}
+
+
+PyObject* poll(PyObject* self, PyObject* args)
+{
+    Py_ssize_t max_items = 64;
+    int timeout_ms = -1;
+
+    if (!PyArg_ParseTuple(args, "|ni", &max_items, &timeout_ms))
+        return nullptr;
+    if (max_items <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_items must be positive");
+        return nullptr;
+    }
+    if (!reader_running) {
+        PyErr_SetString(PyExc_RuntimeError, "Error: reader is not started.");
+        return nullptr;
+    }
+
+    std::vector<HrmRecord> batch;
+    if (!wait_records(batch, max_items, timeout_ms))
+        return nullptr;
+
+    return make_message_list(batch);
+}
+
+
+PyObject* dropped(PyObject* self, PyObject* args)
+{
+    return PyLong_FromUnsignedLongLong(records.Dropped());
+}
+
+
+PyObject* fileno(PyObject* self, PyObject* args)
+{
+    return PyLong_FromLong(records.EventFd());
+}
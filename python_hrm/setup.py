@@ -2,7 +2,7 @@ from distutils.core import setup, Extension
 
 hrm = Extension('hrm',
                 language = "c++",
-                sources = ['hrm.cpp', '../src/TtyUsbDevice.cpp', '../src/Stick.cpp'],
+                sources = ['hrm.cpp', '../src/TtyUsbDevice.cpp', '../src/Stick.cpp', '../src/Burst.cpp', '../src/Capture.cpp', '../src/FrameReader.cpp', '../src/FrameScanner.cpp', '../src/IdentityCache.cpp', '../src/Log.cpp', '../src/Metrics.cpp', '../src/PairingCache.cpp', '../src/Reactor.cpp', '../src/HrmDecoder.cpp', '../src/TxScheduler.cpp'],
                 extra_compile_args=["-std=c++17"],
                 include_dirs = ['../include'])
 
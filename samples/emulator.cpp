@@ -0,0 +1,102 @@
+#include <iostream>
+#include <chrono>
+#include <csignal>
+#include <thread>
+#include "HrmDecoder.h"
+#include "StickEmulator.h"
+#include "TtyUsbDevice.h"
+
+namespace {
+
+volatile std::sig_atomic_t interrupted = 0;
+
+void on_signal(int)
+{
+    interrupted = 1;
+}
+
+} // namespace
+
+// emulator [link] [devices] [seconds] [corrupt frame rate] [lost message rate]
+//
+// With seconds 0 the emulated stick is served until Ctrl-C, e.g. for
+// multi_stick. Otherwise a Stick in scan mode reads it for that long and
+// the received, decoded and corrupted messages are reported
+int main(int argc, char *argv[])
+{
+    std::string link = argc > 1 ? argv[1] : "/tmp/ttyANT0";
+
+    EmulatedDevices devices;
+    devices.count = argc > 2 ? std::stoul(argv[2]) : 1000;
+    unsigned seconds = argc > 3 ? std::stoul(argv[3]) : 0;
+
+    EmulatorFaults faults;
+    faults.corrupt_frame = argc > 4 ? std::stod(argv[4]) : 0;
+    faults.lost_message = argc > 5 ? std::stod(argv[5]) : 0;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    emulator.SetFaults(faults);
+
+    if (!emulator.Start(link)) {
+        std::cerr << "Cannot create " << link << std::endl;
+        return 1;
+    }
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    if (seconds == 0) {
+        while (!interrupted) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            auto stats = emulator.Stats();
+            std::cout << "Commands: " << stats.commands << " Data frames: " << stats.data_frames
+                      << " Overflows: " << stats.overflows << " Faults: " << stats.faults << std::endl;
+        }
+        return 0;
+    }
+
+    Stick stick = Stick();
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path())));
+
+    if (!stick.Connect() || !stick.Reset() || !stick.InitScanMode()) {
+        std::cerr << "Cannot initialise the emulated stick" << std::endl;
+        return 1;
+    }
+
+    HrmDecoder decoder;
+    std::vector<ExtendedMessage> batch;
+    uint64_t received = 0;
+    uint64_t beats = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::seconds(seconds);
+    uint64_t sent_before = emulator.Stats().data_frames;
+
+    while (!interrupted && std::chrono::steady_clock::now() < end) {
+        stick.ReadExtendedBatch(batch, 256);
+        received += batch.size();
+
+        HeartBeat beat;
+        for (auto const &msg : batch)
+            if (decoder.Decode(msg, beat))
+                beats += beat.beats;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    auto stats = emulator.Stats();
+    auto framing = stick.FramingStats();
+
+    std::cout << "Devices: " << devices.count
+              << " Seconds: " << elapsed.count()
+              << " Sent: " << stats.data_frames - sent_before
+              << " Received: " << received
+              << " Messages per second: " << (uint64_t)(received / elapsed.count())
+              << " Beats: " << beats
+              << " Corrupt frames: " << framing.corrupt_frames
+              << " Overflows: " << stats.overflows
+              << " Faults: " << stats.faults
+              << std::endl;
+
+    return 0;
+}
@@ -1,12 +1,20 @@
 #include <iostream>
 #include "TtyUsbDevice.h"
 #include "Stick.h"
+#include "HrmDecoder.h"
+#include "PairingCache.h"
 
 int main()
 {
     Stick stick = Stick();
+    HrmDecoder decoder;
     stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice("/dev/ttyUSB0")));
 
+    // Sensors paired in a previous run are reacquired without a search
+    auto pairings = std::make_shared<PairingCache>("/tmp/antservice.pairings");
+    pairings->Load();
+    stick.SetPairingCache(pairings);
+
     do {
         if (!stick.Connect()) {
             std::cerr << "Cannot connect to device" << std::endl;
@@ -36,9 +44,19 @@ int main()
                           << " Device type:0x" << std::hex << (unsigned) msg.device_type
                           << " Transfer type:0x" << std::hex << (unsigned) msg.trans_type
                           << std::endl;
+
+                HeartBeat beat;
+                if (decoder.Decode(msg, beat)) {
+                    std::cout << "Heart rate:" << std::dec << (unsigned) beat.heart_rate
+                              << " Beats:" << beat.beat_count
+                              << " RR interval ms:" << beat.RrMilliseconds()
+                              << std::endl;
+                }
             }
         }
     } while(false);
 
+    pairings->Save();
+
     return 0;
 }
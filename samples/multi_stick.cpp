@@ -0,0 +1,53 @@
+#include <iostream>
+#include "StickPool.h"
+#include "IdentityCache.h"
+
+int main()
+{
+    StickPool pool;
+
+    if (pool.Discover("/dev/ttyUSB") == 0) {
+        std::cerr << "No ANT USB sticks found" << std::endl;
+        return 1;
+    }
+
+    // Sticks already known from an earlier run skip the reset and keep
+    // their open channels
+    auto identities = std::make_shared<IdentityCache>("/tmp/antservice.sticks");
+    identities->Load();
+    for (size_t i=0; i<pool.Size(); i++)
+        pool[i].SetIdentityCache(identities);
+
+    if (pool.Init(true) == 0) {
+        std::cerr << "Cannot initialise any stick" << std::endl;
+        return 1;
+    }
+
+    // curl --unix-socket /tmp/antservice.metrics http://localhost/metrics
+    MetricsServer metrics([&pool] { return pool.PrometheusText(); });
+    metrics.Start("/tmp/antservice.metrics");
+
+    // Unplugged sticks come back with their channels when they are replugged
+    pool.WatchHotPlug("/dev/ttyUSB");
+    pool.Start();
+
+    for (int i=0; i<50; i++) {
+
+        PoolMessage msg;
+
+        if (pool.Read(msg, 5000)) {
+            std::cout << "Stick:" << std::dec << msg.stick
+                      << " Channel:" << (unsigned) msg.message.channel_number
+                      << " Device number:" << (unsigned) msg.message.device_number
+                      << " Device type:0x" << std::hex << (unsigned) msg.message.device_type
+                      << std::endl;
+        }
+    }
+
+    metrics.Stop();
+    pool.Stop();
+
+    identities->Save();
+
+    return 0;
+}
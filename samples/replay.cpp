@@ -0,0 +1,41 @@
+#include <iostream>
+#include <chrono>
+#include "ReplayDevice.h"
+#include "Stick.h"
+
+int main(int argc, char *argv[])
+{
+    std::string path = argc > 1 ? argv[1] : "logs/sample.log";
+    unsigned loops = argc > 2 ? std::stoul(argv[2]) : 100000;
+
+    auto device = new ReplayDevice(ReplayDevice::UNTHROTTLED);
+    if (!device->LoadLog(path)) {
+        std::cerr << "Cannot load " << path << std::endl;
+        return 1;
+    }
+    device->SetLoops(loops);
+
+    Stick stick = Stick();
+    stick.AttachDevice(std::unique_ptr<Device>(device));
+
+    if (!stick.Connect() || !stick.Reset() || !stick.Init()) {
+        std::cerr << "Cannot initialise replayed stick" << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    uint64_t count = 0;
+    ExtendedMessage msg;
+    while (stick.ReadExtendedMsg(msg))
+        ++count;
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "Messages: " << count
+              << " Seconds: " << elapsed.count()
+              << " Messages per second: " << (uint64_t)(count / elapsed.count())
+              << std::endl;
+
+    return 0;
+}
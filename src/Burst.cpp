@@ -0,0 +1,66 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Burst.h"
+
+#include <cstring>
+
+
+BurstAssembler::Result BurstAssembler::Add(uint8_t channel_byte, const uint8_t *payload, uint64_t time)
+{
+    uint8_t sequence = (channel_byte & BURST_SEQUENCE_MASK) >> BURST_SEQUENCE_SHIFT;
+
+    if (sequence == 0) {
+        if (buffer_.size() < max_size_)
+            buffer_.resize(max_size_);
+        size_ = 0;
+        start_time_ = time;
+        in_progress_ = true;
+    } else if (!in_progress_) {
+        return IGNORED;
+    } else if (sequence != sequence_ % 3 + 1) {
+        in_progress_ = false;
+        return FAILED;
+    }
+
+    if (size_ + PACKET_SIZE > max_size_) {
+        in_progress_ = false;
+        return FAILED;
+    }
+
+    std::memcpy(&buffer_[size_], payload, PACKET_SIZE);
+    size_ += PACKET_SIZE;
+    sequence_ = sequence;
+
+    if (!(channel_byte & BURST_LAST_PACKET))
+        return PENDING;
+
+    end_time_ = time;
+    in_progress_ = false;
+
+    return COMPLETE;
+}
+
+
+bool BurstAssembler::Abort()
+{
+    bool aborted = in_progress_;
+    in_progress_ = false;
+
+    return aborted;
+}
@@ -0,0 +1,351 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Capture.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+
+
+CaptureWriter::CaptureWriter(std::string const &base_path, size_t segment_records, unsigned max_segments) :
+    base_path_(base_path),
+    segment_records_(segment_records > 0 ? segment_records : DEFAULT_SEGMENT_RECORDS),
+    max_segments_(max_segments)
+{
+}
+
+
+CaptureWriter::~CaptureWriter()
+{
+    Close();
+}
+
+
+std::string CaptureWriter::SegmentPath(unsigned segment) const
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%06u.antcap", segment);
+    return base_path_ + suffix;
+}
+
+
+bool CaptureWriter::Open()
+{
+    LOG_FUNC;
+
+    Close();
+    segment_ = 0;
+    total_ = 0;
+
+    // Readers must not mix in segments of an earlier capture
+    for (auto const &path : CaptureReader::Segments(base_path_))
+        unlink(path.c_str());
+
+    if (!open_segment(0, current_))
+        return false;
+    use_segment(current_);
+
+    stopping_ = false;
+    helper_ = std::thread(&CaptureWriter::run_helper, this);
+
+    return true;
+}
+
+
+void CaptureWriter::Close()
+{
+    if (records_ == nullptr)
+        return;
+
+    stop_helper();
+
+    // A prepared segment without records is not a part of the capture
+    if (next_ready_) {
+        // close_segment resets next_, its number is needed for the unlink
+        std::string path = SegmentPath(next_.number);
+        close_segment(next_, 0);
+        unlink(path.c_str());
+        next_ready_ = false;
+    }
+
+    close_segment(current_, count_);
+    header_ = nullptr;
+    records_ = nullptr;
+    count_ = capacity_ = 0;
+}
+
+
+void CaptureWriter::prepare_next()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (preparing_ || next_ready_)
+        return;
+
+    preparing_ = true;
+    next_number_ = segment_ + 1;
+    helper_wake_up_.notify_one();
+}
+
+
+bool CaptureWriter::next_segment()
+{
+    if (records_ == nullptr)
+        return false;
+
+    // Normally the helper has been done long ago
+    prepare_next();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    prepared_.wait(lock, [this] () { return !preparing_; });
+
+    if (!next_ready_)
+        return false;
+
+    retired_.emplace_back(current_, count_);
+    current_ = next_;
+    next_ready_ = false;
+    helper_wake_up_.notify_one();
+    lock.unlock();
+
+    use_segment(current_);
+
+    return true;
+}
+
+
+void CaptureWriter::use_segment(SegmentMap const &segment)
+{
+    header_ = static_cast<CaptureHeader *>(segment.map);
+    header_->start_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    records_ = reinterpret_cast<CaptureRecord *>(header_ + 1);
+    segment_ = segment.number;
+    count_ = 0;
+    capacity_ = segment_records_;
+}
+
+
+void CaptureWriter::run_helper()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        helper_wake_up_.wait(lock, [this] () { return stopping_ || preparing_ || !retired_.empty(); });
+
+        auto retired = std::move(retired_);
+        retired_.clear();
+        bool prepare = preparing_;
+        unsigned number = next_number_;
+        if (!prepare && retired.empty())
+            break;
+        lock.unlock();
+
+        for (auto &full : retired) {
+            unsigned current = full.first.number + 1;
+            close_segment(full.first, full.second);
+            if (max_segments_ > 0 && current >= max_segments_)
+                unlink(SegmentPath(current - max_segments_).c_str());
+        }
+
+        SegmentMap segment;
+        bool ready = prepare && open_segment(number, segment);
+
+        lock.lock();
+        if (prepare) {
+            next_ = segment;
+            next_ready_ = ready;
+            preparing_ = false;
+            prepared_.notify_one();
+        }
+    }
+}
+
+
+void CaptureWriter::stop_helper()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        helper_wake_up_.notify_one();
+    }
+
+    if (helper_.joinable())
+        helper_.join();
+}
+
+
+bool CaptureWriter::open_segment(unsigned number, SegmentMap &segment)
+{
+    std::string path = SegmentPath(number);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERR("Cannot create capture segment " << path);
+        return false;
+    }
+
+    size_t map_size = sizeof(CaptureHeader) + segment_records_ * sizeof(CaptureRecord);
+
+    // Allocate the blocks up front, a full disk is reported here and not
+    // as SIGBUS on the receive path
+    if (posix_fallocate(fd, 0, map_size) != 0) {
+        LOG_ERR("Cannot allocate capture segment " << path);
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        LOG_ERR("Cannot map capture segment " << path);
+        close(fd);
+        return false;
+    }
+
+    auto header = static_cast<CaptureHeader *>(map);
+    std::memcpy(header->magic, CaptureHeader::MAGIC, sizeof(header->magic));
+    header->version = CaptureHeader::VERSION;
+    header->record_size = sizeof(CaptureRecord);
+    header->capacity = segment_records_;
+    header->records = 0;
+    header->start_time = 0;
+
+    segment.number = number;
+    segment.fd = fd;
+    segment.map = map;
+    segment.map_size = map_size;
+
+    LOG_MSG("Capture segment " << path);
+
+    return true;
+}
+
+
+void CaptureWriter::close_segment(SegmentMap &segment, size_t count)
+{
+    munmap(segment.map, segment.map_size);
+
+    // Drop the unused tail of a partially filled segment
+    if (ftruncate(segment.fd, sizeof(CaptureHeader) + count * sizeof(CaptureRecord)) != 0)
+        LOG_ERR("Cannot truncate capture segment " << SegmentPath(segment.number));
+    close(segment.fd);
+
+    segment = SegmentMap {};
+}
+
+
+CaptureReader::~CaptureReader()
+{
+    Close();
+}
+
+
+std::vector<std::string> CaptureReader::Segments(std::string const &base_path)
+{
+    auto found = base_path.rfind("/");
+    std::string directory = found == std::string::npos ? "." : base_path.substr(0, found);
+    std::string prefix = (found == std::string::npos ? base_path : base_path.substr(found + 1)) + ".";
+    std::string const suffix = ".antcap";
+
+    std::vector<std::string> segments;
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return segments;
+
+    while (dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() == prefix.size() + 6 + suffix.size() &&
+            name.compare(0, prefix.size(), prefix) == 0 &&
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+            segments.push_back(directory + "/" + name);
+    }
+    closedir(dir);
+
+    // Segment numbers are zero padded
+    std::sort(segments.begin(), segments.end());
+
+    return segments;
+}
+
+
+bool CaptureReader::Open(std::string const &segment_path)
+{
+    Close();
+
+    int fd = open(segment_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Cannot open capture segment " << segment_path);
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CaptureHeader)) {
+        LOG_ERR("Capture segment is too short " << segment_path);
+        close(fd);
+        return false;
+    }
+
+    map_size_ = info.st_size;
+    map_ = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map_ == MAP_FAILED) {
+        LOG_ERR("Cannot map capture segment " << segment_path);
+        map_ = nullptr;
+        return false;
+    }
+
+    header_ = static_cast<CaptureHeader const *>(map_);
+    if (std::memcmp(header_->magic, CaptureHeader::MAGIC, sizeof(header_->magic)) != 0 ||
+        header_->version != CaptureHeader::VERSION ||
+        header_->record_size != sizeof(CaptureRecord)) {
+        LOG_ERR("Not a capture segment " << segment_path);
+        Close();
+        return false;
+    }
+
+    // A writer that did not close the segment leaves it at full size
+    size_t stored = (map_size_ - sizeof(CaptureHeader)) / sizeof(CaptureRecord);
+    records_ = reinterpret_cast<CaptureRecord const *>(header_ + 1);
+    size_ = std::min<size_t>(header_->records, stored);
+
+    madvise(map_, map_size_, MADV_SEQUENTIAL);
+
+    return true;
+}
+
+
+void CaptureReader::Close()
+{
+    if (map_ != nullptr)
+        munmap(map_, map_size_);
+
+    map_ = nullptr;
+    map_size_ = 0;
+    header_ = nullptr;
+    records_ = nullptr;
+    size_ = 0;
+}
@@ -0,0 +1,185 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FrameReader.h"
+#include "FrameScanner.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+void FrameView::CopyTo(std::vector<uint8_t> &message) const
+{
+    message.resize(Size());
+    CopyTo(message.data());
+}
+
+
+void FrameView::CopyTo(uint8_t *dest) const
+{
+    std::memcpy(dest, first, first_size);
+    if (second_size)
+        std::memcpy(dest + first_size, second, second_size);
+}
+
+
+size_t FrameReader::Write(const uint8_t *data, size_t size)
+{
+    size = std::min(size, FreeSpace());
+
+    size_t index = tail_ & MASK;
+    size_t first_part = std::min(size, CAPACITY - index);
+
+    std::memcpy(&buffer_[index], data, first_part);
+    std::memcpy(&buffer_[0], data + first_part, size - first_part);
+
+    tail_ += size;
+
+    return size;
+}
+
+
+void FrameReader::skip_to_sync()
+{
+    size_t start = head_;
+
+    while (head_ != tail_) {
+        size_t index = head_ & MASK;
+        size_t contiguous = std::min(Size(), CAPACITY - index);
+
+        auto begin = &buffer_[index];
+        auto found = static_cast<const uint8_t *>(std::memchr(begin, ant::SYNC_BYTE, contiguous));
+        if (found != nullptr) {
+            head_ += found - begin;
+            break;
+        }
+        head_ += contiguous;
+    }
+
+    if (head_ != start)
+        add(dropped_bytes_, head_ - start);
+}
+
+
+bool FrameReader::Next(FrameView &frame)
+{
+    while (true) {
+        skip_to_sync();
+
+        if (Size() < FRAME_OVERHEAD)
+            return false;
+
+        // A corrupted length must not make us wait for up to 255 bytes
+        size_t data_length = at(1);
+        if (data_length > ant::MAX_DATA_LENGTH) {
+            add(corrupt_frames_, 1);
+            add(dropped_bytes_, 1);
+            ++head_;
+            continue;
+        }
+
+        size_t len = data_length + FRAME_OVERHEAD;
+        if (Size() < len)
+            return false;
+
+        size_t index = head_ & MASK;
+        size_t first_part = std::min(len, CAPACITY - index);
+
+        frame.first = &buffer_[index];
+        frame.first_size = first_part;
+        frame.second = &buffer_[0];
+        frame.second_size = len - first_part;
+
+        // Resynchronise right behind the bad sync byte, the bytes after it
+        // may be a good frame
+        uint8_t checksum = frame.second_size == 0
+            ? FrameScanner::FrameXor(frame.first, len, CAPACITY - index)
+            : FrameScanner::Xor(frame.first, frame.first_size) ^ FrameScanner::Xor(frame.second, frame.second_size);
+        if (checksum != 0) {
+            add(corrupt_frames_, 1);
+            add(dropped_bytes_, 1);
+            ++head_;
+            continue;
+        }
+
+        head_ += len;
+        add(frames_, 1);
+
+        return true;
+    }
+}
+
+
+size_t FrameReader::NextBatch(FrameView *frames, size_t max_frames)
+{
+    constexpr size_t SCAN_FRAMES = 64;
+    FrameScanner::FrameOffset offsets[SCAN_FRAMES];
+    size_t count = 0;
+
+    while (count < max_frames && Size() >= FRAME_OVERHEAD) {
+        size_t index = head_ & MASK;
+        size_t contiguous = std::min(Size(), CAPACITY - index);
+
+        // A frame may straddle the end of the ring, take it the slow way
+        if (contiguous < Size() && contiguous < MAX_FRAME_SIZE) {
+            if (!Next(frames[count]))
+                break;
+            ++count;
+            continue;
+        }
+
+        size_t consumed = 0;
+        size_t rejected = 0;
+        size_t found = FrameScanner::Scan(&buffer_[index], contiguous, offsets,
+                                          std::min(max_frames - count, SCAN_FRAMES), consumed, rejected);
+
+        size_t frame_bytes = 0;
+        for (size_t i = 0; i < found; ++i) {
+            FrameView &frame = frames[count++];
+            frame.first = &buffer_[index + offsets[i].offset];
+            frame.first_size = offsets[i].size;
+            frame.second = nullptr;
+            frame.second_size = 0;
+            frame_bytes += offsets[i].size;
+        }
+
+        head_ += consumed;
+        add(frames_, found);
+        if (rejected)
+            add(corrupt_frames_, rejected);
+        if (consumed != frame_bytes)
+            add(dropped_bytes_, consumed - frame_bytes);
+
+        // Only an incomplete frame is left
+        if (found == 0 && consumed == 0)
+            break;
+    }
+
+    return count;
+}
+
+
+FrameStats FrameReader::Stats() const
+{
+    FrameStats stats;
+    stats.frames = frames_.load(std::memory_order_relaxed);
+    stats.corrupt_frames = corrupt_frames_.load(std::memory_order_relaxed);
+    stats.dropped_bytes = dropped_bytes_.load(std::memory_order_relaxed);
+
+    return stats;
+}
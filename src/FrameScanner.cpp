@@ -0,0 +1,316 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FrameScanner.h"
+#include "Defaults.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define ANT_FRAME_SCANNER_X86 1
+#endif
+
+namespace FrameScanner {
+
+namespace {
+
+constexpr size_t FRAME_OVERHEAD = 4;
+// Candidates collected per FindSync call in Scan
+constexpr size_t CANDIDATES = 256;
+
+
+size_t find_sync_scalar(const uint8_t *data, size_t size, uint32_t *positions, size_t max_positions)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < size && count < max_positions; ++i)
+        if (data[i] == ant::SYNC_BYTE)
+            positions[count++] = static_cast<uint32_t>(i);
+
+    return count;
+}
+
+
+uint8_t xor_scalar(const uint8_t *data, size_t size)
+{
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < size; ++i)
+        checksum ^= data[i];
+
+    return checksum;
+}
+
+
+#ifndef ANT_FRAME_SCANNER_X86
+
+uint8_t frame_xor_scalar(const uint8_t *frame, size_t frame_size, size_t)
+{
+    return xor_scalar(frame, frame_size);
+}
+
+#endif
+
+
+#ifdef ANT_FRAME_SCANNER_X86
+
+// Appends the positions of the set bits of mask, returns false when full
+inline bool push_mask(uint32_t mask, size_t base, uint32_t *positions, size_t &count, size_t max_positions)
+{
+    while (mask != 0) {
+        if (count == max_positions)
+            return false;
+        positions[count++] = static_cast<uint32_t>(base + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+
+    return true;
+}
+
+
+// Scans data[from, size) with a narrower implementation
+template <typename FindSync>
+inline size_t find_sync_tail(const uint8_t *data, size_t from, size_t size,
+                             uint32_t *positions, size_t max_positions, FindSync find_sync)
+{
+    size_t count = find_sync(data + from, size - from, positions, max_positions);
+    for (size_t i = 0; i < count; ++i)
+        positions[i] += static_cast<uint32_t>(from);
+
+    return count;
+}
+
+
+inline uint8_t fold_xor(__m128i acc)
+{
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 2));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 1));
+
+    return static_cast<uint8_t>(_mm_cvtsi128_si32(acc));
+}
+
+
+size_t find_sync_sse2(const uint8_t *data, size_t size, uint32_t *positions, size_t max_positions)
+{
+    const __m128i sync = _mm_set1_epi8(static_cast<char>(ant::SYNC_BYTE));
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, sync)));
+        if (!push_mask(mask, i, positions, count, max_positions))
+            return count;
+    }
+
+    return count + find_sync_tail(data, i, size, positions + count, max_positions - count, find_sync_scalar);
+}
+
+
+uint8_t xor_sse2(const uint8_t *data, size_t size)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16)
+        acc = _mm_xor_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+
+    return fold_xor(acc) ^ xor_scalar(data + i, size - i);
+}
+
+
+// Checksum of a frame which has at least 32 readable bytes behind its
+// start: two masked loads and no data dependent branches
+uint8_t frame_xor_sse2(const uint8_t *frame, size_t frame_size, size_t available)
+{
+    // 16 bytes of 0xFF then 16 zeros, loading from MASKS + 16 - n keeps n bytes
+    alignas(16) static const uint8_t MASKS[32] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+
+    if (available < 32 || frame_size > 32)
+        return xor_sse2(frame, frame_size);
+
+    size_t low = std::min<size_t>(frame_size, 16);
+    size_t high = frame_size - low;
+
+    __m128i first = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(frame)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(MASKS + 16 - low)));
+    __m128i second = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(frame + 16)),
+                                   _mm_loadu_si128(reinterpret_cast<const __m128i *>(MASKS + 16 - high)));
+
+    return fold_xor(_mm_xor_si128(first, second));
+}
+
+
+__attribute__((target("avx2")))
+size_t find_sync_avx2(const uint8_t *data, size_t size, uint32_t *positions, size_t max_positions)
+{
+    const __m256i sync = _mm256_set1_epi8(static_cast<char>(ant::SYNC_BYTE));
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, sync)));
+        if (!push_mask(mask, i, positions, count, max_positions))
+            return count;
+    }
+
+    return count + find_sync_tail(data, i, size, positions + count, max_positions - count, find_sync_sse2);
+}
+
+
+__attribute__((target("avx2")))
+uint8_t xor_avx2(const uint8_t *data, size_t size)
+{
+    if (size < 32)
+        return xor_sse2(data, size);
+
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32)
+        acc = _mm256_xor_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)));
+
+    __m128i half = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+    return fold_xor(half) ^ xor_sse2(data + i, size - i);
+}
+
+#endif // ANT_FRAME_SCANNER_X86
+
+
+struct Kernels {
+    const char *name;
+    size_t (*find_sync)(const uint8_t *, size_t, uint32_t *, size_t);
+    uint8_t (*checksum)(const uint8_t *, size_t);
+    // Like checksum, available bytes behind the frame start may be read
+    uint8_t (*frame_checksum)(const uint8_t *, size_t, size_t);
+};
+
+
+Kernels select_kernels()
+{
+#ifdef ANT_FRAME_SCANNER_X86
+    // Runs from a static constructor, possibly before the one of libgcc
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {"avx2", find_sync_avx2, xor_avx2, frame_xor_sse2};
+    return {"sse2", find_sync_sse2, xor_sse2, frame_xor_sse2};
+#else
+    return {"scalar", find_sync_scalar, xor_scalar, frame_xor_scalar};
+#endif
+}
+
+
+const Kernels selected = select_kernels();
+
+} // namespace
+
+
+size_t FindSync(const uint8_t *data, size_t size, uint32_t *positions, size_t max_positions)
+{
+    return selected.find_sync(data, size, positions, max_positions);
+}
+
+
+uint8_t Xor(const uint8_t *data, size_t size)
+{
+    return selected.checksum(data, size);
+}
+
+
+uint8_t FrameXor(const uint8_t *frame, size_t size, size_t available)
+{
+    return selected.frame_checksum(frame, size, available);
+}
+
+
+size_t Scan(const uint8_t *data, size_t size, FrameOffset *frames, size_t max_frames,
+            size_t &consumed, size_t &rejected)
+{
+    uint32_t candidates[CANDIDATES];
+    size_t count = 0;
+    size_t next = 0;
+    // End of the last accepted frame, sync bytes in front of it are payload
+    size_t accepted_end = 0;
+
+    while (count < max_frames) {
+        // Payload bytes equal to SYNC_BYTE are rare, do not collect many
+        // more candidates than frames wanted
+        size_t wanted = std::min(CANDIDATES, max_frames - count + 16);
+        size_t found = selected.find_sync(data + next, size - next, candidates, wanted);
+
+        for (size_t i = 0; i < found; ++i) {
+            size_t pos = next + candidates[i];
+            if (pos < accepted_end)
+                continue;
+
+            if (pos + FRAME_OVERHEAD > size) {
+                consumed = pos;
+                return count;
+            }
+
+            size_t data_length = data[pos + 1];
+            if (data_length > ant::MAX_DATA_LENGTH) {
+                ++rejected;
+                continue;
+            }
+
+            size_t frame_size = data_length + FRAME_OVERHEAD;
+            if (pos + frame_size > size) {
+                consumed = pos;
+                return count;
+            }
+
+            if (selected.frame_checksum(data + pos, frame_size, size - pos) != 0) {
+                ++rejected;
+                continue;
+            }
+
+            frames[count++] = {static_cast<uint32_t>(pos), static_cast<uint8_t>(frame_size)};
+            accepted_end = pos + frame_size;
+
+            if (count == max_frames) {
+                consumed = accepted_end;
+                return count;
+            }
+        }
+
+        // No sync bytes left, the rest of the block is garbage
+        if (found < wanted) {
+            consumed = size;
+            return count;
+        }
+
+        next = std::max<size_t>(next + candidates[found - 1] + 1, accepted_end);
+    }
+
+    consumed = accepted_end;
+    return count;
+}
+
+
+const char *Implementation()
+{
+    return selected.name;
+}
+
+} // namespace FrameScanner
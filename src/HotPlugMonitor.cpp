@@ -0,0 +1,106 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "HotPlugMonitor.h"
+#include "Log.h"
+
+#include <sys/inotify.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <string.h>
+
+
+HotPlugMonitor::~HotPlugMonitor()
+{
+    Stop();
+}
+
+
+bool HotPlugMonitor::Watch(std::string const &prefix, Callback callback)
+{
+    LOG_FUNC;
+
+    Stop();
+
+    auto found = prefix.rfind("/");
+    directory_ = found == std::string::npos ? "." : prefix.substr(0, found);
+    name_prefix_ = found == std::string::npos ? prefix : prefix.substr(found + 1);
+    callback_ = std::move(callback);
+
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0) {
+        LOG_ERR("Error " << errno << " from inotify_init1: " << strerror(errno));
+        return false;
+    }
+
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB;
+    if (inotify_add_watch(inotify_fd_, directory_.c_str(), mask) < 0) {
+        LOG_ERR("Error " << errno << " from inotify_add_watch on " << directory_ << ": " << strerror(errno));
+        Stop();
+        return false;
+    }
+
+    return true;
+}
+
+
+void HotPlugMonitor::Stop()
+{
+    if (inotify_fd_ >= 0) {
+        close(inotify_fd_);
+        inotify_fd_ = -1;
+    }
+}
+
+
+size_t HotPlugMonitor::Dispatch()
+{
+    if (inotify_fd_ < 0)
+        return 0;
+
+    alignas(inotify_event) char buffer[4096];
+    size_t reported = 0;
+
+    while (true) {
+        ssize_t length = read(inotify_fd_, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERR("Error " << errno << " from inotify read: " << strerror(errno));
+            break;
+        }
+
+        for (ssize_t offset = 0; offset < length; ) {
+            auto const *event = reinterpret_cast<inotify_event const *>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+                LOG_ERR("Hot plug events lost in " << directory_);
+            if (event->len == 0 || strncmp(event->name, name_prefix_.c_str(), name_prefix_.size()) != 0)
+                continue;
+
+            bool present = !(event->mask & (IN_DELETE | IN_MOVED_FROM));
+            callback_(directory_ + "/" + event->name, present);
+            ++reported;
+        }
+    }
+
+    return reported;
+}
@@ -0,0 +1,134 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "HrmDecoder.h"
+
+
+namespace {
+
+enum {
+    PAGE_TOGGLE_MASK = 0x80,
+    PAGE_NUMBER_MASK = 0x7F,
+    PAGE_PREVIOUS_HEART_BEAT = 4,
+    PAIRING_BIT = 0x80
+};
+
+} // namespace
+
+
+void HrmDecoder::Reset()
+{
+    states_.fill(DeviceState {});
+    updates_ = 0;
+}
+
+
+HrmDecoder::DeviceState *HrmDecoder::find_state(uint32_t key, bool &created)
+{
+    // Fibonacci hashing of the device key
+    size_t start = static_cast<size_t>((key * 2654435769u) >> 24) % MAX_DEVICES;
+    DeviceState *oldest = nullptr;
+
+    for (size_t probe = 0; probe < PROBE_LIMIT; ++probe) {
+        DeviceState &state = states_[(start + probe) % MAX_DEVICES];
+
+        if (state.used && state.key == key) {
+            created = false;
+            return &state;
+        }
+        if (!state.used) {
+            oldest = &state;
+            break;
+        }
+        if (oldest == nullptr || state.last_update < oldest->last_update)
+            oldest = &state;
+    }
+
+    *oldest = DeviceState {};
+    oldest->key = key;
+    oldest->used = true;
+    created = true;
+
+    return oldest;
+}
+
+
+bool HrmDecoder::Decode(ExtendedMessage const &msg, HeartBeat &beat)
+{
+    /* Common part of all HRM data pages
+     *
+     * | 0                  | 1-3          | 4-5                   | 6           | 7          |
+     * |--------------------|--------------|-----------------------|-------------|------------|
+     * | Toggle | Page num  | Page specific| Heart beat event time | Heart beat  | Computed   |
+     * | bit 7  | bits 0-6  |              | 1/1024 s, LSB first   | count       | heart rate |
+     */
+
+    if ((msg.device_type & ~PAIRING_BIT) != HRM::ANT_DEVICE_TYPE)
+        return false;
+
+    bool created = false;
+    DeviceState &state = *find_state(msg.DeviceKey(), created);
+
+    uint8_t toggle = msg.payload[0] & PAGE_TOGGLE_MASK;
+    uint8_t beat_count = msg.payload[6];
+    uint16_t event_time = static_cast<uint16_t>(msg.payload[4] | msg.payload[5] << 8);
+
+    state.last_update = ++updates_;
+
+    if (created) {
+        state.last_toggle = toggle;
+        state.last_beat_count = beat_count;
+        state.last_event_time = event_time;
+        return false;
+    }
+
+    // Legacy sensors never toggle, their bytes 0-3 are not page data
+    if (toggle != state.last_toggle) {
+        state.toggle_seen = true;
+        state.last_toggle = toggle;
+    }
+
+    // Both the beat count and the event time roll over, unsigned
+    // arithmetic of the matching width yields the right difference
+    uint8_t beats = static_cast<uint8_t>(beat_count - state.last_beat_count);
+    if (beats == 0)
+        return false;
+
+    uint16_t rr_interval = 0;
+    if (beats == 1) {
+        rr_interval = static_cast<uint16_t>(event_time - state.last_event_time);
+    } else if (state.toggle_seen && (msg.payload[0] & PAGE_NUMBER_MASK) == PAGE_PREVIOUS_HEART_BEAT) {
+        // Beats were missed, page 4 still carries the previous event time
+        uint16_t previous_event_time = static_cast<uint16_t>(msg.payload[2] | msg.payload[3] << 8);
+        rr_interval = static_cast<uint16_t>(event_time - previous_event_time);
+    }
+
+    state.beat_count += beats;
+    state.last_beat_count = beat_count;
+    state.last_event_time = event_time;
+
+    beat.device_key = state.key;
+    beat.device_number = msg.device_number;
+    beat.heart_rate = msg.payload[7];
+    beat.beats = beats;
+    beat.beat_count = state.beat_count;
+    beat.event_time = event_time;
+    beat.rr_interval = rr_interval;
+
+    return true;
+}
@@ -0,0 +1,115 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "IdentityCache.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+
+bool IdentityCache::Load()
+{
+    LOG_FUNC;
+
+    std::ifstream file(path_);
+    std::vector<StickIdentity> identities;
+
+    std::string line;
+    while (file && std::getline(file, line)) {
+        std::istringstream fields(line);
+        StickIdentity identity;
+
+        if (!(fields >> identity.path >> identity.serial >> identity.channels >> identity.networks)) {
+            LOG_ERR("Skipping malformed identity: " << line);
+            continue;
+        }
+        // The version is the rest of the line
+        std::getline(fields >> std::ws, identity.version);
+
+        identities.push_back(identity);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    identities_ = std::move(identities);
+
+    return true;
+}
+
+
+bool IdentityCache::Save()
+{
+    LOG_FUNC;
+
+    std::ostringstream content;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto const &identity : identities_)
+            content << identity.path << ' ' << identity.serial << ' ' << identity.channels << ' '
+                    << identity.networks << ' ' << identity.version << '\n';
+    }
+
+    // A crash while writing must not lose the previous cache
+    std::string temp_path = path_ + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::trunc);
+        file << content.str();
+        file.flush();
+        if (!file) {
+            LOG_ERR("Cannot write " << temp_path);
+            return false;
+        }
+    }
+
+    if (std::rename(temp_path.c_str(), path_.c_str()) != 0) {
+        LOG_ERR("Cannot replace " << path_);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool IdentityCache::Find(std::string const &device_path, StickIdentity &identity) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = std::find_if(identities_.begin(), identities_.end(),
+                           [&device_path] (StickIdentity const &i) { return i.path == device_path; });
+    if (it == identities_.end())
+        return false;
+
+    identity = *it;
+
+    return true;
+}
+
+
+void IdentityCache::Record(StickIdentity const &identity)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = std::find_if(identities_.begin(), identities_.end(),
+                           [&identity] (StickIdentity const &i) { return i.path == identity.path; });
+    if (it != identities_.end())
+        *it = identity;
+    else
+        identities_.push_back(identity);
+}
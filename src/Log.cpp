@@ -0,0 +1,364 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+
+namespace antlog {
+
+namespace {
+
+/* Bounded multi-producer queue (D. Vyukov). Every cell carries a sequence
+ * number which tells producers and the consumer whether it is free.
+ */
+class RecordQueue {
+public:
+    static constexpr size_t CAPACITY = 4096;
+
+    RecordQueue() {
+        for (size_t i = 0; i < CAPACITY; ++i)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool Push(Record const &record) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells_[pos & MASK];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.record = record;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Single consumer, like Pop
+    bool Empty() const {
+        size_t pos = dequeue_pos_;
+        return cells_[pos & MASK].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    // Single consumer
+    bool Pop(Record &record) {
+        size_t pos = dequeue_pos_;
+        Cell &cell = cells_[pos & MASK];
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1)
+            return false;
+
+        record = cell.record;
+        cell.sequence.store(pos + CAPACITY, std::memory_order_release);
+        ++dequeue_pos_;
+
+        return true;
+    }
+
+private:
+    static constexpr size_t MASK = CAPACITY - 1;
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Record record;
+    };
+
+    Cell cells_[CAPACITY];
+    alignas(64) std::atomic<size_t> enqueue_pos_ {0};
+    alignas(64) size_t dequeue_pos_ = 0;
+};
+
+
+// Set once the logger is destroyed, records of static destructors running
+// later are silently discarded
+std::atomic<bool> shut_down {false};
+
+
+class Logger {
+public:
+    static Logger &Instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    void Push(Record const &record) {
+        if (!queue_.Push(record)) {
+            ++dropped_;
+            return;
+        }
+        ++pushed_;
+
+        // Pairs with the fence in run(): either the worker sees the record
+        // before it sleeps, or this sees it sleeping and wakes it up
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed))
+            wake_up();
+    }
+
+    void Flush() {
+        uint64_t target = pushed_;
+        while (written_ < target)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    ~Logger() {
+        running_ = false;
+        wake_up();
+        worker_.join();
+        shut_down = true;
+    }
+
+private:
+    Logger() : worker_([this] { run(); }) {}
+
+    void run() {
+        Record record;
+        uint64_t reported_drops = 0;
+
+        for (;;) {
+            bool busy = false;
+            while (queue_.Pop(record)) {
+                write(record);
+                ++written_;
+                busy = true;
+            }
+
+            uint64_t dropped = dropped_;
+            if (dropped != reported_drops) {
+                std::fprintf(stderr, "%llu log records dropped\n", (unsigned long long)(dropped - reported_drops));
+                reported_drops = dropped;
+            }
+
+            if (busy) {
+                std::fflush(stdout);
+                continue;
+            }
+            if (!running_)
+                break;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            sleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (queue_.Empty() && running_)
+                wake_up_.wait(lock);
+            sleeping_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void wake_up() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wake_up_.notify_one();
+    }
+
+    void write(Record const &record) {
+        switch (record.type) {
+        case FUNC_ENTER: {
+            const char *file = std::strrchr(record.file, '/');
+            // Extra symbols make the output coloured
+            std::printf("+ \x1b[31m%s \x1b[33m[%s:%u]\x1b[0m\n",
+                        record.func, file ? file + 1 : record.file, record.line);
+            break;
+        }
+        case FUNC_EXIT:
+            std::printf("- \x1b[31m%s\x1b[0m\n", record.func);
+            break;
+        case DUMP:
+            std::fputs(record.func, stdout);
+            for (size_t i = 0; i < record.size; ++i)
+                std::printf(" 0x%x", (unsigned)record.data[i]);
+            if (record.truncated)
+                std::fputs(" [truncated]", stdout);
+            std::fputc('\n', stdout);
+            break;
+        case TEXT:
+            write_text(record, stdout);
+            break;
+        case ERROR_TEXT:
+            std::fflush(stdout);
+            write_text(record, stderr);
+            break;
+        }
+    }
+
+    // Formats the arguments stored by Writer
+    void write_text(Record const &record, FILE *stream) {
+        text_.str(std::string());
+        text_.flags(std::ios_base::dec);
+
+        size_t pos = 0;
+        while (pos < record.size) {
+            auto type = static_cast<ArgType>(record.data[pos++]);
+            const uint8_t *value = &record.data[pos];
+
+            switch (type) {
+            case ARG_LITERAL: {
+                const char *literal;
+                std::memcpy(&literal, value, sizeof(literal));
+                text_ << literal;
+                pos += sizeof(literal);
+                break;
+            }
+            case ARG_STRING:
+                text_.write(reinterpret_cast<const char *>(value + 1), value[0]);
+                pos += 1 + value[0];
+                break;
+            case ARG_CHAR:
+                text_ << static_cast<char>(value[0]);
+                pos += 1;
+                break;
+            case ARG_SIGNED: {
+                int64_t number;
+                std::memcpy(&number, value, sizeof(number));
+                text_ << number;
+                pos += sizeof(number);
+                break;
+            }
+            case ARG_UNSIGNED: {
+                uint64_t number;
+                std::memcpy(&number, value, sizeof(number));
+                text_ << number;
+                pos += sizeof(number);
+                break;
+            }
+            case ARG_DOUBLE: {
+                double number;
+                std::memcpy(&number, value, sizeof(number));
+                text_ << number;
+                pos += sizeof(number);
+                break;
+            }
+            case ARG_BASE:
+                text_ << std::setbase(value[0]);
+                pos += 1;
+                break;
+            }
+        }
+
+        if (record.truncated)
+            text_ << " [truncated]";
+        text_ << '\n';
+
+        auto const &text = text_.str();
+        std::fwrite(text.data(), 1, text.size(), stream);
+    }
+
+    RecordQueue queue_ {};
+    std::atomic<uint64_t> pushed_ {0};
+    std::atomic<uint64_t> written_ {0};
+    std::atomic<uint64_t> dropped_ {0};
+    std::atomic<bool> running_ {true};
+    // Worker state, set while it waits for records
+    std::mutex mutex_ {};
+    std::condition_variable wake_up_ {};
+    std::atomic<bool> sleeping_ {false};
+    std::ostringstream text_ {};
+    std::thread worker_;
+};
+
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+
+void Push(Record &record)
+{
+    if (shut_down)
+        return;
+
+    record.timestamp_ns = now_ns();
+    Logger::Instance().Push(record);
+}
+
+
+void Text(RecordType type, const char *func, const char *file, unsigned line, std::string const &text)
+{
+    Writer writer(type, func, file, line);
+    writer << text;
+    writer.Push();
+}
+
+
+void Dump(const char *prefix, const uint8_t *data, size_t size)
+{
+    Record record;
+    record.func = prefix;
+    record.file = "";
+    record.line = 0;
+    record.type = DUMP;
+    record.size = static_cast<uint8_t>(std::min(size, Record::DATA_SIZE));
+    record.truncated = size > Record::DATA_SIZE;
+    std::memcpy(record.data, data, record.size);
+
+    Push(record);
+}
+
+
+void Flush()
+{
+    if (!shut_down)
+        Logger::Instance().Flush();
+}
+
+
+FunctionScope::FunctionScope(const char *func, const char *file, unsigned line) : func_(func)
+{
+    Record record;
+    record.func = func;
+    record.file = file;
+    record.line = line;
+    record.type = FUNC_ENTER;
+    record.size = 0;
+    record.truncated = false;
+
+    Push(record);
+}
+
+
+FunctionScope::~FunctionScope()
+{
+    Record record;
+    record.func = func_;
+    record.file = "";
+    record.line = 0;
+    record.type = FUNC_EXIT;
+    record.size = 0;
+    record.truncated = false;
+
+    Push(record);
+}
+
+} // namespace antlog
@@ -0,0 +1,392 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Metrics.h"
+#include "Common.h"
+#include "Reactor.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+
+uint64_t Histogram::BucketLimit(unsigned index)
+{
+    if (index < SUB_BUCKETS)
+        return index;
+
+    unsigned shift = index / SUB_BUCKETS - 1;
+    uint64_t lower = static_cast<uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+
+    return lower + ((uint64_t(1) << shift) - 1);
+}
+
+
+HistogramSnapshot Histogram::Snapshot() const
+{
+    HistogramSnapshot snapshot;
+    snapshot.buckets.resize(BUCKETS);
+
+    for (unsigned i = 0; i < BUCKETS; ++i)
+        snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    // The count is summed from the buckets, it is consistent with them even
+    // when recording goes on
+    for (auto count : snapshot.buckets)
+        snapshot.count += count;
+    snapshot.sum = sum_.load(std::memory_order_relaxed);
+
+    return snapshot;
+}
+
+
+uint64_t HistogramSnapshot::Percentile(double fraction) const
+{
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = static_cast<uint64_t>(fraction * count + 0.5);
+    rank = std::max<uint64_t>(1, std::min(rank, count));
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return Histogram::BucketLimit(i);
+    }
+
+    return Histogram::BucketLimit(Histogram::BUCKETS - 1);
+}
+
+
+uint64_t HistogramSnapshot::CountBelow(uint64_t value) const
+{
+    uint64_t below = 0;
+    for (unsigned i = 0; i < buckets.size() && Histogram::BucketLimit(i) <= value; ++i)
+        below += buckets[i];
+
+    return below;
+}
+
+
+void CounterTable::Increment(uint32_t key)
+{
+    // Fibonacci hashing spreads the sequential device numbers
+    size_t index = (key * 2654435769u) >> 24;
+
+    for (size_t probe = 0; probe < PROBE_LIMIT; ++probe) {
+        Entry &entry = entries_[(index + probe) % CAPACITY];
+        uint32_t current = entry.key.load(std::memory_order_acquire);
+
+        if (current == EMPTY) {
+            if (!entry.key.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+                if (current != key)
+                    continue;
+        } else if (current != key) {
+            continue;
+        }
+
+        Metrics::Add(entry.count);
+        return;
+    }
+
+    Metrics::Add(overflow_);
+}
+
+
+std::vector<std::pair<uint32_t, uint64_t>> CounterTable::Snapshot() const
+{
+    std::vector<std::pair<uint32_t, uint64_t>> counters;
+
+    for (auto const &entry : entries_) {
+        uint32_t key = entry.key.load(std::memory_order_acquire);
+        if (key != EMPTY)
+            counters.emplace_back(key, entry.count.load(std::memory_order_relaxed));
+    }
+
+    return counters;
+}
+
+
+void Metrics::Fill(MetricsSnapshot &snapshot) const
+{
+    snapshot.bytes_read = bytes_read.load(std::memory_order_relaxed);
+    snapshot.bytes_written = bytes_written.load(std::memory_order_relaxed);
+    snapshot.read_errors = read_errors.load(std::memory_order_relaxed);
+    snapshot.write_errors = write_errors.load(std::memory_order_relaxed);
+    snapshot.commands = commands.load(std::memory_order_relaxed);
+    snapshot.command_errors = command_errors.load(std::memory_order_relaxed);
+    snapshot.bursts_received = bursts_received.load(std::memory_order_relaxed);
+    snapshot.burst_bytes_received = burst_bytes_received.load(std::memory_order_relaxed);
+    snapshot.burst_receive_errors = burst_receive_errors.load(std::memory_order_relaxed);
+    snapshot.bursts_sent = bursts_sent.load(std::memory_order_relaxed);
+    snapshot.burst_bytes_sent = burst_bytes_sent.load(std::memory_order_relaxed);
+    snapshot.burst_send_errors = burst_send_errors.load(std::memory_order_relaxed);
+    snapshot.tx_messages = tx_messages.load(std::memory_order_relaxed);
+    snapshot.tx_repeats = tx_repeats.load(std::memory_order_relaxed);
+    snapshot.tx_acknowledged = tx_acknowledged.load(std::memory_order_relaxed);
+    snapshot.tx_ack_failures = tx_ack_failures.load(std::memory_order_relaxed);
+    snapshot.tx_errors = tx_errors.load(std::memory_order_relaxed);
+    snapshot.disconnects = disconnects.load(std::memory_order_relaxed);
+    snapshot.reconnects = reconnects.load(std::memory_order_relaxed);
+
+    snapshot.channel_frames.clear();
+    for (size_t channel = 0; channel < MAX_CHANNELS; ++channel) {
+        uint64_t frames = channel_frames[channel].load(std::memory_order_relaxed);
+        if (frames)
+            snapshot.channel_frames.emplace_back(static_cast<uint8_t>(channel), frames);
+    }
+
+    snapshot.device_frames = device_frames.Snapshot();
+    snapshot.device_overflow = device_frames.Overflow();
+    snapshot.command_round_trip = command_round_trip.Snapshot();
+    snapshot.delivery_latency = delivery_latency.Snapshot();
+    snapshot.radio_latency = radio_latency.Snapshot();
+    snapshot.burst_receive_time = burst_receive_time.Snapshot();
+    snapshot.burst_send_time = burst_send_time.Snapshot();
+    snapshot.tx_jitter = tx_jitter.Snapshot();
+    snapshot.reconnect_gap = reconnect_gap.Snapshot();
+}
+
+
+namespace {
+
+// Bucket bounds of the exported histograms, in seconds
+const double LATENCY_BOUNDS[] = {
+    0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5
+};
+
+
+void counter(std::ostringstream &out, char const *name, char const *help,
+             std::vector<MetricsSnapshot> const &sticks, uint64_t MetricsSnapshot::*field)
+{
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n";
+    for (size_t i = 0; i < sticks.size(); ++i)
+        out << name << "{stick=\"" << i << "\"} " << sticks[i].*field << "\n";
+}
+
+
+void histogram(std::ostringstream &out, char const *name, char const *help,
+               std::vector<MetricsSnapshot> const &sticks, HistogramSnapshot MetricsSnapshot::*field)
+{
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+    for (size_t i = 0; i < sticks.size(); ++i) {
+        HistogramSnapshot const &h = sticks[i].*field;
+        for (double bound : LATENCY_BOUNDS)
+            out << name << "_bucket{stick=\"" << i << "\",le=\"" << bound << "\"} "
+                << h.CountBelow(static_cast<uint64_t>(bound * 1e9)) << "\n";
+        out << name << "_bucket{stick=\"" << i << "\",le=\"+Inf\"} " << h.count << "\n";
+        out << name << "_sum{stick=\"" << i << "\"} " << h.sum / 1e9 << "\n";
+        out << name << "_count{stick=\"" << i << "\"} " << h.count << "\n";
+    }
+}
+
+} // namespace
+
+
+std::string PrometheusText(std::vector<MetricsSnapshot> const &sticks)
+{
+    std::ostringstream out;
+
+    counter(out, "ant_bytes_read_total", "Bytes read from the stick", sticks, &MetricsSnapshot::bytes_read);
+    counter(out, "ant_bytes_written_total", "Bytes written to the stick", sticks, &MetricsSnapshot::bytes_written);
+    counter(out, "ant_read_errors_total", "Failed device reads", sticks, &MetricsSnapshot::read_errors);
+    counter(out, "ant_write_errors_total", "Failed device writes", sticks, &MetricsSnapshot::write_errors);
+    counter(out, "ant_frames_total", "Valid frames received", sticks, &MetricsSnapshot::frames);
+    counter(out, "ant_corrupt_frames_total", "Sync bytes rejected for length or checksum",
+            sticks, &MetricsSnapshot::corrupt_frames);
+    counter(out, "ant_dropped_bytes_total", "Bytes dropped while resynchronising",
+            sticks, &MetricsSnapshot::dropped_bytes);
+    counter(out, "ant_commands_total", "Commands sent", sticks, &MetricsSnapshot::commands);
+    counter(out, "ant_command_errors_total", "Commands failed", sticks, &MetricsSnapshot::command_errors);
+    counter(out, "ant_dropped_messages_total", "Messages lost by slow consumers",
+            sticks, &MetricsSnapshot::dropped_messages);
+    counter(out, "ant_bursts_received_total", "Completed incoming bursts",
+            sticks, &MetricsSnapshot::bursts_received);
+    counter(out, "ant_burst_bytes_received_total", "Data bytes of completed incoming bursts",
+            sticks, &MetricsSnapshot::burst_bytes_received);
+    counter(out, "ant_burst_receive_errors_total", "Incoming bursts lost or out of sequence",
+            sticks, &MetricsSnapshot::burst_receive_errors);
+    counter(out, "ant_bursts_sent_total", "Completed outgoing bursts", sticks, &MetricsSnapshot::bursts_sent);
+    counter(out, "ant_burst_bytes_sent_total", "Data bytes of completed outgoing bursts",
+            sticks, &MetricsSnapshot::burst_bytes_sent);
+    counter(out, "ant_burst_send_errors_total", "Outgoing bursts failed", sticks, &MetricsSnapshot::burst_send_errors);
+    counter(out, "ant_tx_messages_total", "Payloads handed to master channels", sticks, &MetricsSnapshot::tx_messages);
+    counter(out, "ant_tx_repeats_total", "Master channel periods without a new payload",
+            sticks, &MetricsSnapshot::tx_repeats);
+    counter(out, "ant_tx_acknowledged_total", "Acknowledged messages confirmed",
+            sticks, &MetricsSnapshot::tx_acknowledged);
+    counter(out, "ant_tx_ack_failures_total", "Acknowledged messages not confirmed",
+            sticks, &MetricsSnapshot::tx_ack_failures);
+    counter(out, "ant_tx_errors_total", "Data messages rejected by the stick", sticks, &MetricsSnapshot::tx_errors);
+    counter(out, "ant_disconnects_total", "Devices lost, e.g. unplugged", sticks, &MetricsSnapshot::disconnects);
+    counter(out, "ant_reconnects_total", "Lost devices brought back", sticks, &MetricsSnapshot::reconnects);
+
+    out << "# HELP ant_channel_frames_total Data messages per channel\n"
+        << "# TYPE ant_channel_frames_total counter\n";
+    for (size_t i = 0; i < sticks.size(); ++i)
+        for (auto const &channel : sticks[i].channel_frames)
+            out << "ant_channel_frames_total{stick=\"" << i << "\",channel=\"" << (unsigned)channel.first
+                << "\"} " << channel.second << "\n";
+
+    out << "# HELP ant_device_frames_total Data messages per transmitter\n"
+        << "# TYPE ant_device_frames_total counter\n";
+    for (size_t i = 0; i < sticks.size(); ++i) {
+        for (auto const &device : sticks[i].device_frames)
+            out << "ant_device_frames_total{stick=\"" << i
+                << "\",device_type=\"" << (device.first >> 24)
+                << "\",trans_type=\"" << ((device.first >> 16) & 0xFF)
+                << "\",device_number=\"" << (device.first & 0xFFFF)
+                << "\"} " << device.second << "\n";
+        if (sticks[i].device_overflow)
+            out << "ant_device_frames_total{stick=\"" << i << "\",device_type=\"other\"} "
+                << sticks[i].device_overflow << "\n";
+    }
+
+    out << "# HELP ant_queue_depth Messages waiting in a delivery queue\n"
+        << "# TYPE ant_queue_depth gauge\n";
+    for (size_t i = 0; i < sticks.size(); ++i)
+        for (size_t queue = 0; queue < sticks[i].queue_depths.size(); ++queue)
+            out << "ant_queue_depth{stick=\"" << i << "\",queue=\"" << queue << "\"} "
+                << sticks[i].queue_depths[queue] << "\n";
+
+    out << "# HELP ant_startup_seconds Phases of the last stick startup\n"
+        << "# TYPE ant_startup_seconds gauge\n";
+    for (size_t i = 0; i < sticks.size(); ++i)
+        for (auto const &phase : sticks[i].startup)
+            out << "ant_startup_seconds{stick=\"" << i << "\",phase=\"" << phase.first << "\"} "
+                << phase.second / 1e9 << "\n";
+
+    histogram(out, "ant_command_round_trip_seconds", "Command write to response",
+              sticks, &MetricsSnapshot::command_round_trip);
+    histogram(out, "ant_delivery_latency_seconds", "Device read to consumer",
+              sticks, &MetricsSnapshot::delivery_latency);
+    histogram(out, "ant_radio_latency_seconds", "Stick RX timestamp to device read, above the minimum",
+              sticks, &MetricsSnapshot::radio_latency);
+    histogram(out, "ant_burst_receive_seconds", "First to last packet of incoming bursts",
+              sticks, &MetricsSnapshot::burst_receive_time);
+    histogram(out, "ant_burst_send_seconds", "First packet to completion of outgoing bursts",
+              sticks, &MetricsSnapshot::burst_send_time);
+    histogram(out, "ant_tx_jitter_seconds", "Deviation of master channel events from the channel period",
+              sticks, &MetricsSnapshot::tx_jitter);
+    histogram(out, "ant_reconnect_gap_seconds", "Last data before a device was lost to the first data after reconnecting",
+              sticks, &MetricsSnapshot::reconnect_gap);
+
+    return out.str();
+}
+
+
+MetricsServer::MetricsServer(Provider provider) :
+    provider_(std::move(provider)),
+    reactor_(new Reactor())
+{
+}
+
+
+MetricsServer::~MetricsServer()
+{
+    Stop();
+}
+
+
+bool MetricsServer::Start(std::string const &socket_path)
+{
+    LOG_FUNC;
+
+    sockaddr_un address {};
+    if (thread_.joinable() || socket_path.size() >= sizeof(address.sun_path))
+        return false;
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        LOG_ERR("Cannot create metrics socket");
+        return false;
+    }
+
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    // A stale socket of a previous run would make bind fail
+    unlink(socket_path.c_str());
+
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listen_fd_, 8) != 0 ||
+        !reactor_->Add(listen_fd_, [this] { on_connection(); })) {
+        LOG_ERR("Cannot listen on metrics socket " << socket_path);
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+
+    socket_path_ = socket_path;
+    thread_ = std::thread([this] { reactor_->Run(); });
+
+    LOG_MSG("Metrics on unix socket " << socket_path);
+
+    return true;
+}
+
+
+void MetricsServer::Stop()
+{
+    if (!thread_.joinable())
+        return;
+
+    reactor_->Stop();
+    thread_.join();
+
+    reactor_->Remove(listen_fd_);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    unlink(socket_path_.c_str());
+}
+
+
+void MetricsServer::on_connection()
+{
+    while (true) {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        // The request is not parsed, every path returns the metrics. Reading
+        // it first avoids a reset on close with unread data
+        char request[1024];
+        timeval timeout {0, 100000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        ssize_t received = recv(fd, request, sizeof(request), 0);
+        (void)received;
+
+        std::string body = provider_();
+        std::string response = "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "\r\n" + body;
+
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t result = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (result <= 0)
+                break;
+            sent += result;
+        }
+        close(fd);
+    }
+}
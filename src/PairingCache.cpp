@@ -0,0 +1,191 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PairingCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+
+ChannelConfig PairedDevice::Config() const
+{
+    ChannelConfig config;
+    config.device_type = device_type;
+    config.device_number = device_number;
+    config.trans_type = trans_type;
+    config.period = period;
+    config.frequency = frequency;
+    config.network = network;
+
+    return config;
+}
+
+
+bool PairingCache::Load()
+{
+    LOG_FUNC;
+
+    std::ifstream file(path_);
+    std::vector<PairedDevice> devices;
+
+    std::string line;
+    while (file && std::getline(file, line)) {
+        std::istringstream fields(line);
+        unsigned device_type, device_number, trans_type, period, frequency, network;
+        long long last_seen;
+
+        if (!(fields >> device_type >> device_number >> trans_type >> period >> frequency >> network >> last_seen)
+            || device_type > 0xFF || device_number > 0xFFFF || trans_type > 0xFF
+            || period > 0xFFFF || frequency > 0xFF || network > 0xFF) {
+            LOG_ERR("Skipping malformed pairing: " << line);
+            continue;
+        }
+
+        devices.push_back(PairedDevice {
+            static_cast<uint16_t>(device_number), static_cast<uint8_t>(device_type),
+            static_cast<uint8_t>(trans_type), static_cast<uint16_t>(period),
+            static_cast<uint8_t>(frequency), static_cast<uint8_t>(network), last_seen});
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    devices_.clear();
+    for (auto const &device : devices) {
+        auto it = std::find_if(devices_.begin(), devices_.end(),
+                               [&device] (PairedDevice const &d) { return d.Key() == device.Key(); });
+        if (it == devices_.end())
+            devices_.push_back(device);
+        else if (it->last_seen < device.last_seen)
+            *it = device;
+    }
+
+    if (devices_.size() > MAX_DEVICES) {
+        std::sort(devices_.begin(), devices_.end(),
+                  [] (PairedDevice const &a, PairedDevice const &b) { return a.last_seen > b.last_seen; });
+        devices_.resize(MAX_DEVICES);
+    }
+
+    return true;
+}
+
+
+bool PairingCache::Save()
+{
+    LOG_FUNC;
+
+    std::ostringstream content;
+    for (auto const &device : Recent())
+        content << (unsigned)device.device_type << ' ' << device.device_number << ' '
+                << (unsigned)device.trans_type << ' ' << device.period << ' '
+                << (unsigned)device.frequency << ' ' << (unsigned)device.network << ' '
+                << device.last_seen << '\n';
+
+    // A crash while writing must not lose the previous cache
+    std::string temp_path = path_ + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::trunc);
+        file << content.str();
+        file.flush();
+        if (!file) {
+            LOG_ERR("Cannot write " << temp_path);
+            return false;
+        }
+    }
+
+    if (std::rename(temp_path.c_str(), path_.c_str()) != 0) {
+        LOG_ERR("Cannot replace " << path_);
+        return false;
+    }
+
+    return true;
+}
+
+
+void PairingCache::Record(PairedDevice const &device)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = std::find_if(devices_.begin(), devices_.end(),
+                           [&device] (PairedDevice const &d) { return d.Key() == device.Key(); });
+    if (it != devices_.end()) {
+        *it = device;
+        return;
+    }
+
+    if (devices_.size() < MAX_DEVICES) {
+        devices_.push_back(device);
+        return;
+    }
+
+    *std::min_element(devices_.begin(), devices_.end(),
+                      [] (PairedDevice const &a, PairedDevice const &b) { return a.last_seen < b.last_seen; }) = device;
+}
+
+
+bool PairingCache::Forget(uint32_t key)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = std::find_if(devices_.begin(), devices_.end(),
+                           [key] (PairedDevice const &d) { return d.Key() == key; });
+    if (it == devices_.end())
+        return false;
+
+    devices_.erase(it);
+
+    return true;
+}
+
+
+size_t PairingCache::Expire(int64_t max_age, int64_t now)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    size_t size = devices_.size();
+    devices_.erase(std::remove_if(devices_.begin(), devices_.end(),
+                                  [=] (PairedDevice const &d) { return now - d.last_seen > max_age; }),
+                   devices_.end());
+
+    return size - devices_.size();
+}
+
+
+std::vector<PairedDevice> PairingCache::Recent(size_t max_count) const
+{
+    std::vector<PairedDevice> devices;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        devices = devices_;
+    }
+
+    std::stable_sort(devices.begin(), devices.end(),
+                     [] (PairedDevice const &a, PairedDevice const &b) { return a.last_seen > b.last_seen; });
+    if (devices.size() > max_count)
+        devices.resize(max_count);
+
+    return devices;
+}
+
+
+size_t PairingCache::Size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return devices_.size();
+}
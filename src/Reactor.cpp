@@ -0,0 +1,200 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Reactor.h"
+#include "Common.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <string.h>
+
+
+Reactor::Reactor()
+{
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0)
+        LOG_ERR("Error " << errno << " from epoll_create1: " << strerror(errno));
+
+    wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd_ < 0)
+        LOG_ERR("Error " << errno << " from eventfd: " << strerror(errno));
+
+    epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = wakeup_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &event);
+}
+
+
+Reactor::~Reactor()
+{
+    for (auto const &handler : handlers_)
+        if (handler.second.timer)
+            close(handler.first);
+
+    if (wakeup_fd_ >= 0)
+        close(wakeup_fd_);
+    if (epoll_fd_ >= 0)
+        close(epoll_fd_);
+}
+
+
+bool Reactor::add(int fd, Callback callback, bool timer)
+{
+    epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+        LOG_ERR("Error " << errno << " from epoll_ctl: " << strerror(errno));
+        return false;
+    }
+
+    handlers_[fd] = Handler {std::move(callback), timer};
+
+    return true;
+}
+
+
+bool Reactor::Add(int fd, Callback on_readable)
+{
+    return add(fd, std::move(on_readable), false);
+}
+
+
+bool Reactor::Remove(int fd)
+{
+    auto itt = handlers_.find(fd);
+    if (itt == handlers_.end())
+        return false;
+
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    if (itt->second.timer)
+        close(fd);
+    handlers_.erase(itt);
+
+    return true;
+}
+
+
+int Reactor::AddTimer(unsigned interval_ms, Callback on_timer)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Error " << errno << " from timerfd_create: " << strerror(errno));
+        return -1;
+    }
+
+    itimerspec spec {};
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+    timerfd_settime(fd, 0, &spec, nullptr);
+
+    if (!add(fd, std::move(on_timer), true)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+bool Reactor::RunOnce(int timeout_ms)
+{
+    constexpr int MAX_EVENTS = 32;
+    epoll_event events[MAX_EVENTS];
+
+    int count = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout_ms);
+    if (count < 0) {
+        if (errno == EINTR)
+            return true;
+        LOG_ERR("Error " << errno << " from epoll_wait: " << strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int fd = events[i].data.fd;
+
+        if (fd == wakeup_fd_) {
+            uint64_t value;
+            while (read(wakeup_fd_, &value, sizeof(value)) > 0);
+
+            std::vector<Callback> posted;
+            {
+                std::lock_guard<std::mutex> lock(posted_mutex_);
+                posted.swap(posted_);
+            }
+            for (auto &callback : posted)
+                callback();
+            continue;
+        }
+
+        // A previous callback may have removed this descriptor
+        auto itt = handlers_.find(fd);
+        if (itt == handlers_.end())
+            continue;
+
+        if (itt->second.timer) {
+            uint64_t expirations;
+            while (read(fd, &expirations, sizeof(expirations)) > 0);
+        }
+
+        // Copy, the callback is allowed to remove itself
+        Callback callback = itt->second.callback;
+        callback();
+    }
+
+    return true;
+}
+
+
+void Reactor::Run()
+{
+    while (!stop_requested_ && RunOnce());
+    stop_requested_ = false;
+}
+
+
+void Reactor::Stop()
+{
+    stop_requested_ = true;
+    wake_up();
+}
+
+
+void Reactor::Post(Callback callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        posted_.push_back(std::move(callback));
+    }
+    wake_up();
+}
+
+
+void Reactor::wake_up()
+{
+    uint64_t value = 1;
+    if (write(wakeup_fd_, &value, sizeof(value)) < 0)
+        LOG_ERR("Error " << errno << " from eventfd write: " << strerror(errno));
+}
@@ -0,0 +1,237 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ReplayDevice.h"
+#include "Burst.h"
+
+#include <fstream>
+#include <thread>
+
+
+namespace {
+
+std::vector<uint8_t> parse_bytes(std::string const &text)
+{
+    std::vector<uint8_t> bytes;
+    std::istringstream stream(text);
+    std::string token;
+
+    while (stream >> token) {
+        if (token.compare(0, 2, "0x") != 0)
+            break;
+        bytes.push_back(static_cast<uint8_t>(std::stoul(token, nullptr, 16)));
+    }
+
+    return bytes;
+}
+
+
+// "Channel:0 Payload: 0x4 ... 0x0 Device number:41981 Device type:0x78 Transfer type:0x61"
+bool parse_sample_line(std::string const &line, std::vector<uint8_t> &frame)
+{
+    auto payload_pos = line.find("Payload:");
+    auto number_pos = line.find("Device number:");
+    auto type_pos = line.find("Device type:");
+    auto trans_pos = line.find("Transfer type:");
+
+    if (payload_pos == std::string::npos || number_pos == std::string::npos
+        || type_pos == std::string::npos || trans_pos == std::string::npos)
+        return false;
+
+    std::vector<uint8_t> payload = parse_bytes(line.substr(payload_pos + 8));
+    if (payload.size() != 8)
+        return false;
+
+    unsigned channel = std::stoul(line.substr(line.find(':') + 1));
+    unsigned device_number = std::stoul(line.substr(number_pos + 14));
+    unsigned device_type = std::stoul(line.substr(type_pos + 12), nullptr, 16);
+    unsigned trans_type = std::stoul(line.substr(trans_pos + 14), nullptr, 16);
+
+    std::vector<uint8_t> data;
+    data.push_back(static_cast<uint8_t>(channel));
+    data.insert(data.end(), payload.begin(), payload.end());
+    data.push_back(0x80); // Flag byte: channel id follows
+    data.push_back(static_cast<uint8_t>(device_number & 0xFF));
+    data.push_back(static_cast<uint8_t>(device_number >> 8 & 0xFF));
+    data.push_back(static_cast<uint8_t>(device_type));
+    data.push_back(static_cast<uint8_t>(trans_type));
+
+    frame = Message(ant::BROADCAST_DATA, data);
+
+    return true;
+}
+
+} // namespace
+
+
+bool ReplayDevice::LoadLog(std::string const &path)
+{
+    LOG_FUNC;
+
+    std::ifstream log(path);
+    if (!log) {
+        LOG_ERR("Cannot open log " << path);
+        return false;
+    }
+
+    std::vector<uint8_t> request {};
+    std::vector<uint8_t> frame {};
+    std::string line;
+
+    while (std::getline(log, line)) {
+        if (line.compare(0, 6, "Write:") == 0) {
+            request = parse_bytes(line.substr(6));
+            script_[request].clear();
+        } else if (line.compare(0, 5, "Read:") == 0) {
+            if (!request.empty())
+                AddResponse(request, parse_bytes(line.substr(5)));
+        } else if (line.compare(0, 8, "Channel:") == 0) {
+            if (parse_sample_line(line, frame))
+                AddFrame(frame);
+        }
+    }
+
+    return true;
+}
+
+
+void ReplayDevice::AddResponse(std::vector<uint8_t> const &request, std::vector<uint8_t> const &response)
+{
+    script_[request].push_back(response);
+}
+
+
+void ReplayDevice::AddFrame(std::vector<uint8_t> const &frame)
+{
+    stream_.push_back(frame);
+}
+
+
+bool ReplayDevice::Connect()
+{
+    connected_ = true;
+    next_frame_time_ = std::chrono::steady_clock::now();
+
+    return true;
+}
+
+
+bool ReplayDevice::Disconnect()
+{
+    connected_ = false;
+
+    return true;
+}
+
+
+bool ReplayDevice::Write(std::vector<uint8_t> const &buff)
+{
+    if (!connected_ || buff.size() < 4)
+        return false;
+
+    auto itt = script_.find(buff);
+    if (itt != script_.end()) {
+        for (auto const &response : itt->second)
+            pending_.insert(pending_.end(), response.begin(), response.end());
+        return true;
+    }
+
+    // Not in the script, acknowledge like a stick would
+    std::vector<uint8_t> response;
+    switch (buff[2]) {
+    case ant::RESET_SYSTEM:
+        response = Message(ant::STARTUP_MESSAGE, {0x20});
+        break;
+    case ant::REQUEST_MESSAGE:
+        LOG_ERR("No scripted response for request " << MessageDump(buff));
+        return true;
+    case ant::BROADCAST_DATA:
+        // Sent at the next channel period without a response
+        return true;
+    case ant::ACKNOWLEDGE_DATA:
+        response = Message(ant::CHANNEL_RESPONSE, {buff[3], ant::CHANNEL_EVENT, ant::EVENT_TRANSFER_TX_COMPLETED});
+        break;
+    case ant::BURST_TRANSFER_DATA:
+        // Packets are not acknowledged, the last one completes the transfer
+        if (!(buff[3] & BURST_LAST_PACKET))
+            return true;
+        response = Message(ant::CHANNEL_RESPONSE, {static_cast<uint8_t>(buff[3] & BURST_CHANNEL_MASK),
+                                                   ant::CHANNEL_EVENT, ant::EVENT_TRANSFER_TX_COMPLETED});
+        break;
+    default:
+        response = Message(ant::CHANNEL_RESPONSE, {buff[3], buff[2], ant::RESPONSE_NO_ERROR});
+        break;
+    }
+    pending_.insert(pending_.end(), response.begin(), response.end());
+
+    return true;
+}
+
+
+bool ReplayDevice::next_stream_frame(std::vector<uint8_t> &buff)
+{
+    if (stream_.empty())
+        return false;
+
+    if (stream_pos_ == stream_.size()) {
+        if (loops_ != 0 && ++loop_ >= loops_)
+            return false;
+        stream_pos_ = 0;
+    }
+
+    auto const &frame = stream_[stream_pos_++];
+    buff.insert(buff.end(), frame.begin(), frame.end());
+    ++frames_replayed_;
+
+    return true;
+}
+
+
+bool ReplayDevice::Read(std::vector<uint8_t> &buff)
+{
+    if (!connected_)
+        return false;
+
+    // Responses to commands first
+    if (!pending_.empty()) {
+        size_t size = std::min(chunk_size_, pending_.size());
+        buff.insert(buff.end(), pending_.begin(), pending_.begin() + size);
+        pending_.erase(pending_.begin(), pending_.begin() + size);
+        return true;
+    }
+
+    if (mode_ == REAL_TIME) {
+        std::this_thread::sleep_until(next_frame_time_);
+        next_frame_time_ += frame_period_;
+        return next_stream_frame(buff);
+    }
+
+    // Whole frames only, leftover bytes of a split frame go to pending_
+    size_t start = buff.size();
+    while (buff.size() - start < chunk_size_ && next_stream_frame(buff));
+
+    if (buff.size() == start)
+        return false;
+
+    if (buff.size() - start > chunk_size_) {
+        pending_.insert(pending_.end(), buff.begin() + start + chunk_size_, buff.end());
+        buff.resize(start + chunk_size_);
+    }
+
+    return true;
+}
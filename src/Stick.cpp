@@ -19,143 +19,1577 @@
  */
 
 #include "Stick.h"
+#include "Capture.h"
+#include "IdentityCache.h"
+#include "PairingCache.h"
+#include "SpscQueue.h"
+
+#include <poll.h>
+#include <errno.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+
+
+namespace {
+
+uint64_t steady_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+
+struct Stick::Subscriber {
+    static constexpr size_t QUEUE_SIZE = 1024;
+
+    struct Entry {
+        ExtendedMessage msg;
+        // Device read time, steady clock ns
+        uint64_t read_time;
+    };
+
+    int id = 0;
+    MessageFilter filter {};
+    MessageCallback callback {};
+    Histogram *latency = nullptr;
+    SpscQueue<Entry, QUEUE_SIZE> queue {};
+    std::atomic<bool> running {true};
+    std::atomic<bool> sleeping {false};
+    std::mutex mutex {};
+    std::condition_variable wakeup {};
+    std::thread thread {};
+
+    // Producer side, the mutex is only taken when the consumer sleeps
+    void Notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeup.notify_one();
+        }
+    }
+
+    void Run() {
+        Entry entry;
+        while (true) {
+            while (queue.Pop(entry)) {
+                latency->Record(steady_now() - entry.read_time);
+                callback(entry.msg);
+            }
+
+            if (!running.load(std::memory_order_acquire))
+                break;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // The timeout only covers a missed notification
+            wakeup.wait_for(lock, std::chrono::milliseconds(100), [this] {
+                return !queue.Empty() || !running.load(std::memory_order_acquire);
+            });
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running.store(false, std::memory_order_release);
+            wakeup.notify_one();
+        }
+        // The thread owns a reference, it may finish on its own after a
+        // callback stopped its own subscription
+        if (thread.get_id() == std::this_thread::get_id())
+            thread.detach();
+        else if (thread.joinable())
+            thread.join();
+    }
+};
+
+
+uint64_t RxClock::Latency(uint16_t rx_timestamp, uint64_t host_ns)
+{
+    if (!started_ || host_ns < last_host_ns_) {
+        started_ = true;
+        ticks_ = rx_timestamp;
+        window_start_ns_ = host_ns;
+    } else {
+        // The 16 bit counter wraps every 2 s, gaps between messages can be
+        // longer: pick the number of wraps which fits the host clock best
+        uint64_t elapsed_ticks = (host_ns - last_host_ns_) * TICKS_PER_SECOND / 1000000000ULL;
+        uint16_t delta = static_cast<uint16_t>(rx_timestamp - last_timestamp_);
+        uint64_t wraps = elapsed_ticks > delta ? (elapsed_ticks - delta + 0x8000) >> 16 : 0;
+        ticks_ += delta + (wraps << 16);
+    }
+
+    last_timestamp_ = rx_timestamp;
+    last_host_ns_ = host_ns;
+
+    int64_t offset = static_cast<int64_t>(host_ns) - static_cast<int64_t>(ticks_ * 1000000000ULL / TICKS_PER_SECOND);
+
+    if (host_ns - window_start_ns_ >= WINDOW_NS || host_ns == window_start_ns_) {
+        previous_min_offset_ = host_ns == window_start_ns_ ? offset : min_offset_;
+        min_offset_ = offset;
+        window_start_ns_ = host_ns;
+    }
+    min_offset_ = std::min(min_offset_, offset);
+
+    return static_cast<uint64_t>(offset - std::min(min_offset_, previous_min_offset_));
+}
+
+
+Stick::Stick() = default;
+
+
+Stick::~Stick()
+{
+    StopIo();
+}
 
 
 void Stick::AttachDevice(std::unique_ptr<Device> && device)
 {
     LOG_FUNC;
 
-    device_ = std::move(device);
+    device_ = std::move(device);
+}
+
+
+bool Stick::Connect()
+{
+    LOG_FUNC;
+
+    timings_ = StartupTimings {};
+    uint64_t start = steady_now();
+
+    device_->Connect();
+
+    timings_.connect = steady_now() - start;
+
+    return device_->IsConnected();
+}
+
+
+bool Stick::Reset() {
+    uint64_t start = steady_now();
+    ant::error status = reset();
+    timings_.reset = steady_now() - start;
+
+    return status == ant::NO_ERROR ? true : false;
+}
+
+
+ant::error Stick::init_stick()
+{
+    ant::error status = ant::NO_ERROR;
+
+    uint64_t start = steady_now();
+    status |= identify();
+    timings_.identify = steady_now() - start;
+
+    start = steady_now();
+    status |= configure_stick();
+    timings_.configure = steady_now() - start;
+
+    reset_channel_state();
+
+    return status;
+}
+
+
+ant::error Stick::identify()
+{
+    version_.clear();
+
+    ant::error status = query_info();
+
+    std::string path = device_->Path();
+    if (status == ant::NO_ERROR && identity_cache_ && !path.empty())
+        identity_cache_->Record(StickIdentity {path, serial_, channels_, networks_, version_});
+
+    return status;
+}
+
+
+ant::error Stick::configure_stick()
+{
+    ant::error status = ant::NO_ERROR;
+
+    begin_pipeline();
+    status |= set_network_key(ant::AntPlusNetworkKey);
+    status |= set_extended_messages(extended_flags_);
+    status |= end_pipeline();
+
+    return status;
+}
+
+
+void Stick::reset_channel_state()
+{
+    channel_configs_.assign(channels_, std::nullopt);
+    scan_mode_ = false;
+    tx_.Reset();
+    paired_keys_.fill(0);
+}
+
+
+bool Stick::Init()
+{
+    LOG_FUNC;
+
+    if (init_stick() != ant::NO_ERROR)
+        return false;
+
+    uint64_t start = steady_now();
+    bool opened = open_default_channels();
+    timings_.channels = steady_now() - start;
+
+    return opened;
+}
+
+
+bool Stick::open_default_channels()
+{
+    ChannelConfig search {};
+    std::vector<uint32_t> exclusions;
+    bool searching = false;
+
+    for (auto const &config : channel_configs_)
+        if (config && config->device_type == search.device_type && config->device_number == 0)
+            searching = true;
+
+    // Known devices first, one channel stays free for the search
+    if (pairing_cache_ && channels_ > 1) {
+        for (auto const &device : pairing_cache_->Recent(channels_)) {
+            bool open = std::find(paired_keys_.begin(), paired_keys_.end(), device.Key()) != paired_keys_.end();
+            if (!open && (FreeChannels() <= (searching ? 0 : 1) || open_configured_channel(device.Config(), {}) < 0))
+                continue;
+            if (device.device_type == search.device_type && exclusions.size() < MAX_EXCLUSIONS)
+                exclusions.push_back(device.Key());
+        }
+    }
+
+    if (searching)
+        return true;
+
+    // By default search for any HRM, see ChannelConfig defaults
+    return open_configured_channel(search, exclusions) >= 0;
+}
+
+
+bool Stick::WarmStart()
+{
+    LOG_FUNC;
+
+    timings_ = StartupTimings {};
+    if (!warm_start(timings_))
+        return false;
+
+    uint64_t start = steady_now();
+    bool opened = open_default_channels();
+    timings_.channels = steady_now() - start;
+
+    LOG_MSG("Stick " << serial_ << " ready in " << timings_.Total() / 1000 << " us ("
+            << (timings_.warm ? "warm" : "cold") << ")");
+
+    return opened;
+}
+
+
+bool Stick::warm_start(StartupTimings &timings)
+{
+    uint64_t start = steady_now();
+    device_->Connect();
+    timings.connect = steady_now() - start;
+
+    if (!device_->IsConnected())
+        return false;
+
+    ant::error status = ant::NO_ERROR;
+    std::vector<uint8_t> states;
+    StickIdentity cached;
+    std::string path = device_->Path();
+
+    // With a known identity the serial check, the state probe and the
+    // extended messages setting share one round trip
+    start = steady_now();
+    if (identity_cache_ && !path.empty() && identity_cache_->Find(path, cached)) {
+        unsigned serial = 0;
+        states.assign(cached.channels, 0);
+
+        begin_pipeline();
+        status |= get_serial(serial);
+        for (uint8_t channel = 0; channel < cached.channels; ++channel)
+            status |= get_channel_status(channel, states[channel]);
+        status |= set_extended_messages(extended_flags_);
+        status |= end_pipeline();
+
+        if (status == ant::NO_ERROR && serial == cached.serial) {
+            serial_ = cached.serial;
+            version_ = cached.version;
+            channels_ = cached.channels;
+            networks_ = cached.networks;
+            LOG_MSG("Known stick " << serial_ << " on " << path);
+        } else {
+            LOG_MSG("Other stick on " << path << ", identifying");
+            states.clear();
+            status = ant::NO_ERROR;
+        }
+    }
+
+    if (states.empty()) {
+        status |= identify();
+        if (status == ant::NO_ERROR) {
+            states.assign(channels_, 0);
+            begin_pipeline();
+            for (uint8_t channel = 0; channel < channels_; ++channel)
+                status |= get_channel_status(channel, states[channel]);
+            status |= set_extended_messages(extended_flags_);
+            status |= end_pipeline();
+        }
+    }
+    timings.identify = steady_now() - start;
+
+    if (channels_ == 0)
+        return false;
+
+    start = steady_now();
+    reset_channel_state();
+
+    bool adopted = false;
+    if (status == ant::NO_ERROR)
+        status = adopt_channels(states, adopted);
+
+    if (status != ant::NO_ERROR) {
+        LOG_MSG("Stick state unknown, resetting");
+        uint64_t reset_start = steady_now();
+        status = reset();
+        timings.reset = steady_now() - reset_start;
+        if (status != ant::NO_ERROR)
+            return false;
+        reset_channel_state();
+        adopted = false;
+    }
+
+    // Open channels prove that the stick kept the configuration of the
+    // previous run, the network key included
+    status = adopted ? set_extended_messages(extended_flags_) : configure_stick();
+    if (status != ant::NO_ERROR)
+        return false;
+    timings.configure = steady_now() - start - timings.reset;
+    timings.warm = timings.reset == 0;
+
+    return true;
+}
+
+
+bool Stick::Reconnect()
+{
+    LOG_FUNC;
+
+    if (!lost_ && device_->IsConnected())
+        return true;
+
+    DeviceLost();
+    device_->Disconnect();
+
+    // Nothing read before the loss belongs to the new connection
+    framer_.Clear();
+    read_chunk_.clear();
+    read_offset_ = 0;
+    in_flight_.clear();
+    pipeline_ = false;
+    for (auto &burst : bursts_)
+        burst.Abort();
+    rx_clock_.Reset();
+
+    StartupTimings timings;
+    if (!warm_start(timings))
+        return false;
+
+    uint64_t start = steady_now();
+    bool opened = true;
+
+    if (replay_scan_mode_ && !replay_.empty()) {
+        // A stick which was not power cycled may still be scanning
+        if (IsChannelOpen(0)) {
+            std::fill(channel_configs_.begin(), channel_configs_.end(), replay_.front().config);
+            scan_mode_ = true;
+        } else {
+            opened = open_scan_mode(replay_.front().config);
+        }
+    } else {
+        // Devices which have channels of their own are not searched for
+        std::vector<uint32_t> exclusions;
+        for (auto const &replay : replay_)
+            if (replay.config.device_number != 0 && exclusions.size() < MAX_EXCLUSIONS)
+                exclusions.push_back(replay.key);
+
+        for (auto const &replay : replay_) {
+            ChannelConfig const &config = replay.config;
+            bool wildcard = config.device_number == 0;
+            bool adopted = false;
+            for (size_t channel = 0; channel < channel_configs_.size() && !adopted; ++channel) {
+                auto const &open = channel_configs_[channel];
+                if (!open)
+                    continue;
+                // Still tracking its device or still searching. A taken over
+                // wildcard channel reports the id of its device, it keeps the
+                // wildcard configuration for the next replay
+                if (replay.key != 0 && paired_keys_[channel] == replay.key) {
+                    channel_configs_[channel] = config;
+                    adopted = true;
+                } else if (wildcard && open->device_number == 0 && open->device_type == config.device_type) {
+                    adopted = true;
+                }
+            }
+            if (!adopted && open_configured_channel(config, wildcard ? exclusions : std::vector<uint32_t> {}) < 0)
+                opened = false;
+        }
+    }
+    timings.channels = steady_now() - start;
+
+    // The stick stays lost with its channels to replay, the next attempt
+    // takes over the ones which are open by now
+    if (!opened) {
+        LOG_ERR("Stick " << serial_ << " could not reopen all channels, retrying later");
+        return false;
+    }
+
+    LOG_MSG("Stick " << serial_ << " reconnected in " << timings.Total() / 1000 << " us, "
+            << replay_.size() << " channels replayed");
+
+    lost_ = false;
+    replay_.clear();
+    Metrics::Add(metrics_.reconnects);
+
+    return true;
+}
+
+
+uint32_t Stick::channel_key(ChannelConfig const &config)
+{
+    // Like ExtendedMessage::DeviceKey, the transmission type carries the top
+    // nibble of a 20 bit device number
+    uint8_t trans_type = static_cast<uint8_t>(config.trans_type | ((config.device_number >> 12) & 0xF0));
+    return (uint32_t)config.device_type << 24 | (uint32_t)trans_type << 16 | (config.device_number & 0xFFFF);
+}
+
+
+void Stick::DeviceLost()
+{
+    if (lost_)
+        return;
+
+    lost_ = true;
+    lost_since_ = read_time_ != 0 ? read_time_ : steady_now();
+    Metrics::Add(metrics_.disconnects);
+    device_->Disconnect();
+
+    // Wildcard channels are replayed as wildcards, so they keep finding new
+    // devices. The device one had paired with only identifies the channel
+    // when a stick which was not power cycled still tracks it
+    replay_.clear();
+    replay_scan_mode_ = scan_mode_;
+    for (size_t channel = 0; channel < channel_configs_.size(); ++channel) {
+        if (!channel_configs_[channel])
+            continue;
+        ChannelConfig const &config = *channel_configs_[channel];
+        uint32_t key = config.device_number != 0 ? channel_key(config)
+                                                 : scan_mode_ ? 0 : paired_keys_[channel & BURST_CHANNEL_MASK];
+        replay_.push_back(ReplayChannel {config, key});
+        if (scan_mode_)
+            break;
+    }
+
+    LOG_ERR("Stick " << serial_ << " lost");
+}
+
+
+ant::error Stick::adopt_channels(std::vector<uint8_t> const &states, bool &adopted)
+{
+    LOG_FUNC;
+
+    /* Channel status
+     *
+     * | bits 4-7     | bits 2-3       | bits 0-1                                   |
+     * |--------------|----------------|--------------------------------------------|
+     * | Channel type | Network number | 0 unassigned, 1 assigned, 2 searching, 3 tracking |
+     */
+    enum { UNASSIGNED = 0, ASSIGNED = 1, STATE_MASK = 0x03 };
+
+    ant::error status = ant::NO_ERROR;
+    std::vector<ChannelConfig> configs(states.size());
+
+    begin_pipeline();
+    for (uint8_t channel = 0; channel < states.size(); ++channel) {
+        uint8_t state = states[channel] & STATE_MASK;
+        if (state == ASSIGNED)
+            status |= unassign_channel(channel);
+        else if (state != UNASSIGNED)
+            status |= get_channel_id(channel, configs[channel]);
+    }
+    status |= end_pipeline();
+
+    if (status != ant::NO_ERROR)
+        return status;
+
+    auto known = pairing_cache_ ? pairing_cache_->Recent() : std::vector<PairedDevice> {};
+
+    for (uint8_t channel = 0; channel < states.size() && channel < channel_configs_.size(); ++channel) {
+        if ((states[channel] & STATE_MASK) <= ASSIGNED)
+            continue;
+
+        ChannelConfig &config = configs[channel];
+        config.type = static_cast<ant::ChannelType>(states[channel] & 0xF0);
+        config.network = (states[channel] >> 2) & 0x03;
+
+        // Period and frequency cannot be queried, the pairing cache knows
+        // them for the devices it has seen
+        uint32_t key = (uint32_t)config.device_type << 24 | (uint32_t)config.trans_type << 16 | config.device_number;
+        for (auto const &device : known) {
+            if (device.Key() == key) {
+                config.period = device.period;
+                config.frequency = device.frequency;
+                break;
+            }
+        }
+
+        LOG_MSG("Taking over channel " << (unsigned)channel << " device number: " << config.device_number);
+
+        channel_configs_[channel] = config;
+        if (config.type & ant::TRANSMIT_DIRECTION)
+            tx_.Open(channel, config.period);
+        if (config.device_number != 0)
+            paired_keys_[channel] = key;
+        adopted = true;
+    }
+
+    return ant::NO_ERROR;
+}
+
+
+bool Stick::InitScanMode(ChannelConfig const &config)
+{
+    LOG_FUNC;
+
+    if (init_stick() != ant::NO_ERROR)
+        return false;
+
+    return open_scan_mode(config);
+}
+
+
+bool Stick::open_scan_mode(ChannelConfig const &config)
+{
+    if (channel_configs_.empty())
+        return false;
+
+    ant::error status = ant::NO_ERROR;
+
+    // Scan mode is configured through channel 0 and occupies the whole stick
+    begin_pipeline();
+    status |= assign_channel(0, config.network, ant::BIDIRECTIONAL_RECEIVE);
+    status |= set_channel_id(0, config.device_number, config.device_type, config.trans_type);
+    status |= set_channel_frequency(0, config.frequency);
+    status |= open_rx_scan_mode();
+    status |= end_pipeline();
+
+    if (status != ant::NO_ERROR)
+        return false;
+
+    std::fill(channel_configs_.begin(), channel_configs_.end(), config);
+    scan_mode_ = true;
+
+    return true;
+}
+
+
+int Stick::OpenChannel(ChannelConfig const &config)
+{
+    return open_configured_channel(config, {});
+}
+
+
+int Stick::open_configured_channel(ChannelConfig const &config, std::vector<uint32_t> const &exclusions)
+{
+    LOG_FUNC;
+
+    if (scan_mode_) {
+        LOG_ERR("Channels cannot be opened in scan mode");
+        return -1;
+    }
+
+    auto free_slot = std::find(channel_configs_.begin(), channel_configs_.end(), std::nullopt);
+    if (free_slot == channel_configs_.end()) {
+        LOG_ERR("No free channels left");
+        return -1;
+    }
+
+    uint8_t channel_number = static_cast<uint8_t>(free_slot - channel_configs_.begin());
+
+    ant::error status = ant::NO_ERROR;
+
+    // The stick executes commands in order, so the whole chain is written
+    // back to back and the responses are collected at the end
+    begin_pipeline();
+    status |= assign_channel(channel_number, config.network, config.type);
+    status |= set_channel_id(channel_number, config.device_number, config.device_type, config.trans_type);
+    status |= configure_channel(channel_number, config.period, config.search_timeout, config.frequency);
+    if (!exclusions.empty())
+        status |= set_exclusion_list(channel_number, exclusions);
+    status |= open_channel(channel_number);
+    status |= end_pipeline();
+
+    if (status != ant::NO_ERROR) {
+        unassign_channel(channel_number);
+        return -1;
+    }
+
+    *free_slot = config;
+    if (config.type & ant::TRANSMIT_DIRECTION)
+        tx_.Open(channel_number, config.period);
+
+    return channel_number;
+}
+
+
+bool Stick::CloseChannel(uint8_t channel_number)
+{
+    LOG_FUNC;
+
+    if (scan_mode_ || !IsChannelOpen(channel_number))
+        return false;
+
+    ant::error status = ant::NO_ERROR;
+
+    status |= close_channel(channel_number);
+    status |= unassign_channel(channel_number);
+
+    channel_configs_[channel_number].reset();
+    tx_.Close(channel_number);
+    paired_keys_[channel_number & BURST_CHANNEL_MASK] = 0;
+
+    return status == ant::NO_ERROR;
+}
+
+
+bool Stick::IsChannelOpen(uint8_t channel_number) const
+{
+    return channel_number < channel_configs_.size() && channel_configs_[channel_number].has_value();
+}
+
+
+unsigned Stick::FreeChannels() const
+{
+    return std::count(channel_configs_.begin(), channel_configs_.end(), std::nullopt);
+}
+
+
+bool Stick::next_frame(FrameView &frame, bool wait)
+{
+    bool device_read = false;
+
+    while (!framer_.Next(frame))
+        if (!fill_framer(wait, device_read))
+            return false;
+
+    return true;
+}
+
+
+bool Stick::fill_framer(bool wait, bool &device_read)
+{
+    while (read_offset_ == read_chunk_.size()) {
+        if (device_read && !wait)
+            return false;
+        // A poll must not wait in Read of a blocking device
+        if (!wait && device_->ReadMayBlock() && !WaitInput(0))
+            return false;
+
+        read_chunk_.clear();
+        read_offset_ = 0;
+        if (!device_->Read(read_chunk_)) {
+            Metrics::Add(metrics_.read_errors);
+            if (!device_->IsConnected())
+                DeviceLost();
+            return false;
+        }
+        device_read = true;
+
+        if (!read_chunk_.empty()) {
+            Metrics::Add(metrics_.bytes_read, read_chunk_.size());
+            read_time_ = steady_now();
+        }
+
+        // Non-blocking device without data
+        if (read_chunk_.empty() && (!wait || !WaitInput(-1)))
+            return false;
+    }
+
+    read_offset_ += framer_.Write(&read_chunk_[read_offset_], read_chunk_.size() - read_offset_);
+
+    return true;
+}
+
+
+ant::error Stick::next_frame_until(FrameView &frame, std::chrono::steady_clock::time_point deadline)
+{
+    while (!next_frame(frame, false)) {
+        // Not IsConnected, lost_ stays set while Reconnect talks to the stick
+        if (!device_->IsConnected())
+            return ant::NOT_CONNECTED;
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0)
+            return ant::TIMEOUT;
+
+        // Devices without a pollable descriptor are always reported ready
+        if (device_->Handle() < 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        else
+            WaitInput(static_cast<int>(remaining));
+    }
+
+    return ant::NO_ERROR;
+}
+
+
+bool Stick::WaitInput(int timeout_ms)
+{
+    int fd = device_->Handle();
+    if (fd < 0)
+        return true;
+
+    pollfd descriptor {fd, POLLIN, 0};
+    int count;
+    do {
+        count = poll(&descriptor, 1, timeout_ms);
+    } while (count < 0 && errno == EINTR);
+
+    // A hang up is reported as ready, reading then notices the lost device
+    return count > 0 && (descriptor.revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+
+bool Stick::ReadNextMessage(std::vector<uint8_t> &message)
+{
+    LOG_FUNC;
+
+    FrameView frame;
+    if (!next_frame(frame))
+        return false;
+
+    frame.CopyTo(message);
+
+    return true;
+}
+
+
+bool Stick::PollMessage(std::vector<uint8_t> &message)
+{
+    FrameView frame;
+    if (!next_frame(frame, false))
+        return false;
+
+    frame.CopyTo(message);
+
+    return true;
+}
+
+
+bool Stick::parse_extended_msg(FrameView const &buff, ExtendedMessage& ext_msg)
+{
+
+    /* Flagged Extended Data Message Format
+     *
+     * | 1B   | 1B     | 1B  | 1B      | 8B      | 1B   | 0/4B       | 0/3B | 0/2B      | 1B    |
+     * |------|--------|-----|---------|---------|------|------------|------|-----------|-------|
+     * | SYNC | Msg    | Msg | Channel | Payload | Flag | Channel ID | RSSI | Timestamp | Check |
+     * |      | Length | ID  | Number  |         | Byte | 0x80       | 0x40 | 0x20      | sum   |
+     * |      |        |     |         |         |      |            |      |           |       |
+     * | 0    | 1      | 2   | 3       | 4-11    | 12   | 13...      |      |           |       |
+     *
+     * Channel ID: device number (2B), device type, transmission type
+     * RSSI: measurement type, RSSI value (dBm), threshold (dBm)
+     */
+
+    constexpr size_t FLAG_OFFSET = 12;
+    constexpr uint8_t KNOWN_FLAGS = ant::EXT_CHANNEL_ID | ant::EXT_RSSI | ant::EXT_RX_TIMESTAMP;
+
+    if (buff.Size() <= FLAG_OFFSET + 1 or (buff[2] != ant::BROADCAST_DATA and buff[2] != ant::ACKNOWLEDGE_DATA))
+        return false;
+
+    uint8_t flags = buff[FLAG_OFFSET];
+    if (flags == 0 or (flags & ~KNOWN_FLAGS) != 0)
+        return false;
+
+    size_t expected_size = FLAG_OFFSET + 2 +
+        (flags & ant::EXT_CHANNEL_ID ? 4 : 0) +
+        (flags & ant::EXT_RSSI ? 3 : 0) +
+        (flags & ant::EXT_RX_TIMESTAMP ? 2 : 0);
+    if (buff.Size() != expected_size)
+        return false;
+
+    ext_msg.channel_number = buff[3];
+
+    for (int j=0; j<8; j++) {
+        ext_msg.payload[j] = buff[j+4];
+    };
+
+    ext_msg.flags = flags;
+    size_t field = FLAG_OFFSET + 1;
+
+    if (flags & ant::EXT_CHANNEL_ID) {
+        ext_msg.device_number = (uint16_t)buff[field + 1] << 8 | (uint16_t)buff[field];
+        ext_msg.device_type = buff[field + 2];
+        ext_msg.trans_type = buff[field + 3];
+        field += 4;
+    } else {
+        ext_msg.device_number = 0;
+        ext_msg.device_type = 0;
+        ext_msg.trans_type = 0;
+    }
+
+    if (flags & ant::EXT_RSSI) {
+        ext_msg.rssi = static_cast<int8_t>(buff[field + 1]);
+        ext_msg.rssi_threshold = static_cast<int8_t>(buff[field + 2]);
+        field += 3;
+    } else {
+        ext_msg.rssi = 0;
+        ext_msg.rssi_threshold = 0;
+    }
+
+    if (flags & ant::EXT_RX_TIMESTAMP)
+        ext_msg.rx_timestamp = (uint16_t)buff[field + 1] << 8 | (uint16_t)buff[field];
+    else
+        ext_msg.rx_timestamp = 0;
+
+    return true;
+}
+
+
+bool Stick::decode_extended_msg(FrameView const &frame, ExtendedMessage &ext_msg)
+{
+    if (!parse_extended_msg(frame, ext_msg)) {
+        handle_channel_message(frame);
+        return false;
+    }
+
+    metrics_.CountFrame(ext_msg.channel_number, ext_msg.DeviceKey());
+    if (lost_since_ != 0 && !lost_) {
+        metrics_.reconnect_gap.Record(read_time_ - lost_since_);
+        LOG_MSG("Stick " << serial_ << " data back after " << (read_time_ - lost_since_) / 1000000 << " ms");
+        lost_since_ = 0;
+    }
+    if (ext_msg.flags & ant::EXT_CHANNEL_ID)
+        record_pairing(ext_msg);
+    if (ext_msg.flags & ant::EXT_RX_TIMESTAMP)
+        metrics_.radio_latency.Record(rx_clock_.Latency(ext_msg.rx_timestamp, read_time_));
+
+    if (capture_) {
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        capture_->Append(ext_msg, now);
+    }
+
+    return true;
+}
+
+
+void Stick::handle_channel_message(FrameView const &frame)
+{
+    if (frame.Id() == ant::BURST_TRANSFER_DATA) {
+        handle_burst(frame);
+        return;
+    }
+
+    if (frame.Id() != ant::CHANNEL_RESPONSE || frame.Size() < 7)
+        return;
+
+    uint8_t channel_number = frame[3];
+    uint8_t msg_id = frame[4];
+    uint8_t code = frame[5];
+
+    if (msg_id == ant::CHANNEL_EVENT) {
+        handle_channel_event(channel_number, code);
+    } else if ((msg_id == ant::BROADCAST_DATA || msg_id == ant::ACKNOWLEDGE_DATA) && code != ant::RESPONSE_NO_ERROR) {
+        // Data is only answered when the stick rejects it
+        LOG_ERR("Data rejected on channel " << (unsigned)channel_number << " with code " << (unsigned)code);
+        Metrics::Add(metrics_.tx_errors);
+        if (msg_id == ant::ACKNOWLEDGE_DATA)
+            finish_acknowledged(channel_number, false);
+    }
+}
+
+
+void Stick::handle_burst(FrameView const &frame)
+{
+    if (frame.Size() < 13)
+        return;
+
+    uint8_t channel_byte = frame[3];
+    BurstAssembler &burst = bursts_[channel_byte & BURST_CHANNEL_MASK];
+
+    // A new burst cuts off the unfinished one
+    if (burst.InProgress() && BurstAssembler::IsFirst(channel_byte))
+        Metrics::Add(metrics_.burst_receive_errors);
+
+    uint8_t payload[BurstAssembler::PACKET_SIZE];
+    for (size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = frame[i + 4];
+
+    switch (burst.Add(channel_byte, payload, read_time_)) {
+    case BurstAssembler::COMPLETE:
+        Metrics::Add(metrics_.bursts_received);
+        Metrics::Add(metrics_.burst_bytes_received, burst.Size());
+        metrics_.burst_receive_time.Record(burst.Duration());
+        if (burst_callback_)
+            burst_callback_(channel_byte & BURST_CHANNEL_MASK, burst.Data(), burst.Size());
+        break;
+    case BurstAssembler::FAILED:
+        LOG_ERR("Burst packet out of sequence on channel " << (channel_byte & BURST_CHANNEL_MASK));
+        Metrics::Add(metrics_.burst_receive_errors);
+        break;
+    default:
+        break;
+    }
+}
+
+
+void Stick::handle_channel_event(uint8_t channel_number, uint8_t event)
+{
+    switch (event) {
+    case ant::EVENT_TX:
+        serve_tx(channel_number);
+        break;
+    case ant::EVENT_TRANSFER_TX_COMPLETED:
+    case ant::EVENT_TRANSFER_TX_FAILED:
+        // Also the end of outgoing bursts, which SendBurst waits for itself
+        // and which must not end an acknowledged message. An acknowledged
+        // message takes the EVENT_TX of its period
+        if (channel_number != burst_channel_)
+            finish_acknowledged(channel_number, event == ant::EVENT_TRANSFER_TX_COMPLETED);
+        break;
+    case ant::EVENT_TRANSFER_RX_FAILED:
+        if (bursts_[channel_number & BURST_CHANNEL_MASK].Abort())
+            Metrics::Add(metrics_.burst_receive_errors);
+        break;
+    default:
+        break;
+    }
+}
+
+
+void Stick::finish_acknowledged(uint8_t channel_number, bool acknowledged)
+{
+    uint32_t tag;
+    if (!tx_.Complete(channel_number, tag))
+        return;
+
+    Metrics::Add(acknowledged ? metrics_.tx_acknowledged : metrics_.tx_ack_failures);
+    if (tx_callback_)
+        tx_callback_(channel_number, tag, acknowledged);
+
+    // Not a transmission slot, nothing to tick
+    send_tx(channel_number);
+}
+
+
+void Stick::serve_tx(uint8_t channel_number)
+{
+    if (!tx_.IsOpen(channel_number))
+        return;
+
+    int64_t jitter = tx_.Tick(channel_number, read_time_);
+    if (jitter >= 0)
+        metrics_.tx_jitter.Record(static_cast<uint64_t>(jitter));
+
+    if (!send_tx(channel_number))
+        Metrics::Add(metrics_.tx_repeats);
+}
+
+
+bool Stick::send_tx(uint8_t channel_number)
+{
+    TxScheduler::Payload payload;
+    if (!tx_.Take(channel_number, payload))
+        return false;
+
+    uint8_t msg_id = payload.acknowledged ? ant::ACKNOWLEDGE_DATA : ant::BROADCAST_DATA;
+    if (!write_data_message(msg_id, channel_number, payload.data, sizeof(payload.data))) {
+        if (payload.acknowledged)
+            finish_acknowledged(channel_number, false);
+        return true;
+    }
+
+    Metrics::Add(metrics_.tx_messages);
+
+    return true;
+}
+
+
+bool Stick::QueueBroadcast(uint8_t channel_number, const uint8_t *payload)
+{
+    TxScheduler::Payload next {};
+    std::memcpy(next.data, payload, sizeof(next.data));
+
+    return tx_.Queue(channel_number, next);
+}
+
+
+bool Stick::QueueAcknowledged(uint8_t channel_number, const uint8_t *payload, uint32_t tag)
+{
+    TxScheduler::Payload next {};
+    std::memcpy(next.data, payload, sizeof(next.data));
+    next.acknowledged = true;
+    next.tag = tag;
+
+    return tx_.Queue(channel_number, next);
+}
+
+
+bool Stick::write_data_message(uint8_t msg_id, uint8_t channel_byte, const uint8_t *payload, size_t size)
+{
+    auto message = BuildMessage<9>(msg_id, channel_byte, payload, size);
+
+    if (!device_->Write(message)) {
+        Metrics::Add(metrics_.write_errors);
+        return false;
+    }
+    Metrics::Add(metrics_.bytes_written, message.size());
+
+    return true;
+}
+
+
+ant::error Stick::SendBurst(uint8_t channel_number, const uint8_t *data, size_t size)
+{
+    LOG_FUNC;
+
+    // Its end events belong to the burst, not to an acknowledged message
+    burst_channel_ = channel_number;
+    ant::error status = send_burst(channel_number, data, size);
+    burst_channel_ = NO_CHANNEL;
+
+    return status;
+}
+
+
+ant::error Stick::send_burst(uint8_t channel_number, const uint8_t *data, size_t size)
+{
+    constexpr size_t PACKET_SIZE = BurstAssembler::PACKET_SIZE;
+    // Far above the radio time of a packet, which depends on the channel period
+    constexpr int TIMEOUT_MS = 1000;
+    constexpr int PACKET_TIMEOUT_MS = 10;
+
+    if (size == 0 || channel_number > BURST_CHANNEL_MASK)
+        return ant::TRANSFER_FAILED;
+
+    size_t packets = (size + PACKET_SIZE - 1) / PACKET_SIZE;
+    uint64_t start = steady_now();
+    uint8_t end_event = 0;
+
+    for (size_t index = 0; index < packets; ++index) {
+        size_t offset = index * PACKET_SIZE;
+        size_t count = std::min(PACKET_SIZE, size - offset);
+
+        uint8_t channel_byte = channel_number | BurstSequence(index) << BURST_SEQUENCE_SHIFT
+                             | (index + 1 == packets ? BURST_LAST_PACKET : 0);
+
+        if (!write_data_message(ant::BURST_TRANSFER_DATA, channel_byte, data + offset, count)) {
+            Metrics::Add(metrics_.burst_send_errors);
+            return ant::NOT_CONNECTED;
+        }
+
+        // Flow control: the stick buffers only a few packets, so let it take
+        // every window before queueing more, and give up as soon as it
+        // reports a failure instead of streaming the rest into the void
+        if ((index + 1) % BURST_WINDOW == 0 && index + 1 < packets) {
+            if (!device_->Drain()) {
+                Metrics::Add(metrics_.burst_send_errors);
+                return ant::NOT_CONNECTED;
+            }
+            end_event = wait_burst_end(channel_number, 0);
+            if (end_event != 0)
+                break;
+        }
+    }
+
+    if (end_event == 0)
+        end_event = wait_burst_end(channel_number, TIMEOUT_MS + static_cast<int>(packets) * PACKET_TIMEOUT_MS);
+
+    if (end_event != ant::EVENT_TRANSFER_TX_COMPLETED) {
+        LOG_ERR("Burst on channel " << (unsigned)channel_number << " failed with code " << (unsigned)end_event);
+        Metrics::Add(metrics_.burst_send_errors);
+        return ant::TRANSFER_FAILED;
+    }
+
+    uint64_t duration = steady_now() - start;
+    Metrics::Add(metrics_.bursts_sent);
+    Metrics::Add(metrics_.burst_bytes_sent, size);
+    metrics_.burst_send_time.Record(duration);
+    LOG_MSG("Burst of " << size << " bytes sent at " << size * 1e9 / std::max<uint64_t>(duration, 1) << " B/s");
+
+    return ant::NO_ERROR;
+}
+
+
+uint8_t Stick::wait_burst_end(uint8_t channel_number, int timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    FrameView frame;
+    ExtendedMessage ext_msg;
+
+    for (;;) {
+        // Data messages and incoming bursts are decoded as usual meanwhile,
+        // data messages are kept for the next read
+        while (next_frame(frame, false)) {
+            if (decode_extended_msg(frame, ext_msg)) {
+                keep_message(ext_msg);
+                continue;
+            }
+            if (frame.Size() < 7
+                || frame.Id() != ant::CHANNEL_RESPONSE || (frame[3] & BURST_CHANNEL_MASK) != channel_number)
+                continue;
+
+            uint8_t code = frame[5];
+            if (frame[4] == ant::CHANNEL_EVENT) {
+                if (code == ant::EVENT_TRANSFER_TX_COMPLETED || code == ant::EVENT_TRANSFER_TX_FAILED
+                    || code == ant::EVENT_SERIAL_QUE_OVERFLOW)
+                    return code;
+            } else if (frame[4] == ant::BURST_TRANSFER_DATA && code != ant::RESPONSE_NO_ERROR) {
+                // TRANSFER_IN_PROGRESS, TRANSFER_SEQUENCE_NUMBER_ERROR...
+                return code;
+            }
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0)
+            return 0;
+
+        // Devices without a pollable descriptor are always reported ready
+        if (device_->Handle() < 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        else
+            WaitInput(static_cast<int>(remaining));
+    }
+}
+
+
+void Stick::record_pairing(ExtendedMessage const &ext_msg)
+{
+    // Scan mode receives every device on channel 0 without pairing
+    uint8_t channel_number = ext_msg.channel_number;
+    if (scan_mode_ || channel_number >= channel_configs_.size() || !channel_configs_[channel_number])
+        return;
+
+    uint32_t key = ext_msg.DeviceKey();
+    if (paired_keys_[channel_number] == key)
+        return;
+    paired_keys_[channel_number] = key;
+
+    if (!pairing_cache_)
+        return;
+
+    ChannelConfig const &config = *channel_configs_[channel_number];
+    pairing_cache_->Record(PairedDevice {
+        ext_msg.device_number, ext_msg.device_type, ext_msg.trans_type,
+        config.period, config.frequency, config.network, static_cast<int64_t>(std::time(nullptr))});
+}
+
+
+bool Stick::StartCapture(std::string const &base_path, size_t segment_records, unsigned max_segments)
+{
+    LOG_FUNC;
+
+    auto capture = std::unique_ptr<CaptureWriter>(new CaptureWriter(base_path, segment_records, max_segments));
+    if (!capture->Open())
+        return false;
+
+    capture_ = std::move(capture);
+
+    return true;
 }
 
 
-bool Stick::Connect()
+void Stick::StopCapture()
 {
     LOG_FUNC;
 
-    device_->Connect();
+    capture_.reset();
+}
 
-    return device_->IsConnected();
+
+void Stick::keep_message(ExtendedMessage const &ext_msg)
+{
+    if (kept_messages_.size() >= MAX_KEPT_MESSAGES) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    kept_messages_.push_back(ext_msg);
 }
 
 
-bool Stick::Reset() {
-    return reset() == ant::NO_ERROR ? true : false;
+bool Stick::take_kept_message(ExtendedMessage &ext_msg)
+{
+    if (kept_messages_.empty())
+        return false;
+
+    ext_msg = kept_messages_.front();
+    kept_messages_.pop_front();
+
+    return true;
 }
 
 
-bool Stick::Init()
+bool Stick::ReadExtendedMsg(ExtendedMessage& ext_msg)
 {
     LOG_FUNC;
 
-    ant::error status = ant::NO_ERROR;
+    if (take_kept_message(ext_msg))
+        return true;
 
-    status |= query_info();
-    status |= set_network_key(ant::AntPlusNetworkKey);
-    // For code simplification, we set some defaults with zero values
-    // TODO: Add default values to Defaults.h
-    status |= assign_channel(0/*network*/, 0/*channel*/);
-    status |= set_channel_id(0/*channel*/, 0/*device*/, HRM::ANT_DEVICE_TYPE);
-    status |= configure_channel(0/*channel*/, HRM::CHANNEL_PERIOD, HRM::SEARCH_TIMEOUT, HRM::CHANNEL_FREQUENCY);
-    status |= set_extended_messages(true);
-    status |= open_channel(0);
+    FrameView buff;
+    if (!next_frame(buff))
+        return false;
 
-    if (status != ant::NO_ERROR)
+    if (!decode_extended_msg(buff, ext_msg)) {
+        LOG_ERR("This message is not extended data message");
         return false;
+    }
 
     return true;
 }
 
 
-bool Stick::ReadNextMessage(std::vector<uint8_t> &message)
+bool Stick::PollExtendedMsg(ExtendedMessage& ext_msg)
 {
-    LOG_FUNC;
+    if (take_kept_message(ext_msg))
+        return true;
 
-    // Try to find SYNC_BYTE
-    do {
-        auto itt = std::find(stored_chunk_.begin(), stored_chunk_.end(), ant::SYNC_BYTE);
-        if (itt != stored_chunk_.end()) {
-            stored_chunk_.erase(stored_chunk_.begin(), itt);
+    FrameView buff;
+
+    // Skip channel events and other non data messages
+    while (next_frame(buff, false))
+        if (decode_extended_msg(buff, ext_msg))
+            return true;
+
+    return false;
+}
+
+
+size_t Stick::ReadExtendedBatch(std::vector<ExtendedMessage> &batch, size_t max_size)
+{
+    batch.clear();
+
+    if (max_size == 0)
+        return 0;
+
+    FrameView buff;
+    ExtendedMessage ext_msg;
+
+    // Channel events are expected in scan mode, skip them silently
+    if (kept_messages_.empty()) {
+        do {
+            if (!next_frame(buff))
+                return 0;
+        } while (!decode_extended_msg(buff, ext_msg));
+
+        batch.push_back(ext_msg);
+    }
+    poll_extended_batch(batch, max_size);
+
+    return batch.size();
+}
+
+
+void Stick::poll_extended_batch(std::vector<ExtendedMessage> &batch, size_t max_size)
+{
+    constexpr size_t BATCH_FRAMES = 64;
+    FrameView frames[BATCH_FRAMES];
+    ExtendedMessage ext_msg;
+    bool device_read = false;
+
+    while (batch.size() < max_size && take_kept_message(ext_msg))
+        batch.push_back(ext_msg);
+
+    while (batch.size() < max_size) {
+        size_t count = framer_.NextBatch(frames, std::min(BATCH_FRAMES, max_size - batch.size()));
+
+        for (size_t i = 0; i < count; ++i)
+            if (decode_extended_msg(frames[i], ext_msg))
+                batch.push_back(ext_msg);
+
+        if (count == 0 && !fill_framer(false, device_read))
             break;
-        }
-        device_->Read(stored_chunk_);
-    } while(true);
+    }
+}
+
+
+MetricsSnapshot Stick::Snapshot() const
+{
+    MetricsSnapshot snapshot;
+    metrics_.Fill(snapshot);
+
+    FrameStats framing = framer_.Stats();
+    snapshot.frames = framing.frames;
+    snapshot.corrupt_frames = framing.corrupt_frames;
+    snapshot.dropped_bytes = framing.dropped_bytes;
+    snapshot.dropped_messages = DroppedMessages();
+    snapshot.startup = {
+        {"connect", timings_.connect}, {"identify", timings_.identify}, {"reset", timings_.reset},
+        {"configure", timings_.configure}, {"channels", timings_.channels}};
+
+    for (auto const &subscriber : *std::atomic_load(&subscribers_))
+        snapshot.queue_depths.push_back(subscriber->queue.Size());
+
+    return snapshot;
+}
+
+
+int Stick::Subscribe(MessageFilter const &filter, MessageCallback callback)
+{
+    LOG_FUNC;
+
+    if (!device_ || !callback)
+        return -1;
 
-    // If message size <4 get new portion
-    while (stored_chunk_.size() < 4)
-        device_->Read(stored_chunk_);
+    std::lock_guard<std::mutex> lock(subscribers_mutex_);
 
-    unsigned int len = (unsigned int)stored_chunk_[1] + 4; // Total lenght is SYNC + LEN + MSGID + DATA
-    while (stored_chunk_.size() < len)
-        device_->Read(stored_chunk_);
+    auto subscriber = std::make_shared<Subscriber>();
+    subscriber->id = next_subscriber_id_++;
+    subscriber->filter = filter;
+    subscriber->callback = std::move(callback);
+    subscriber->latency = &metrics_.delivery_latency;
+    subscriber->thread = std::thread([subscriber] () { subscriber->Run(); });
 
-    message = std::vector<uint8_t>(stored_chunk_.begin(), stored_chunk_.begin() + len);
-    stored_chunk_.erase(stored_chunk_.begin(), stored_chunk_.begin() + len);
+    auto subscribers = std::make_shared<SubscriberList>(*subscribers_);
+    subscribers->push_back(subscriber);
+    std::atomic_store(&subscribers_, std::shared_ptr<const SubscriberList>(std::move(subscribers)));
+
+    if (!io_running_.exchange(true))
+        io_thread_ = std::thread(&Stick::io_loop, this);
+
+    return subscriber->id;
+}
+
+
+bool Stick::Unsubscribe(int id)
+{
+    LOG_FUNC;
+
+    std::shared_ptr<Subscriber> subscriber;
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex_);
+
+        auto subscribers = std::make_shared<SubscriberList>(*subscribers_);
+        auto it = std::find_if(subscribers->begin(), subscribers->end(),
+                               [id] (auto const &s) { return s->id == id; });
+        if (it == subscribers->end())
+            return false;
+
+        subscriber = *it;
+        subscribers->erase(it);
+        std::atomic_store(&subscribers_, std::shared_ptr<const SubscriberList>(std::move(subscribers)));
+    }
+
+    // Messages already queued are still delivered
+    subscriber->Stop();
 
     return true;
 }
 
 
-bool Stick::ReadExtendedMsg(ExtendedMessage& ext_msg)
+void Stick::StopIo()
 {
+    if (io_running_.exchange(false))
+        io_thread_.join();
 
-    /* Flagged Extended Data Message Format
-     *
-     * | 1B   | 1B     | 1B  | 1B      | 8B      | 1B   | 2B     | 1B     | 1B    | 1B    |
-     * |------|--------|-----|---------|---------|------|--------|--------|-------|-------|
-     * | SYNC | Msg    | Msg | Channel | Payload | Flag | Device | Device | Trans | Check |
-     * |      | Length | ID  | Number  |         | Byte | Number | Type   | Type  | sum   |
-     * |      |        |     |         |         |      |        |        |       |       |
-     * | 0    | 1      | 2   | 3       | 4-11    | 12   | 13,14  | 15     | 16    | 17    |
-     */
+    std::shared_ptr<const SubscriberList> subscribers;
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex_);
+        subscribers = std::atomic_exchange(&subscribers_, std::shared_ptr<const SubscriberList>(
+                                               std::make_shared<SubscriberList>()));
+    }
 
-    LOG_FUNC;
+    for (auto &subscriber : *subscribers)
+        subscriber->Stop();
+}
 
-    std::vector<uint8_t> buff {};
 
-    device_->Read(buff);
-    if (buff.size() != 18 or buff[2] != 0x4e or buff[12] != 0x80) {
-        LOG_ERR("This message is not extended data message");
-        return false;
+void Stick::io_loop()
+{
+    constexpr int POLL_TIMEOUT_MS = 100;
+    constexpr int RECONNECT_INTERVAL_MS = 500;
+    constexpr size_t BATCH_SIZE = 256;
+    std::vector<ExtendedMessage> batch;
+    batch.reserve(BATCH_SIZE);
+
+    while (io_running_.load(std::memory_order_relaxed)) {
+        // Nothing tells a standalone stick when the device is back
+        if (lost_) {
+            if (!Reconnect())
+                std::this_thread::sleep_for(std::chrono::milliseconds(RECONNECT_INTERVAL_MS));
+            continue;
+        }
+
+        if (kept_messages_.empty() && !WaitInput(POLL_TIMEOUT_MS))
+            continue;
+
+        auto subscribers = std::atomic_load(&subscribers_);
+        size_t count = 0;
+
+        do {
+            batch.clear();
+            poll_extended_batch(batch, BATCH_SIZE);
+            count += batch.size();
+
+            for (auto &subscriber : *subscribers) {
+                bool pushed = false;
+                for (auto const &msg : batch) {
+                    if (!subscriber->filter.Matches(msg))
+                        continue;
+                    // Never block the serial port on a slow subscriber
+                    if (subscriber->queue.Push({msg, read_time_}))
+                        pushed = true;
+                    else
+                        dropped_.fetch_add(1, std::memory_order_relaxed);
+                }
+                if (pushed)
+                    subscriber->Notify();
+            }
+        } while (batch.size() == BATCH_SIZE && io_running_.load(std::memory_order_relaxed));
+
+        // Devices without a pollable descriptor are always reported ready
+        if (count == 0 && device_->Handle() < 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
+}
 
-    ext_msg.channel_number = buff[3];
 
-    for (int j=0; j<8; j++) {
-        ext_msg.payload[j] = buff[j+4];
-    };
+uint16_t Stick::response_key(uint8_t channel, uint8_t msg_id)
+{
+    return static_cast<uint16_t>(channel << 8 | msg_id);
+}
 
-    ext_msg.device_number = (uint16_t)buff[14] << 8 | (uint16_t)buff[13];
-    ext_msg.device_type = buff[15];
-    ext_msg.trans_type = buff[16];
 
-    return true;
+uint16_t Stick::response_key(const std::vector<uint8_t> &response)
+{
+    // Channel responses are matched by channel (or network) and command id,
+    // everything else can only be matched by the message id
+    if (response[2] == ant::CHANNEL_RESPONSE && response.size() >= 6 && response[4] != ant::CHANNEL_EVENT)
+        return response_key(response[3], response[4]);
+
+    // Channel status and id requests are answered per channel
+    if ((response[2] == ant::RESPONSE_CHANNEL_STATUS || response[2] == ant::RESPONSE_CHANNEL_ID) && response.size() >= 5)
+        return response_key(response[3], response[2]);
+
+    return response_key(NO_CHANNEL, response[2]);
 }
 
 
-ant::error Stick::do_command(const std::vector<uint8_t> &message,
+ant::error Stick::do_command(const uint8_t *message, size_t size,
                              std::function<ant::error (const std::vector<uint8_t>&)> check_func,
                              uint8_t response_msg_type)
 {
     LOG_FUNC;
 
-    LOG_MSG("Write: " << MessageDump(message));
-    device_->Write(std::move(message));
+    uint16_t key = response_msg_type == ant::CHANNEL_RESPONSE
+        ? response_key(message[3], message[2])
+        : response_msg_type == ant::RESPONSE_CHANNEL_STATUS || response_msg_type == ant::RESPONSE_CHANNEL_ID
+        ? response_key(message[3], response_msg_type)
+        : response_key(NO_CHANNEL, response_msg_type);
+
+    ant::error status = ant::NO_ERROR;
+
+    // The response could not be told apart from the one already in flight
+    if (in_flight_.count(key) || in_flight_.size() >= MAX_IN_FLIGHT_COMMANDS)
+        status |= wait_commands();
+
+    LOG_DUMP_BYTES("Write:", message, size);
+    if (!device_->Write(message, size)) {
+        Metrics::Add(metrics_.write_errors);
+        return status | ant::error(ant::NOT_CONNECTED);
+    }
+    Metrics::Add(metrics_.bytes_written, size);
+    Metrics::Add(metrics_.commands);
+
+    in_flight_.emplace(key, InFlightCommand {std::move(check_func), std::chrono::steady_clock::now()});
+
+    if (pipeline_) {
+        pipeline_status_ |= status;
+        return ant::NO_ERROR;
+    }
+
+    return status | wait_commands();
+}
+
+
+ant::error Stick::wait_commands()
+{
+    LOG_FUNC;
+
+    ant::error status = ant::NO_ERROR;
 
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RESPONSE_TIMEOUT_MS);
+    FrameView frame;
+    ExtendedMessage ext_msg;
     std::vector<uint8_t> response_msg {};
-    do {
-        ReadNextMessage(response_msg);
-    } while (response_msg[2] != response_msg_type);
+    while (!in_flight_.empty()) {
+        ant::error read_status = next_frame_until(frame, deadline);
+        if (read_status != ant::NO_ERROR) {
+            if (read_status == ant::TIMEOUT)
+                LOG_ERR("No response to " << in_flight_.size() << " commands");
+            in_flight_.clear();
+            return status | read_status;
+        }
+        frame.CopyTo(response_msg);
+
+        // Data messages of opened channels are kept for the next read, channel
+        // events (e.g. EVENT_TX of master channels) are served as usual
+        auto itt = in_flight_.find(response_key(response_msg));
+        if (itt == in_flight_.end()) {
+            if (decode_extended_msg(frame, ext_msg))
+                keep_message(ext_msg);
+            continue;
+        }
 
-    LOG_MSG("Read: " << MessageDump(response_msg));
+        LOG_DUMP("Read:", response_msg);
 
-    ant::error status = check_func(response_msg);
-    if (status != ant::NO_ERROR) {
-        LOG_ERR("Returns with error status: " << status);
-        return status;
+        metrics_.command_round_trip.Record(std::chrono::steady_clock::now() - itt->second.sent);
+
+        ant::error command_status = itt->second.check(response_msg);
+        if (command_status != ant::NO_ERROR) {
+            LOG_ERR("Returns with error status: " << command_status);
+            Metrics::Add(metrics_.command_errors);
+        }
+
+        status |= command_status;
+        in_flight_.erase(itt);
     }
 
-    return ant::NO_ERROR;
+    return status;
+}
+
+
+void Stick::begin_pipeline()
+{
+    pipeline_ = true;
+    pipeline_status_ = ant::NO_ERROR;
+}
+
+
+ant::error Stick::end_pipeline()
+{
+    pipeline_ = false;
+
+    return pipeline_status_ | wait_commands();
 }
 
 
@@ -163,7 +1597,9 @@ ant::error Stick::reset()
 {
     LOG_FUNC;
 
-    return this->do_command(Message(ant::RESET_SYSTEM, {0}),
+    constexpr auto message = MakeMessage<ant::RESET_SYSTEM>(0);
+
+    return this->do_command(message,
            [] (const std::vector<uint8_t>& buff) -> ant::error {
                if (buff.size() < 2) {
                    LOG_ERR("unexpected message");
@@ -181,13 +1617,14 @@ ant::error Stick::query_info()
 
     ant::error status = ant::NO_ERROR;
 
+    begin_pipeline();
     status |= get_serial(serial_);
-    LOG_MSG("Serial: " << serial_);
-
     status |= get_version(version_);
-    LOG_MSG("Version: " << version_);
-
     status |= get_capabilities(channels_, networks_);
+    status |= end_pipeline();
+
+    LOG_MSG("Serial: " << serial_);
+    LOG_MSG("Version: " << version_);
     LOG_MSG("Channels: " << channels_ << " NetWorks: " << networks_);
 
     return status;
@@ -198,7 +1635,9 @@ ant::error Stick::get_serial(unsigned &serial)
 {
     LOG_FUNC;
 
-    return this->do_command(Message(ant::REQUEST_MESSAGE, {0, ant::RESPONSE_SERIAL_NUMBER}),
+    constexpr auto message = MakeMessage<ant::REQUEST_MESSAGE>(0, ant::RESPONSE_SERIAL_NUMBER);
+
+    return this->do_command(message,
            [&serial] (std::vector<uint8_t> const &buff) -> ant::error {
                serial = buff[3] | (buff[4] << 8) | (buff[5] << 16) | (buff[6] << 24);
                return ant::NO_ERROR;
@@ -211,7 +1650,9 @@ ant::error Stick::get_version(std::string& version)
 {
     LOG_FUNC;
 
-    return this->do_command(Message(ant::REQUEST_MESSAGE, {0, ant::RESPONSE_VERSION}),
+    constexpr auto message = MakeMessage<ant::REQUEST_MESSAGE>(0, ant::RESPONSE_VERSION);
+
+    return this->do_command(message,
            [&version] (std::vector<uint8_t> const &buff) -> ant::error {
            // TODO: Append a string length check by getting the message length from message field
                version += reinterpret_cast<const char *>(&buff[3]);
@@ -225,7 +1666,9 @@ ant::error Stick::get_capabilities(unsigned &max_channels, unsigned &max_network
 {
     LOG_FUNC;
 
-    return this->do_command(Message(ant::REQUEST_MESSAGE, {0, ant::RESPONSE_CAPABILITIES}),
+    constexpr auto message = MakeMessage<ant::REQUEST_MESSAGE>(0, ant::RESPONSE_CAPABILITIES);
+
+    return this->do_command(message,
            [&max_channels, &max_networks] (std::vector<uint8_t> const &buff) -> ant::error {
                max_channels = (unsigned)buff[3];
                max_networks = (unsigned)buff[4];
@@ -235,6 +1678,38 @@ ant::error Stick::get_capabilities(unsigned &max_channels, unsigned &max_network
 }
 
 
+ant::error Stick::get_channel_status(uint8_t channel_number, uint8_t &status)
+{
+    LOG_FUNC;
+
+    return this->do_command(MakeMessage<ant::REQUEST_MESSAGE>(channel_number, ant::RESPONSE_CHANNEL_STATUS),
+           [&status] (std::vector<uint8_t> const &buff) -> ant::error {
+               if (buff.size() < 6)
+                   return ant::UNEXPECTED_MESSAGE;
+               status = buff[4];
+               return ant::NO_ERROR;
+           },
+           ant::RESPONSE_CHANNEL_STATUS);
+}
+
+
+ant::error Stick::get_channel_id(uint8_t channel_number, ChannelConfig &config)
+{
+    LOG_FUNC;
+
+    return this->do_command(MakeMessage<ant::REQUEST_MESSAGE>(channel_number, ant::RESPONSE_CHANNEL_ID),
+           [&config] (std::vector<uint8_t> const &buff) -> ant::error {
+               if (buff.size() < 9)
+                   return ant::UNEXPECTED_MESSAGE;
+               config.device_number = buff[4] | (buff[5] << 8);
+               config.device_type = buff[6];
+               config.trans_type = buff[7];
+               return ant::NO_ERROR;
+           },
+           ant::RESPONSE_CHANNEL_ID);
+}
+
+
 ant::error Stick::check_channel_response(const std::vector<uint8_t> &response, uint8_t channel, uint8_t cmd, uint8_t status)
 {
     LOG_FUNC;
@@ -259,32 +1734,42 @@ ant::error Stick::set_network_key(const std::vector<uint8_t> & network_key)
 {
     LOG_FUNC;
 
-    return this->do_command(Message(ant::SET_NETWORK_KEY, std::move(network_key)),
-           [&] (const std::vector<uint8_t>& buff) -> ant::error {
-               return this->check_channel_response(buff, network_key[0], ant::SET_NETWORK_KEY, 0);
+    uint8_t network = network_key[0];
+
+    return this->do_command(Message(ant::SET_NETWORK_KEY, network_key),
+           [this, network] (const std::vector<uint8_t>& buff) -> ant::error {
+               return this->check_channel_response(buff, network, ant::SET_NETWORK_KEY, 0);
            },
            ant::CHANNEL_RESPONSE);
 }
 
 
-ant::error Stick::set_extended_messages(bool enable = false)
+ant::error Stick::set_extended_messages(uint8_t flags)
 {
     LOG_FUNC;
 
-    return this->do_command({Message(ant::ENABLE_EXT_RX_MESGS, {0, static_cast<uint8_t>(enable ? 1 : 0)})},
-                [] (const std::vector<uint8_t>& buff) -> ant::error {
-                    return ant::NO_ERROR;
+    // Sticks without LIB_CONFIG (e.g. the first ANT USB stick) only know the
+    // legacy switch, which is enough for the channel id
+    if ((flags & ~ant::EXT_CHANNEL_ID) == 0)
+        return this->do_command(MakeMessage<ant::ENABLE_EXT_RX_MESGS>(0, flags ? 1 : 0),
+                    [this] (const std::vector<uint8_t>& buff) -> ant::error {
+                        return this->check_channel_response(buff, 0, ant::ENABLE_EXT_RX_MESGS, 0);
+                  },
+                  ant::CHANNEL_RESPONSE);
+
+    return this->do_command(MakeMessage<ant::LIB_CONFIG>(0, flags),
+                [this] (const std::vector<uint8_t>& buff) -> ant::error {
+                    return this->check_channel_response(buff, 0, ant::LIB_CONFIG, 0);
               },
               ant::CHANNEL_RESPONSE);
 }
 
 
-ant::error Stick::assign_channel(uint8_t channel_number, uint8_t network_number)
+ant::error Stick::assign_channel(uint8_t channel_number, uint8_t network_number, ant::ChannelType type)
 {
     LOG_FUNC;
 
-    ant::error status = this->do_command(Message(ant::ASSIGN_CHANNEL, {
-                channel_number, ant::BIDIRECTIONAL_RECEIVE, network_number}),
+    ant::error status = this->do_command(MakeMessage<ant::ASSIGN_CHANNEL>(channel_number, type, network_number),
            [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
                return this->check_channel_response(buff, channel_number, ant::ASSIGN_CHANNEL, 0);
            },
@@ -297,19 +1782,19 @@ ant::error Stick::assign_channel(uint8_t channel_number, uint8_t network_number)
 }
 
 
-ant::error Stick::set_channel_id(uint8_t channel_number, uint32_t device_number, uint8_t device_type)
+ant::error Stick::set_channel_id(uint8_t channel_number, uint32_t device_number, uint8_t device_type,
+                                 uint8_t trans_type)
 {
     LOG_FUNC;
 
-    ant::error status = this->do_command(Message(ant::SET_CHANNEL_ID, {
+    ant::error status = this->do_command(MakeMessage<ant::SET_CHANNEL_ID>(
                                          channel_number,
-                                         static_cast<uint8_t>(device_number & 0xFF),
-                                         static_cast<uint8_t>((device_number >> 8) & 0xFF),
+                                         device_number & 0xFF,
+                                         (device_number >> 8) & 0xFF,
                                          device_type,
                                          // High nibble of the transmission_type is the top 4 bits
                                          // of the 20 bit device id.
-                                         static_cast<uint8_t>((device_number >> 12) & 0xF0)
-                                         }),
+                                         trans_type | ((device_number >> 12) & 0xF0)),
            [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
                return this->check_channel_response(buff, channel_number, ant::SET_CHANNEL_ID, 0);
            },
@@ -330,25 +1815,60 @@ ant::error Stick::configure_channel(uint8_t channel_number, uint32_t period, uin
 
     ant::error status = ant::NO_ERROR;
 
-    status |= this->do_command({Message(ant::SET_CHANNEL_PERIOD, {
-                    channel_number, static_cast<uint8_t>(period & 0xff), static_cast<uint8_t>(period >> 8 & 0xff)
-                })},
+    status |= this->do_command(MakeMessage<ant::SET_CHANNEL_PERIOD>(channel_number, period & 0xff, period >> 8 & 0xff),
                 [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
                     return this->check_channel_response(buff, channel_number, ant::SET_CHANNEL_PERIOD, 0);
               },
               ant::CHANNEL_RESPONSE);
 
-    status |= this->do_command({Message(ant::SET_CHANNEL_SEARCH_TIMEOUT, {channel_number, timeout})},
+    status |= this->do_command(MakeMessage<ant::SET_CHANNEL_SEARCH_TIMEOUT>(channel_number, timeout),
                 [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
                     return this->check_channel_response(buff, channel_number, ant::SET_CHANNEL_SEARCH_TIMEOUT, 0);
               },
               ant::CHANNEL_RESPONSE);
 
-    status |= this->do_command({Message(ant::SET_CHANNEL_RF_FREQ, {channel_number, frequency})},
+    status |= set_channel_frequency(channel_number, frequency);
+
+    return status;
+}
+
+
+ant::error Stick::set_channel_frequency(uint8_t channel_number, uint8_t frequency)
+{
+    LOG_FUNC;
+
+    return this->do_command(MakeMessage<ant::SET_CHANNEL_RF_FREQ>(channel_number, frequency),
                 [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
                     return this->check_channel_response(buff, channel_number, ant::SET_CHANNEL_RF_FREQ, 0);
               },
               ant::CHANNEL_RESPONSE);
+}
+
+
+ant::error Stick::set_exclusion_list(uint8_t channel_number, std::vector<uint32_t> const &keys)
+{
+    LOG_FUNC;
+
+    ant::error status = ant::NO_ERROR;
+    uint8_t size = static_cast<uint8_t>(std::min(keys.size(), MAX_EXCLUSIONS));
+
+    for (uint8_t index = 0; index < size; ++index) {
+        uint32_t key = keys[index];
+        status |= this->do_command(MakeMessage<ant::ADD_CHANNEL_ID>(
+                                       channel_number, static_cast<uint8_t>(key), static_cast<uint8_t>(key >> 8),
+                                       static_cast<uint8_t>(key >> 24), static_cast<uint8_t>(key >> 16), index),
+                    [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
+                        return this->check_channel_response(buff, channel_number, ant::ADD_CHANNEL_ID, 0);
+                  },
+                  ant::CHANNEL_RESPONSE);
+    }
+
+    // The list holds device ids the channel must not pair with
+    status |= this->do_command(MakeMessage<ant::CONFIG_LIST>(channel_number, size, 1),
+                [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
+                    return this->check_channel_response(buff, channel_number, ant::CONFIG_LIST, 0);
+              },
+              ant::CHANNEL_RESPONSE);
 
     return status;
 }
@@ -358,9 +1878,80 @@ ant::error Stick::open_channel(uint8_t channel_number)
 {
     LOG_FUNC;
 
-    return this->do_command({Message(ant::OPEN_CHANNEL, {channel_number})},
+    return this->do_command(MakeMessage<ant::OPEN_CHANNEL>(channel_number),
                 [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
                     return this->check_channel_response(buff, channel_number, ant::OPEN_CHANNEL, 0);
               },
               ant::CHANNEL_RESPONSE);
 }
+
+
+ant::error Stick::open_rx_scan_mode()
+{
+    LOG_FUNC;
+
+    // The only data byte is a filler, the response refers to channel 0
+    constexpr auto message = MakeMessage<ant::OPEN_RX_SCAN_MODE>(0);
+
+    return this->do_command(message,
+                [this] (const std::vector<uint8_t>& buff) -> ant::error {
+                    return this->check_channel_response(buff, 0, ant::OPEN_RX_SCAN_MODE, 0);
+              },
+              ant::CHANNEL_RESPONSE);
+}
+
+
+ant::error Stick::close_channel(uint8_t channel_number)
+{
+    LOG_FUNC;
+
+    ant::error status = this->do_command(MakeMessage<ant::CLOSE_CHANNEL>(channel_number),
+                [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
+                    return this->check_channel_response(buff, channel_number, ant::CLOSE_CHANNEL, 0);
+              },
+              ant::CHANNEL_RESPONSE);
+
+    if (status != ant::NO_ERROR)
+        return status;
+
+    // The channel can be unassigned only after it is really closed
+    return wait_channel_event(channel_number, ant::EVENT_CHANNEL_CLOSED);
+}
+
+
+ant::error Stick::unassign_channel(uint8_t channel_number)
+{
+    LOG_FUNC;
+
+    return this->do_command(MakeMessage<ant::UNASSIGN_CHANNEL>(channel_number),
+                [this, channel_number] (const std::vector<uint8_t>& buff) -> ant::error {
+                    return this->check_channel_response(buff, channel_number, ant::UNASSIGN_CHANNEL, 0);
+              },
+              ant::CHANNEL_RESPONSE);
+}
+
+
+ant::error Stick::wait_channel_event(uint8_t channel_number, uint8_t event)
+{
+    LOG_FUNC;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RESPONSE_TIMEOUT_MS);
+    FrameView frame;
+    ExtendedMessage ext_msg;
+    for (;;) {
+        ant::error status = next_frame_until(frame, deadline);
+        if (status != ant::NO_ERROR)
+            return status;
+
+        if (frame.Size() >= 6
+            && frame.Id() == ant::CHANNEL_RESPONSE
+            && frame[3] == channel_number
+            && frame[4] == ant::CHANNEL_EVENT
+            && frame[5] == event)
+            return ant::NO_ERROR;
+
+        // Other frames are served and kept like in wait_commands
+        if (decode_extended_msg(frame, ext_msg))
+            keep_message(ext_msg);
+    }
+}
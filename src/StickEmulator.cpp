@@ -0,0 +1,631 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "StickEmulator.h"
+#include "Log.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+
+namespace {
+
+uint64_t steady_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t period_ns(uint16_t period)
+{
+    return 1000000000ULL * period / 32768;
+}
+
+// Counters have a single writer, the emulator thread
+void add(std::atomic<uint64_t> &counter, uint64_t value = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+} // namespace
+
+
+StickEmulator::~StickEmulator()
+{
+    Stop();
+}
+
+
+bool StickEmulator::Start(std::string const &link_path)
+{
+    LOG_FUNC;
+
+    if (running_)
+        return false;
+
+    master_fd_ = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd_ < 0 || grantpt(master_fd_) != 0 || unlockpt(master_fd_) != 0) {
+        LOG_ERR("Error " << errno << " creating a pty: " << strerror(errno));
+        Stop();
+        return false;
+    }
+    fcntl(master_fd_, F_SETFL, fcntl(master_fd_, F_GETFL) | O_NONBLOCK);
+    fcntl(master_fd_, F_SETFD, FD_CLOEXEC);
+
+    char name[128];
+    if (ptsname_r(master_fd_, name, sizeof(name)) != 0) {
+        LOG_ERR("Error " << errno << " from ptsname_r: " << strerror(errno));
+        Stop();
+        return false;
+    }
+    pty_path_ = name;
+
+    // Raw until the host configures it, a pty echoes by default
+    slave_fd_ = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    termios tty {};
+    if (slave_fd_ < 0 || tcgetattr(slave_fd_, &tty) != 0) {
+        LOG_ERR("Error " << errno << " opening " << pty_path_ << ": " << strerror(errno));
+        Stop();
+        return false;
+    }
+    cfmakeraw(&tty);
+    tcsetattr(slave_fd_, TCSANOW, &tty);
+
+    if (!link_path.empty()) {
+        struct stat info;
+        if (lstat(link_path.c_str(), &info) == 0 && S_ISLNK(info.st_mode))
+            unlink(link_path.c_str());
+        if (symlink(pty_path_.c_str(), link_path.c_str()) != 0) {
+            LOG_ERR("Error " << errno << " linking " << link_path << ": " << strerror(errno));
+            Stop();
+            return false;
+        }
+        link_path_ = link_path;
+    }
+
+    reset_state();
+    commands_.Clear();
+    out_.clear();
+    out_.reserve(MAX_BACKLOG);
+
+    // Random phases, like transmitters switched on at different times
+    random_.seed(devices_config_.seed);
+    devices_.clear();
+    schedule_ = decltype(schedule_) {};
+    uint64_t now = steady_now();
+    uint64_t period = period_ns(devices_config_.period);
+
+    for (size_t index = 0; index < devices_config_.count; ++index) {
+        Device device {};
+        device.device_number = static_cast<uint16_t>(devices_config_.first_device_number + index);
+        device.heart_rate = static_cast<uint8_t>(50 + random_() % 100);
+        device.next_beat = now + random_() % 1000000000ULL;
+        device.rssi = static_cast<int8_t>(-30 - static_cast<int>(random_() % 60));
+        devices_.push_back(device);
+        schedule_.push(Due {now + random_() % period, index});
+    }
+
+    LOG_MSG("Emulated stick on " << Path() << " with " << devices_.size() << " devices");
+
+    running_ = true;
+    thread_ = std::thread(&StickEmulator::run, this);
+
+    return true;
+}
+
+
+void StickEmulator::Stop()
+{
+    running_ = false;
+    if (thread_.joinable())
+        thread_.join();
+
+    if (!link_path_.empty()) {
+        // Only the link this emulator made, a new one may be somebody else's
+        char target[128] {};
+        if (readlink(link_path_.c_str(), target, sizeof(target) - 1) > 0 && pty_path_ == target)
+            unlink(link_path_.c_str());
+        link_path_.clear();
+    }
+
+    // Closing the master hangs up the host side
+    if (slave_fd_ >= 0)
+        close(slave_fd_);
+    if (master_fd_ >= 0)
+        close(master_fd_);
+    slave_fd_ = master_fd_ = -1;
+}
+
+
+EmulatorStats StickEmulator::Stats() const
+{
+    EmulatorStats stats;
+    stats.commands = commands_count_.load(std::memory_order_relaxed);
+    stats.data_frames = data_frames_.load(std::memory_order_relaxed);
+    stats.bytes_written = bytes_written_.load(std::memory_order_relaxed);
+    stats.overflows = overflows_.load(std::memory_order_relaxed);
+    stats.faults = faults_count_.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+
+void StickEmulator::reset_state()
+{
+    channels_ = {};
+    scan_mode_ = false;
+    extended_flags_ = 0;
+}
+
+
+void StickEmulator::run()
+{
+    constexpr uint64_t MAX_WAIT_NS = 100000000;
+    uint64_t period = period_ns(devices_config_.period);
+    uint8_t buffer[4096];
+
+    while (running_) {
+        uint64_t now = steady_now();
+
+        while (!schedule_.empty() && schedule_.top().first <= now) {
+            Due due = schedule_.top();
+            schedule_.pop();
+            broadcast(due.second, now);
+            // A stalled emulator skips the broadcasts it missed instead of
+            // sending them in one go
+            due.first += period;
+            if (due.first <= now)
+                due.first += (now - due.first) / period * period + period;
+            schedule_.push(due);
+        }
+
+        uint64_t next = schedule_.empty() ? now + MAX_WAIT_NS : schedule_.top().first;
+        for (uint8_t number = 0; number < channel_count_ && number < MAX_CHANNELS; ++number) {
+            Channel &channel = channels_[number];
+            if (channel.state < SEARCHING || !(channel.type & ant::TRANSMIT_DIRECTION))
+                continue;
+            if (channel.next_tx <= now)
+                serve_transmit(number, now);
+            next = std::min(next, channel.next_tx);
+        }
+
+        flush();
+
+        uint64_t wait = next > now ? std::min(next - now, MAX_WAIT_NS) : 0;
+        pollfd descriptor {master_fd_, static_cast<short>(POLLIN | (out_.empty() ? 0 : POLLOUT)), 0};
+        if (poll(&descriptor, 1, static_cast<int>((wait + 999999) / 1000000)) <= 0)
+            continue;
+
+        if (descriptor.revents & POLLIN) {
+            ssize_t length = read(master_fd_, buffer, sizeof(buffer));
+            for (ssize_t offset = 0; offset < length; ) {
+                offset += commands_.Write(buffer + offset, length - offset);
+                FrameView frame;
+                while (commands_.Next(frame))
+                    handle_command(frame);
+            }
+        }
+    }
+}
+
+
+bool StickEmulator::chance(double probability)
+{
+    if (probability <= 0 || uniform_(random_) >= probability)
+        return false;
+
+    add(faults_count_);
+    return true;
+}
+
+
+uint32_t StickEmulator::device_key(size_t index) const
+{
+    return (uint32_t)devices_config_.device_type << 24 | (uint32_t)devices_config_.trans_type << 16 |
+           devices_[index].device_number;
+}
+
+
+bool StickEmulator::accepts(Channel const &channel, size_t index) const
+{
+    if (channel.paired)
+        return channel.paired == index + 1;
+
+    // Zero fields are wildcards, the pairing bit of the type is ignored
+    constexpr uint8_t PAIRING_BIT = 0x80;
+    Device const &device = devices_[index];
+    if ((channel.device_number && channel.device_number != device.device_number) ||
+        ((channel.device_type & ~PAIRING_BIT) && (channel.device_type & ~PAIRING_BIT) != devices_config_.device_type) ||
+        (channel.trans_type && channel.trans_type != devices_config_.trans_type))
+        return false;
+
+    if (channel.list_size == 0)
+        return true;
+
+    uint32_t key = device_key(index);
+    bool listed = std::find(channel.list.begin(), channel.list.begin() + channel.list_size, key) !=
+                  channel.list.begin() + channel.list_size;
+
+    return channel.exclude ? !listed : listed;
+}
+
+
+void StickEmulator::broadcast(size_t index, uint64_t now)
+{
+    Device &device = devices_[index];
+
+    // Heart beats happen in real time, whether anybody listens or not
+    uint64_t beat_period = 60000000000ULL / device.heart_rate;
+    while (device.next_beat <= now) {
+        device.previous_event_time = device.event_time;
+        device.event_time = static_cast<uint16_t>(device.next_beat * 128 / 125000000);
+        ++device.beat_count;
+        device.next_beat += beat_period;
+    }
+
+    for (uint8_t number = 0; number < channel_count_ && number < MAX_CHANNELS; ++number) {
+        Channel &channel = channels_[number];
+        if (channel.state < SEARCHING || (channel.type & ant::TRANSMIT_DIRECTION))
+            continue;
+        // Scan mode receives everything on channel 0
+        if (!scan_mode_ && !accepts(channel, index))
+            continue;
+
+        if (chance(faults_.lost_message)) {
+            // A channel tracking its device reports the missed message
+            if (!scan_mode_ && channel.paired)
+                respond(number, ant::CHANNEL_EVENT, ant::EVENT_RX_FAIL);
+            continue;
+        }
+
+        if (!scan_mode_ && !channel.paired) {
+            channel.paired = index + 1;
+            channel.state = TRACKING;
+        }
+
+        /* HRM data page 4 (previous heart beat)
+         *
+         * | 0               | 1            | 2-3                  | 4-5              | 6           | 7          |
+         * |-----------------|--------------|----------------------|------------------|-------------|------------|
+         * | Toggle, page 4  | Manufacturer | Previous event time  | Event time       | Beat count  | Heart rate |
+         */
+        uint8_t toggle = (device.messages++ / 4) & 1 ? 0x80 : 0x00;
+        uint8_t data[ant::MAX_DATA_LENGTH] = {
+            number,
+            static_cast<uint8_t>(toggle | 4), 0xFF,
+            static_cast<uint8_t>(device.previous_event_time), static_cast<uint8_t>(device.previous_event_time >> 8),
+            static_cast<uint8_t>(device.event_time), static_cast<uint8_t>(device.event_time >> 8),
+            device.beat_count, device.heart_rate
+        };
+        size_t size = 9;
+
+        if (extended_flags_) {
+            data[size++] = extended_flags_;
+            if (extended_flags_ & ant::EXT_CHANNEL_ID) {
+                data[size++] = static_cast<uint8_t>(device.device_number);
+                data[size++] = static_cast<uint8_t>(device.device_number >> 8);
+                data[size++] = devices_config_.device_type;
+                data[size++] = devices_config_.trans_type;
+            }
+            if (extended_flags_ & ant::EXT_RSSI) {
+                data[size++] = 0x20;  // Measurement type: dBm
+                data[size++] = static_cast<uint8_t>(device.rssi);
+                data[size++] = static_cast<uint8_t>(-96);
+            }
+            if (extended_flags_ & ant::EXT_RX_TIMESTAMP) {
+                uint16_t timestamp = static_cast<uint16_t>(now / 1000 * TICKS_PER_SECOND / 1000000);
+                data[size++] = static_cast<uint8_t>(timestamp);
+                data[size++] = static_cast<uint8_t>(timestamp >> 8);
+            }
+        }
+
+        if (chance(faults_.garbage)) {
+            size_t count = 1 + random_() % 8;
+            for (size_t i = 0; i < count && out_.size() < MAX_BACKLOG; ++i)
+                out_.push_back(static_cast<uint8_t>(random_()));
+        }
+
+        emit(ant::BROADCAST_DATA, data, size, true);
+    }
+}
+
+
+void StickEmulator::serve_transmit(uint8_t number, uint64_t now)
+{
+    Channel &channel = channels_[number];
+
+    // The end of an acknowledged message takes the place of EVENT_TX
+    uint8_t event = ant::EVENT_TX;
+    if (channel.ack_pending) {
+        event = chance(faults_.failed_ack) ? ant::EVENT_TRANSFER_TX_FAILED : ant::EVENT_TRANSFER_TX_COMPLETED;
+        channel.ack_pending = false;
+    }
+    respond(number, ant::CHANNEL_EVENT, event);
+
+    channel.next_tx += period_ns(channel.period);
+    if (channel.next_tx <= now)
+        channel.next_tx = now + period_ns(channel.period);
+}
+
+
+void StickEmulator::handle_request(uint8_t number, uint8_t message)
+{
+    Channel const &channel = channels_[number < MAX_CHANNELS ? number : 0];
+    bool valid_channel = number < channel_count_ && number < MAX_CHANNELS;
+
+    switch (message) {
+    case ant::RESPONSE_SERIAL_NUMBER: {
+        uint8_t data[] = {static_cast<uint8_t>(serial_), static_cast<uint8_t>(serial_ >> 8),
+                          static_cast<uint8_t>(serial_ >> 16), static_cast<uint8_t>(serial_ >> 24)};
+        emit(ant::RESPONSE_SERIAL_NUMBER, data, sizeof(data));
+        break;
+    }
+    case ant::RESPONSE_VERSION: {
+        const char version[] = "EMU1.00";
+        emit(ant::RESPONSE_VERSION, reinterpret_cast<const uint8_t *>(version), sizeof(version));
+        break;
+    }
+    case ant::RESPONSE_CAPABILITIES: {
+        uint8_t data[] = {static_cast<uint8_t>(channel_count_), static_cast<uint8_t>(networks_), 0x00, 0xBA};
+        emit(ant::RESPONSE_CAPABILITIES, data, sizeof(data));
+        break;
+    }
+    case ant::RESPONSE_CHANNEL_STATUS: {
+        if (!valid_channel)
+            break;
+        uint8_t data[] = {number, static_cast<uint8_t>((channel.type & 0xF0) | (channel.network & 0x03) << 2 | channel.state)};
+        emit(ant::RESPONSE_CHANNEL_STATUS, data, sizeof(data));
+        break;
+    }
+    case ant::RESPONSE_CHANNEL_ID: {
+        if (!valid_channel)
+            break;
+        // A paired channel reports the id it found
+        uint16_t device_number = channel.paired ? devices_[channel.paired - 1].device_number : channel.device_number;
+        uint8_t device_type = channel.paired ? devices_config_.device_type : channel.device_type;
+        uint8_t trans_type = channel.paired ? devices_config_.trans_type : channel.trans_type;
+        uint8_t data[] = {number, static_cast<uint8_t>(device_number), static_cast<uint8_t>(device_number >> 8),
+                          device_type, trans_type};
+        emit(ant::RESPONSE_CHANNEL_ID, data, sizeof(data));
+        break;
+    }
+    default:
+        respond(number, ant::REQUEST_MESSAGE, ant::INVALID_MESSAGE);
+        return;
+    }
+
+    if (!valid_channel)
+        respond(number, ant::REQUEST_MESSAGE, ant::INVALID_PARAMETER_PROVIDED);
+}
+
+
+void StickEmulator::handle_command(FrameView const &frame)
+{
+    add(commands_count_);
+
+    uint8_t id = frame.Id();
+    uint8_t data[ant::MAX_DATA_LENGTH] {};
+    for (size_t i = 0; i < frame.Length() && i < sizeof(data); ++i)
+        data[i] = frame[3 + i];
+
+    bool is_data = id == ant::BROADCAST_DATA || id == ant::ACKNOWLEDGE_DATA || id == ant::BURST_TRANSFER_DATA;
+    uint8_t number = id == ant::BURST_TRANSFER_DATA ? data[0] & 0x1F : data[0];
+
+    if (!is_data && chance(faults_.lost_response))
+        return;
+    // Requests are answered with the requested message, not a response code
+    if (!is_data && id != ant::REQUEST_MESSAGE && id != ant::RESET_SYSTEM && chance(faults_.command_error)) {
+        respond(number, id, ant::CHANNEL_IN_WRONG_STATE);
+        return;
+    }
+
+    if (id == ant::RESET_SYSTEM) {
+        reset_state();
+        uint8_t reason = 0x20;  // Command reset
+        emit(ant::STARTUP_MESSAGE, &reason, 1);
+        return;
+    }
+    if (id == ant::REQUEST_MESSAGE) {
+        handle_request(number, data[1]);
+        return;
+    }
+
+    // Everything else addresses a channel, except the stick wide settings
+    switch (id) {
+    case ant::SET_NETWORK_KEY:
+        respond(number, id, number < networks_ ? ant::RESPONSE_NO_ERROR : ant::INVALID_NETWORK_NUMBER);
+        return;
+    case ant::ENABLE_EXT_RX_MESGS:
+        extended_flags_ = data[1] ? ant::EXT_CHANNEL_ID : 0;
+        respond(number, id, ant::RESPONSE_NO_ERROR);
+        return;
+    case ant::LIB_CONFIG:
+        extended_flags_ = data[1];
+        respond(number, id, ant::RESPONSE_NO_ERROR);
+        return;
+    default:
+        break;
+    }
+
+    if (number >= channel_count_ || number >= MAX_CHANNELS) {
+        respond(number, id, ant::INVALID_PARAMETER_PROVIDED);
+        return;
+    }
+
+    Channel &channel = channels_[number];
+    uint8_t code = ant::RESPONSE_NO_ERROR;
+
+    switch (id) {
+    case ant::ASSIGN_CHANNEL:
+        if (channel.state != UNASSIGNED) {
+            code = ant::CHANNEL_IN_WRONG_STATE;
+            break;
+        }
+        channel = Channel {};
+        channel.state = ASSIGNED;
+        channel.type = data[1];
+        channel.network = data[2];
+        break;
+    case ant::UNASSIGN_CHANNEL:
+        if (channel.state != ASSIGNED)
+            code = ant::CHANNEL_IN_WRONG_STATE;
+        else
+            channel.state = UNASSIGNED;
+        break;
+    case ant::SET_CHANNEL_ID:
+        channel.device_number = static_cast<uint16_t>(data[1] | data[2] << 8);
+        channel.device_type = data[3];
+        channel.trans_type = data[4];
+        break;
+    case ant::SET_CHANNEL_PERIOD:
+        channel.period = static_cast<uint16_t>(data[1] | data[2] << 8);
+        break;
+    case ant::ADD_CHANNEL_ID:
+        if (data[5] >= MAX_EXCLUSIONS) {
+            code = ant::INVALID_PARAMETER_PROVIDED;
+            break;
+        }
+        channel.list[data[5]] = (uint32_t)data[3] << 24 | (uint32_t)data[4] << 16 | data[1] | (uint32_t)data[2] << 8;
+        break;
+    case ant::CONFIG_LIST:
+        channel.list_size = static_cast<uint8_t>(std::min<size_t>(data[1], MAX_EXCLUSIONS));
+        channel.exclude = data[2] != 0;
+        break;
+    case ant::OPEN_CHANNEL:
+    case ant::OPEN_RX_SCAN_MODE:
+        if (channel.state != ASSIGNED) {
+            code = ant::CHANNEL_IN_WRONG_STATE;
+            break;
+        }
+        channel.paired = 0;
+        if (channel.type & ant::TRANSMIT_DIRECTION) {
+            channel.state = TRACKING;
+            channel.next_tx = steady_now() + period_ns(channel.period);
+        } else {
+            channel.state = SEARCHING;
+        }
+        scan_mode_ = id == ant::OPEN_RX_SCAN_MODE;
+        break;
+    case ant::CLOSE_CHANNEL:
+        if (channel.state < SEARCHING) {
+            code = ant::CHANNEL_IN_WRONG_STATE;
+            break;
+        }
+        respond(number, id, code);
+        channel.state = ASSIGNED;
+        channel.paired = 0;
+        channel.ack_pending = false;
+        if (number == 0)
+            scan_mode_ = false;
+        respond(number, ant::CHANNEL_EVENT, ant::EVENT_CHANNEL_CLOSED);
+        return;
+    case ant::BROADCAST_DATA:
+        // Broadcasts are only answered when they are rejected
+        if (channel.state < SEARCHING)
+            respond(number, id, ant::CHANNEL_NOT_OPENED);
+        return;
+    case ant::ACKNOWLEDGE_DATA:
+        if (channel.state < SEARCHING) {
+            respond(number, id, ant::CHANNEL_NOT_OPENED);
+        } else if (channel.type & ant::TRANSMIT_DIRECTION) {
+            channel.ack_pending = true;
+        } else {
+            respond(number, ant::CHANNEL_EVENT, chance(faults_.failed_ack) ?
+                    ant::EVENT_TRANSFER_TX_FAILED : ant::EVENT_TRANSFER_TX_COMPLETED);
+        }
+        return;
+    case ant::BURST_TRANSFER_DATA:
+        if (channel.state < SEARCHING)
+            respond(number, id, ant::CHANNEL_NOT_OPENED);
+        else if (data[0] & 0x80)
+            respond(number, ant::CHANNEL_EVENT, chance(faults_.failed_ack) ?
+                    ant::EVENT_TRANSFER_TX_FAILED : ant::EVENT_TRANSFER_TX_COMPLETED);
+        return;
+    default:
+        // Search timeout, frequency, transmit power and the like
+        break;
+    }
+
+    respond(number, id, code);
+}
+
+
+void StickEmulator::respond(uint8_t channel, uint8_t message, uint8_t code)
+{
+    uint8_t data[] = {channel, message, code};
+    emit(ant::CHANNEL_RESPONSE, data, sizeof(data));
+}
+
+
+void StickEmulator::emit(uint8_t id, const uint8_t *data, size_t size, bool data_frame)
+{
+    // Like the serial queue of a stick, data is lost when the host does
+    // not keep up, responses always get through
+    if (data_frame && out_.size() >= MAX_BACKLOG) {
+        add(overflows_);
+        return;
+    }
+
+    uint8_t checksum = ant::SYNC_BYTE ^ static_cast<uint8_t>(size) ^ id;
+    out_.push_back(ant::SYNC_BYTE);
+    out_.push_back(static_cast<uint8_t>(size));
+    out_.push_back(id);
+    for (size_t i = 0; i < size; ++i) {
+        out_.push_back(data[i]);
+        checksum ^= data[i];
+    }
+
+    if (data_frame && chance(faults_.corrupt_frame))
+        checksum = ~checksum;
+    out_.push_back(checksum);
+
+    if (data_frame)
+        add(data_frames_);
+}
+
+
+void StickEmulator::flush()
+{
+    size_t written = 0;
+
+    while (written < out_.size()) {
+        size_t size = out_.size() - written;
+        if (faults_.max_write)
+            size = std::min(size, faults_.max_write);
+
+        ssize_t bytes = write(master_fd_, out_.data() + written, size);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG_ERR("Error " << errno << " writing to " << pty_path_ << ": " << strerror(errno));
+            break;
+        }
+        written += bytes;
+    }
+
+    out_.erase(out_.begin(), out_.begin() + written);
+    add(bytes_written_, written);
+}
@@ -0,0 +1,396 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "StickPool.h"
+#include "TtyUsbDevice.h"
+
+#include <dirent.h>
+
+
+StickPool::~StickPool()
+{
+    Stop();
+}
+
+
+size_t StickPool::Discover(std::string const &prefix)
+{
+    LOG_FUNC;
+
+    auto found = prefix.rfind("/");
+    std::string directory = found == std::string::npos ? "." : prefix.substr(0, found);
+    std::string name_prefix = found == std::string::npos ? prefix : prefix.substr(found + 1);
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        LOG_ERR("Cannot open directory " << directory);
+        return 0;
+    }
+
+    std::vector<std::string> names;
+    while (dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, name_prefix.size(), name_prefix) == 0)
+            names.push_back(name);
+    }
+    closedir(dir);
+
+    // Natural order: ttyUSB2 goes before ttyUSB10
+    std::sort(names.begin(), names.end(), [] (std::string const &a, std::string const &b) {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    });
+
+    for (auto const &name : names) {
+        LOG_MSG("Found ANT USB Stick: " << directory << "/" << name);
+
+        auto stick = std::unique_ptr<Stick>(new Stick());
+        stick->AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(directory + "/" + name, true)));
+        Add(std::move(stick));
+    }
+
+    return names.size();
+}
+
+
+void StickPool::Add(std::unique_ptr<Stick> &&stick)
+{
+    sticks_.push_back(std::move(stick));
+    ready_.push_back(false);
+    handles_.push_back(-1);
+    pending_.push_back(false);
+    reconnections_.emplace_back();
+}
+
+
+size_t StickPool::Init(bool warm)
+{
+    LOG_FUNC;
+
+    // Every stick waits for its own responses, so their round trips overlap
+    std::vector<char> results(sticks_.size(), 0);
+    std::vector<std::thread> threads;
+
+    for (size_t index = 0; index < sticks_.size(); ++index) {
+        threads.emplace_back([this, &results, index, warm] () {
+            auto &stick = *sticks_[index];
+            results[index] = warm ? stick.WarmStart() : stick.Connect() && stick.Reset() && stick.Init();
+        });
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+
+    size_t ready = 0;
+
+    for (size_t index = 0; index < sticks_.size(); ++index) {
+        ready_[index] = results[index];
+        if (!ready_[index]) {
+            LOG_ERR("Cannot initialise stick " << index);
+            continue;
+        }
+        ++ready;
+
+        auto const &timings = sticks_[index]->Timings();
+        LOG_MSG("Stick " << index << (timings.warm ? " warm" : " cold") << " start, us:"
+                << " connect " << timings.connect / 1000 << " identify " << timings.identify / 1000
+                << " reset " << timings.reset / 1000 << " configure " << timings.configure / 1000
+                << " channels " << timings.channels / 1000);
+    }
+
+    return ready;
+}
+
+
+bool StickPool::OpenChannel(ChannelConfig const &config, size_t &stick, uint8_t &channel)
+{
+    LOG_FUNC;
+
+    if (thread_.joinable()) {
+        LOG_ERR("Channels cannot be opened while the pool is running");
+        return false;
+    }
+
+    std::vector<size_t> candidates;
+    for (size_t index = 0; index < sticks_.size(); ++index)
+        if (ready_[index] && sticks_[index]->FreeChannels() > 0)
+            candidates.push_back(index);
+
+    // Least loaded sticks first, fall back to the next one if opening fails
+    std::stable_sort(candidates.begin(), candidates.end(), [this] (size_t a, size_t b) {
+        return sticks_[a]->FreeChannels() > sticks_[b]->FreeChannels();
+    });
+
+    for (auto index : candidates) {
+        int channel_number = sticks_[index]->OpenChannel(config);
+        if (channel_number >= 0) {
+            stick = index;
+            channel = static_cast<uint8_t>(channel_number);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+bool StickPool::WatchHotPlug(std::string const &prefix)
+{
+    LOG_FUNC;
+
+    if (thread_.joinable()) {
+        LOG_ERR("Hot plug monitoring must be set up before Start");
+        return false;
+    }
+
+    return hotplug_.Watch(prefix, [this] (std::string const &path, bool present) {
+        on_hotplug(path, present);
+    });
+}
+
+
+bool StickPool::Start()
+{
+    LOG_FUNC;
+
+    if (thread_.joinable())
+        return false;
+
+    for (size_t index = 0; index < sticks_.size(); ++index) {
+        if (!ready_[index])
+            continue;
+
+        int fd = sticks_[index]->Handle();
+        if (fd < 0 || !reactor_.Add(fd, [this, index] { on_readable(index); })) {
+            LOG_ERR("Stick " << index << " cannot be polled");
+            continue;
+        }
+        handles_[index] = fd;
+    }
+
+    if (hotplug_.Handle() >= 0) {
+        reactor_.Add(hotplug_.Handle(), [this] { hotplug_.Dispatch(); });
+        retry_timer_ = reactor_.AddTimer(RECONNECT_INTERVAL_MS, [this] { retry_reconnects(); });
+    }
+
+    thread_ = std::thread([this] { reactor_.Run(); });
+
+    return true;
+}
+
+
+void StickPool::Stop()
+{
+    if (!thread_.joinable())
+        return;
+
+    reactor_.Stop();
+    thread_.join();
+
+    // Bounded by the response timeout of the sticks
+    for (auto &reconnection : reconnections_)
+        if (reconnection)
+            reconnection->thread.join();
+    collect_reconnects();
+
+    for (auto &fd : handles_) {
+        reactor_.Remove(fd);
+        fd = -1;
+    }
+    reactor_.Remove(hotplug_.Handle());
+    reactor_.Remove(retry_timer_);
+    retry_timer_ = -1;
+}
+
+
+void StickPool::on_readable(size_t index)
+{
+    ExtendedMessage msg;
+    auto now = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+
+    while (sticks_[index]->PollExtendedMsg(msg)) {
+        if (!lock.owns_lock())
+            lock.lock();
+
+        if (queue_.size() >= max_queue_size_) {
+            Metrics::Add(dropped_);
+            continue;
+        }
+        queue_.push_back(PoolMessage {index, sequence_++, now, msg});
+    }
+
+    if (lock.owns_lock()) {
+        lock.unlock();
+        available_.notify_all();
+    }
+
+    if (!sticks_[index]->IsConnected())
+        on_lost(index);
+}
+
+
+void StickPool::on_lost(size_t index)
+{
+    if (handles_[index] < 0)
+        return;
+
+    // The descriptor is closed with the device, it must leave the reactor
+    // before its number can be reused
+    reactor_.Remove(handles_[index]);
+    handles_[index] = -1;
+    sticks_[index]->DeviceLost();
+
+    LOG_ERR("Stick " << index << " lost, waiting for " << sticks_[index]->Path());
+}
+
+
+void StickPool::on_hotplug(std::string const &path, bool present)
+{
+    for (size_t index = 0; index < sticks_.size(); ++index) {
+        if (!ready_[index] || sticks_[index]->Path() != path)
+            continue;
+
+        if (!present) {
+            on_lost(index);
+            pending_[index] = false;
+        } else if (handles_[index] < 0) {
+            reconnect(index);
+        }
+        return;
+    }
+
+    if (present)
+        LOG_MSG("Ignoring " << path << ", it is not a stick of the pool");
+}
+
+
+void StickPool::reconnect(size_t index)
+{
+    pending_[index] = true;
+    if (reconnections_[index])
+        return;
+
+    auto reconnection = std::make_unique<Reconnection>();
+    Reconnection *state = reconnection.get();
+    Stick *stick = sticks_[index].get();
+    state->thread = std::thread([this, stick, state] {
+        state->connected = stick->Reconnect();
+        state->finished.store(true, std::memory_order_release);
+        reactor_.Post([this] { collect_reconnects(); });
+    });
+    reconnections_[index] = std::move(reconnection);
+}
+
+
+void StickPool::collect_reconnects()
+{
+    for (size_t index = 0; index < reconnections_.size(); ++index) {
+        auto &reconnection = reconnections_[index];
+        if (!reconnection || !reconnection->finished.load(std::memory_order_acquire))
+            continue;
+
+        // Stop joins it before collecting
+        if (reconnection->thread.joinable())
+            reconnection->thread.join();
+        bool connected = reconnection->connected;
+        reconnection.reset();
+
+        // A failed one stays pending for retry_reconnects
+        if (connected)
+            resume(index);
+    }
+}
+
+
+void StickPool::resume(size_t index)
+{
+    auto &stick = *sticks_[index];
+
+    // Unplugged again while reconnecting
+    if (!pending_[index]) {
+        stick.DeviceLost();
+        return;
+    }
+
+    int fd = stick.Handle();
+    if (fd < 0 || !reactor_.Add(fd, [this, index] { on_readable(index); })) {
+        LOG_ERR("Stick " << index << " cannot be polled");
+        stick.DeviceLost();
+        return;
+    }
+
+    handles_[index] = fd;
+    pending_[index] = false;
+    LOG_MSG("Stick " << index << " is back on " << stick.Path());
+}
+
+
+void StickPool::retry_reconnects()
+{
+    for (size_t index = 0; index < sticks_.size(); ++index)
+        if (pending_[index])
+            reconnect(index);
+}
+
+
+bool StickPool::Read(PoolMessage &msg, int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    auto has_data = [this] { return !queue_.empty(); };
+
+    if (timeout_ms < 0)
+        available_.wait(lock, has_data);
+    else if (!available_.wait_for(lock, std::chrono::milliseconds(timeout_ms), has_data))
+        return false;
+
+    msg = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+
+    sticks_[msg.stick]->Instruments().delivery_latency.Record(std::chrono::steady_clock::now() - msg.received);
+
+    return true;
+}
+
+
+std::string StickPool::PrometheusText()
+{
+    std::vector<MetricsSnapshot> snapshots;
+    for (auto const &stick : sticks_)
+        snapshots.push_back(stick->Snapshot());
+
+    size_t depth;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        depth = queue_.size();
+    }
+    uint64_t dropped = Dropped();
+
+    std::ostringstream out;
+    out << ::PrometheusText(snapshots)
+        << "# HELP ant_pool_queue_depth Messages waiting in the merged queue\n"
+        << "# TYPE ant_pool_queue_depth gauge\n"
+        << "ant_pool_queue_depth " << depth << "\n"
+        << "# HELP ant_pool_dropped_messages_total Messages lost because the merged queue was full\n"
+        << "# TYPE ant_pool_dropped_messages_total counter\n"
+        << "ant_pool_dropped_messages_total " << dropped << "\n";
+
+    return out.str();
+}
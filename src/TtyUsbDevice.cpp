@@ -28,6 +28,7 @@
 
 // Linux headers
 #include <fcntl.h>   // Contains file controls like O_RDWR
+#include <poll.h>    // poll() to tell a hang up from an empty read
 #include <errno.h>   // Error integer and strerror() function
 #include <termios.h> // Contains POSIX terminal control definitions
 #include <unistd.h>  // write(), read(), close()
@@ -50,7 +51,11 @@ bool TtyUsbDevice::Connect() {
         return false;
     }
 
-    tty_usb_file_ = open(path_to_device_.c_str(), O_RDWR);
+    tty_usb_file_ = open(path_to_device_.c_str(), O_RDWR | O_NOCTTY | (non_blocking_ ? O_NONBLOCK : 0));
+    if (tty_usb_file_ < 0) {
+        std::cerr << "Error " << errno << " from open: " << strerror(errno) << std::endl;
+        return false;
+    }
 
     // Clean termios struct, we call it 'tty' for convention
     tty_ = {0};
@@ -58,6 +63,7 @@ bool TtyUsbDevice::Connect() {
     // Read in existing settings, and handle any error
     if(tcgetattr(tty_usb_file_, &tty_) != 0) {
         std::cerr << "Error " << errno << " from tcgetattr: " << strerror(errno) << std::endl;
+        close(tty_usb_file_);
         return false;
     }
 
@@ -78,8 +84,13 @@ bool TtyUsbDevice::Connect() {
     tty_.c_oflag &= ~OPOST; // Prevent special interpretation of output bytes (e.g. newline chars)
     tty_.c_oflag &= ~ONLCR; // Prevent conversion of newline to carriage return/line feed
 
-    tty_.c_cc[VTIME] = 10; // Wait for up to 1s (10 deciseconds), returning as soon as any data is received.
-    tty_.c_cc[VMIN] = 0;
+    if (non_blocking_) {
+        tty_.c_cc[VTIME] = 0; // Readiness is signalled by poll/epoll, never wait in read()
+        tty_.c_cc[VMIN] = 0;
+    } else {
+        tty_.c_cc[VTIME] = 10; // Wait for up to 1s (10 deciseconds), returning as soon as any data is received.
+        tty_.c_cc[VMIN] = 0;
+    }
 
     // Set in/out baud rate to be 9600
     cfsetispeed(&tty_, DEFAULT_TTY_USB_DEVICE_BAUDRATE);
@@ -95,6 +106,33 @@ bool TtyUsbDevice::Connect() {
 }
 
 
+namespace {
+
+// Errors of a device which went away, it has to be opened again
+bool is_lost(int error)
+{
+    return error == EIO || error == ENODEV || error == ENXIO;
+}
+
+} // namespace
+
+
+void TtyUsbDevice::lost(const char *operation, int error) {
+    std::cerr << "Device " << path_to_device_ << " lost, error " << error << " from " << operation
+              << ": " << strerror(error) << std::endl;
+
+    close(tty_usb_file_);
+    connected_ = false;
+}
+
+
+bool TtyUsbDevice::hung_up() const {
+    pollfd descriptor {tty_usb_file_, 0, 0};
+
+    return poll(&descriptor, 1, 0) > 0 && (descriptor.revents & (POLLHUP | POLLERR | POLLNVAL));
+}
+
+
 bool TtyUsbDevice::Disconnect() {
     if (connected_) {
         if (close(tty_usb_file_) < 0) {
@@ -108,15 +146,78 @@ bool TtyUsbDevice::Disconnect() {
 
 
 bool TtyUsbDevice::Write(const std::vector<uint8_t> &buff) {
+    return Write(buff.data(), buff.size());
+}
+
+
+bool TtyUsbDevice::Write(const uint8_t *data, size_t size) {
     if (!connected_) {
         std::cerr << "Device is not connected." << std::endl;
         return false;
     }
 
-    int bytes = write(tty_usb_file_, &buff[0], buff.size());
+    // A frame must reach the stick whole: short writes are continued and a
+    // full output buffer of a non-blocking descriptor is waited for
+    size_t written = 0;
+    while (written < size) {
+        ssize_t bytes = write(tty_usb_file_, data + written, size - written);
+
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!wait_writable())
+                    return false;
+                continue;
+            }
+            if (is_lost(errno)) {
+                lost("write", errno);
+                return false;
+            }
+            std::cerr << "Error writing: " << errno << " : " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        written += static_cast<size_t>(bytes);
+    }
 
-    if (bytes < 0) {
-        std::cerr << "Error writing: " << errno << " : " << strerror(errno) << std::endl;
+    return true;
+}
+
+
+bool TtyUsbDevice::wait_writable() {
+    pollfd descriptor {tty_usb_file_, POLLOUT, 0};
+    int count;
+    do {
+        count = poll(&descriptor, 1, WRITE_TIMEOUT_MS);
+    } while (count < 0 && errno == EINTR);
+
+    if (count == 0) {
+        std::cerr << "Error writing: the device does not take data" << std::endl;
+        return false;
+    }
+    if (count < 0 || (descriptor.revents & (POLLHUP | POLLERR | POLLNVAL))) {
+        lost("write", count < 0 ? errno : EIO);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool TtyUsbDevice::Drain() {
+    if (!connected_)
+        return false;
+
+    // The USB serial driver only completes once the stick took the data,
+    // which is the flow control of the serial link
+    int result;
+    do {
+        result = tcdrain(tty_usb_file_);
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0) {
+        std::cerr << "Error draining: " << errno << " : " << strerror(errno) << std::endl;
         return false;
     }
 
@@ -131,25 +232,42 @@ bool TtyUsbDevice::Read(std::vector<uint8_t> &buff) {
         return false;
     }
 
-    char read_buf[256] = {0};
+    // Large enough to drain a busy scan mode stick in one call
+    uint8_t read_buf[4096];
 
-    uint32_t num_bytes = 0;
+    ssize_t num_bytes = 0;
     uint32_t total_bytes = 0;
 
     do {
         num_bytes = read(tty_usb_file_, &read_buf, sizeof(read_buf));
 
         if (num_bytes < 0) {
+            if (non_blocking_ && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (is_lost(errno)) {
+                lost("read", errno);
+                return false;
+            }
             std::cerr << "Error reading: " << errno << " : " << strerror(errno) << std::endl;
             return false;
         }
 
-        for (unsigned int i = 0; i < num_bytes; i++) {
-            buff.push_back(read_buf[i]);
-        }
+        buff.insert(buff.end(), read_buf, read_buf + num_bytes);
 
         total_bytes += num_bytes;
-    } while (total_bytes <= 4);
+
+        // A hung up tty returns empty reads forever. In non-blocking mode
+        // they normally end the drain, so only one without data is checked
+        if (num_bytes == 0 && (!non_blocking_ || total_bytes == 0) && hung_up()) {
+            lost("read", EIO);
+            return false;
+        }
+
+        if (non_blocking_ && num_bytes == 0)
+            break;
+    // Non-blocking mode drains everything which is ready, but never waits for
+    // more. Blocking mode waits for data, but returns as soon as there is some
+    } while (non_blocking_ || total_bytes == 0);
 
     return true;
 }
@@ -0,0 +1,143 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TxScheduler.h"
+
+
+void TxScheduler::Open(uint8_t channel, uint16_t period)
+{
+    if (channel >= MAX_CHANNELS)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    channels_[channel] = Channel {};
+    channels_[channel].open = true;
+    channels_[channel].period_ns = static_cast<uint64_t>(period) * 1000000000ULL / 32768;
+}
+
+
+void TxScheduler::Close(uint8_t channel)
+{
+    if (channel >= MAX_CHANNELS)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    channels_[channel] = Channel {};
+}
+
+
+void TxScheduler::Reset()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    channels_.fill(Channel {});
+}
+
+
+bool TxScheduler::IsOpen(uint8_t channel)
+{
+    if (channel >= MAX_CHANNELS)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return channels_[channel].open;
+}
+
+
+bool TxScheduler::Queue(uint8_t channel, Payload const &payload)
+{
+    if (channel >= MAX_CHANNELS)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Channel &state = channels_[channel];
+    if (!state.open)
+        return false;
+
+    state.next = payload;
+    state.pending = true;
+
+    return true;
+}
+
+
+int64_t TxScheduler::Tick(uint8_t channel, uint64_t time)
+{
+    if (channel >= MAX_CHANNELS)
+        return -1;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Channel &state = channels_[channel];
+    if (!state.open || state.period_ns == 0)
+        return -1;
+
+    uint64_t last = state.last_tick;
+    state.last_tick = time;
+    if (last == 0 || time < last)
+        return -1;
+
+    // Missed events (e.g. while a command was waited for) span several
+    // periods, measure against the nearest multiple
+    uint64_t interval = time - last;
+    uint64_t periods = (interval + state.period_ns / 2) / state.period_ns;
+    uint64_t expected = periods * state.period_ns;
+
+    return static_cast<int64_t>(interval > expected ? interval - expected : expected - interval);
+}
+
+
+bool TxScheduler::Take(uint8_t channel, Payload &payload)
+{
+    if (channel >= MAX_CHANNELS)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Channel &state = channels_[channel];
+    if (!state.open || !state.pending)
+        return false;
+    // The stick repeats the acknowledged payload until it ends, a new one
+    // written meanwhile would replace it
+    if (state.ack_in_flight)
+        return false;
+
+    payload = state.next;
+    state.pending = false;
+    if (payload.acknowledged) {
+        state.ack_in_flight = true;
+        state.ack_tag = payload.tag;
+    }
+
+    return true;
+}
+
+
+bool TxScheduler::Complete(uint8_t channel, uint32_t &tag)
+{
+    if (channel >= MAX_CHANNELS)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Channel &state = channels_[channel];
+    if (!state.ack_in_flight)
+        return false;
+
+    state.ack_in_flight = false;
+    tag = state.ack_tag;
+
+    return true;
+}
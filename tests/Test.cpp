@@ -0,0 +1,102 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <vector>
+
+#include <unistd.h>
+
+namespace test {
+
+namespace {
+
+struct Entry {
+    std::string name;
+    Function function;
+};
+
+std::vector<Entry> &registry()
+{
+    static std::vector<Entry> entries;
+    return entries;
+}
+
+} // namespace
+
+
+Registration::Registration(std::string const &name, Function function)
+{
+    registry().push_back(Entry {name, std::move(function)});
+}
+
+
+std::string TempPath(std::string const &name)
+{
+    return "/tmp/antservice-test-" + std::to_string(getpid()) + "-" + name;
+}
+
+
+int Main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : "";
+    int runs = 0;
+    int failures = 0;
+
+    for (auto const &entry : registry()) {
+        if (std::strstr(entry.name.c_str(), filter) == nullptr)
+            continue;
+
+        ++runs;
+        auto start = std::chrono::steady_clock::now();
+        bool passed = false;
+
+        try {
+            entry.function();
+            passed = true;
+        } catch (Failure const &failure) {
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", failure.file, failure.line, failure.expression);
+        } catch (std::exception const &exception) {
+            std::fprintf(stderr, "unexpected exception: %s\n", exception.what());
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::fprintf(stderr, "[%s] %s (%.3f s)\n", passed ? "PASS" : "FAIL", entry.name.c_str(), elapsed.count());
+
+        if (!passed)
+            ++failures;
+    }
+
+    if (runs == 0) {
+        std::fprintf(stderr, "no test matches \"%s\"\n", filter);
+        return 1;
+    }
+
+    return failures;
+}
+
+} // namespace test
+
+
+int main(int argc, char *argv[])
+{
+    return test::Main(argc, argv);
+}
@@ -0,0 +1,64 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <functional>
+#include <string>
+
+/* Minimal test harness in the spirit of the benchmarks one. Every test is a
+ * function registered with TEST; a failed CHECK aborts the test it is in and
+ * the run continues with the next one.
+ *
+ * Usage: tests [name filter]
+ *
+ * The exit code is the number of failed tests, so every ctest entry is just
+ * the binary run with a filter.
+ */
+namespace test {
+
+using Function = std::function<void ()>;
+
+struct Registration {
+    Registration(std::string const &name, Function function);
+};
+
+// Thrown by CHECK, caught by Main
+struct Failure {
+    const char *file;
+    int line;
+    const char *expression;
+};
+
+int Main(int argc, char *argv[]);
+
+// Path of a scratch file or link in the temporary directory, unique to the
+// running process
+std::string TempPath(std::string const &name);
+
+} // namespace test
+
+#define TEST(name) \
+    static void name(); \
+    static test::Registration name##_registration(#name, name); \
+    static void name()
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+            throw test::Failure {__FILE__, __LINE__, #condition}; \
+    } while (0)
@@ -0,0 +1,159 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "Capture.h"
+
+#include <chrono>
+#include <thread>
+
+#include <unistd.h>
+
+namespace {
+
+ExtendedMessage message(uint32_t index)
+{
+    ExtendedMessage msg {};
+    msg.channel_number = index % 8;
+    std::memcpy(msg.payload, &index, sizeof(index));
+    msg.device_number = static_cast<uint16_t>(index);
+    msg.device_type = HRM::ANT_DEVICE_TYPE;
+    msg.trans_type = 1;
+    msg.flags = ant::EXT_CHANNEL_ID;
+    return msg;
+}
+
+
+// Reads every segment of the capture, returns false if a record is not the
+// next expected one
+bool read_capture(std::string const &base_path, uint32_t first, uint32_t count, size_t segments)
+{
+    auto paths = CaptureReader::Segments(base_path);
+    if (paths.size() != segments)
+        return false;
+
+    CaptureReader reader;
+    uint32_t index = first;
+
+    for (auto const &path : paths) {
+        if (!reader.Open(path))
+            return false;
+        for (auto const &record : reader) {
+            auto msg = record.Message();
+            uint32_t stored;
+            std::memcpy(&stored, msg.payload, sizeof(stored));
+            if (stored != index || record.timestamp != index || msg.device_number != static_cast<uint16_t>(index))
+                return false;
+            ++index;
+        }
+    }
+
+    return index == first + count;
+}
+
+
+void remove_capture(std::string const &base_path)
+{
+    for (auto const &path : CaptureReader::Segments(base_path))
+        unlink(path.c_str());
+}
+
+} // namespace
+
+
+TEST(capture_segments)
+{
+    auto base = test::TempPath("capture");
+
+    CaptureWriter writer(base, 1000);
+    CHECK(writer.Open());
+    for (uint32_t i = 0; i < 10500; ++i)
+        CHECK(writer.Append(message(i), i));
+    CHECK(writer.Segment() == 10);
+    writer.Close();
+
+    // The segment prepared after the last one is not left behind
+    CHECK(read_capture(base, 0, 10500, 11));
+    remove_capture(base);
+}
+
+
+TEST(capture_prepared_segment)
+{
+    auto base = test::TempPath("prepared");
+
+    // More than half of the last segment, so the next one gets prepared
+    CaptureWriter writer(base, 1000);
+    CHECK(writer.Open());
+    for (uint32_t i = 0; i < 2800; ++i)
+        CHECK(writer.Append(message(i), i));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    writer.Close();
+
+    auto paths = CaptureReader::Segments(base);
+    CHECK(paths.size() == 3);
+
+    size_t const sizes[] = {1000, 1000, 800};
+    CaptureReader reader;
+    for (size_t index = 0; index < paths.size(); ++index) {
+        CHECK(reader.Open(paths[index]));
+        CHECK(reader.Size() == sizes[index]);
+    }
+    reader.Close();
+
+    CHECK(read_capture(base, 0, 2800, 3));
+    remove_capture(base);
+}
+
+
+TEST(capture_stale_segments)
+{
+    auto base = test::TempPath("stale");
+
+    {
+        CaptureWriter writer(base, 100);
+        CHECK(writer.Open());
+        for (uint32_t i = 0; i < 450; ++i)
+            CHECK(writer.Append(message(i), i));
+    }
+
+    // A new capture under the same name starts from scratch
+    CaptureWriter writer(base, 100);
+    CHECK(writer.Open());
+    for (uint32_t i = 0; i < 150; ++i)
+        CHECK(writer.Append(message(i), i));
+    writer.Close();
+
+    CHECK(read_capture(base, 0, 150, 2));
+    remove_capture(base);
+}
+
+
+TEST(capture_max_segments)
+{
+    auto base = test::TempPath("ring");
+
+    CaptureWriter writer(base, 100, 3);
+    CHECK(writer.Open());
+    for (uint32_t i = 0; i < 1050; ++i)
+        CHECK(writer.Append(message(i), i));
+    writer.Close();
+
+    // Segments 8, 9 and the partial 10 are kept
+    CHECK(read_capture(base, 800, 250, 3));
+    remove_capture(base);
+}
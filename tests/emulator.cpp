@@ -0,0 +1,203 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "Stick.h"
+#include "StickEmulator.h"
+#include "TtyUsbDevice.h"
+
+#include <chrono>
+#include <set>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void attach(Stick &stick, StickEmulator const &emulator)
+{
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+}
+
+// Polls the stick for duration_s, returns the number of messages and the
+// device numbers they came from
+size_t receive(Stick &stick, double duration_s, std::set<uint16_t> &device_numbers)
+{
+    size_t count = 0;
+    ExtendedMessage ext_msg;
+    auto start = Clock::now();
+    while (seconds_since(start) < duration_s) {
+        if (!stick.PollExtendedMsg(ext_msg)) {
+            stick.WaitInput(10);
+            continue;
+        }
+        device_numbers.insert(ext_msg.device_number);
+        ++count;
+    }
+    return count;
+}
+
+} // namespace
+
+TEST(emulator_many_devices)
+{
+    EmulatedDevices devices;
+    devices.count = 3000;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("many")));
+
+    Stick stick;
+    attach(stick, emulator);
+    CHECK(stick.Connect() && stick.Reset() && stick.InitScanMode());
+
+    // Every device transmits about four times a second
+    std::set<uint16_t> device_numbers;
+    size_t count = receive(stick, 1.0, device_numbers);
+
+    CHECK(count >= 3 * devices.count);
+    CHECK(device_numbers.size() == devices.count);
+    CHECK(*device_numbers.begin() == devices.first_device_number);
+    CHECK(*device_numbers.rbegin() == devices.first_device_number + devices.count - 1);
+    CHECK(emulator.Stats().overflows == 0);
+    CHECK(stick.FramingStats().corrupt_frames == 0);
+}
+
+
+TEST(emulator_corrupt_stream)
+{
+    EmulatedDevices devices;
+    devices.count = 200;
+    EmulatorFaults faults;
+    faults.corrupt_frame = 0.05;
+    faults.garbage = 0.05;
+    faults.max_write = 7;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    emulator.SetFaults(faults);
+    CHECK(emulator.Start(test::TempPath("corrupt")));
+
+    // Commands are not corrupted, only data frames
+    Stick stick;
+    attach(stick, emulator);
+    CHECK(stick.Connect() && stick.Reset() && stick.InitScanMode());
+
+    std::set<uint16_t> device_numbers;
+    size_t count = receive(stick, 1.0, device_numbers);
+
+    CHECK(count >= 400);
+    CHECK(*device_numbers.begin() >= devices.first_device_number);
+    CHECK(*device_numbers.rbegin() < devices.first_device_number + devices.count);
+    CHECK(emulator.Stats().faults > 0);
+    CHECK(stick.FramingStats().corrupt_frames > 0);
+    CHECK(stick.FramingStats().dropped_bytes > 0);
+}
+
+
+TEST(emulator_command_errors)
+{
+    EmulatorFaults faults;
+    faults.command_error = 1.0;
+
+    StickEmulator emulator;
+    emulator.SetFaults(faults);
+    CHECK(emulator.Start(test::TempPath("errors")));
+
+    Stick stick;
+    attach(stick, emulator);
+    CHECK(stick.Connect());
+
+    auto start = Clock::now();
+    CHECK(!stick.Init());
+    CHECK(seconds_since(start) < 1.0);
+    CHECK(stick.Snapshot().command_errors > 0);
+}
+
+
+TEST(emulator_lost_responses)
+{
+    EmulatorFaults faults;
+    faults.lost_response = 1.0;
+
+    StickEmulator emulator;
+    emulator.SetFaults(faults);
+    CHECK(emulator.Start(test::TempPath("lost")));
+
+    Stick stick;
+    attach(stick, emulator);
+    CHECK(stick.Connect());
+
+    // Fails after the response timeout instead of waiting forever
+    auto start = Clock::now();
+    CHECK(!stick.Reset());
+    CHECK(seconds_since(start) < 5.0);
+    CHECK(stick.IsConnected());
+}
+
+
+TEST(emulator_failed_acks)
+{
+    EmulatedDevices devices;
+    devices.count = 0;
+    EmulatorFaults faults;
+    faults.failed_ack = 0.5;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    emulator.SetFaults(faults);
+    CHECK(emulator.Start(test::TempPath("acks")));
+
+    Stick stick;
+    attach(stick, emulator);
+    CHECK(stick.Connect() && stick.Reset() && stick.Init());
+
+    ChannelConfig master;
+    master.device_number = 100;
+    master.trans_type = 1;
+    master.period = 1024;
+    master.type = ant::BIDIRECTIONAL_TRANSMIT;
+    int channel = stick.OpenChannel(master);
+    CHECK(channel >= 0);
+
+    size_t acknowledged = 0, failed = 0;
+    uint32_t last_tag = 0;
+    stick.SetTxCallback([&] (uint8_t, uint32_t tag, bool ok) {
+        ++(ok ? acknowledged : failed);
+        last_tag = tag;
+    });
+
+    // One acknowledged message at a time, each one ends before the next
+    uint8_t payload[8] {};
+    std::set<uint16_t> device_numbers;
+    for (uint32_t tag = 1; tag <= 40; ++tag) {
+        CHECK(stick.QueueAcknowledged(channel, payload, tag));
+        auto start = Clock::now();
+        while (last_tag != tag && seconds_since(start) < 1.0)
+            receive(stick, 0.01, device_numbers);
+        CHECK(last_tag == tag);
+    }
+
+    CHECK(acknowledged > 0 && failed > 0 && acknowledged + failed == 40);
+    CHECK(stick.Snapshot().tx_acknowledged == acknowledged);
+    CHECK(stick.Snapshot().tx_ack_failures == failed);
+}
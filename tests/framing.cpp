@@ -0,0 +1,223 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "Common.h"
+#include "FrameReader.h"
+
+#include <random>
+
+namespace {
+
+constexpr size_t STREAM_SIZE = 8 << 20;
+
+/* Random broadcast frames with optional garbage in between and optionally
+ * corrupted frames. Neither garbage nor frame contents hold a stray sync
+ * byte, so the framer must give back exactly the good frames and the
+ * counters are known up front.
+ */
+struct Stream {
+    std::vector<uint8_t> bytes;
+    std::vector<size_t> frames; // Offsets of the good frames
+    uint64_t corrupt_frames = 0;
+    uint64_t dropped_bytes = 0;
+};
+
+
+uint8_t no_sync(uint32_t value)
+{
+    auto byte = static_cast<uint8_t>(value);
+    return byte == ant::SYNC_BYTE ? 0 : byte;
+}
+
+
+Stream make_stream(unsigned garbage_percent, unsigned corrupt_percent)
+{
+    std::mt19937 random(42);
+    Stream stream;
+
+    while (stream.bytes.size() < STREAM_SIZE) {
+        if (random() % 100 < garbage_percent) {
+            size_t size = 1 + random() % 64;
+            for (size_t i = 0; i < size; ++i)
+                stream.bytes.push_back(no_sync(random()));
+            stream.dropped_bytes += size;
+        }
+
+        std::vector<uint8_t> data(1 + random() % ant::MAX_DATA_LENGTH);
+        for (auto &byte : data)
+            byte = no_sync(random());
+        auto frame = Message(ant::BROADCAST_DATA, data);
+
+        if (random() % 100 < corrupt_percent) {
+            // A checksum equal to the sync byte would start a new frame
+            if (frame.back() == ant::SYNC_BYTE)
+                continue;
+            frame[3] = frame[3] == 0x55 ? 0x56 : 0x55;
+            ++stream.corrupt_frames;
+            stream.dropped_bytes += frame.size();
+        } else {
+            stream.frames.push_back(stream.bytes.size());
+        }
+        stream.bytes.insert(stream.bytes.end(), frame.begin(), frame.end());
+    }
+
+    return stream;
+}
+
+
+bool same_frame(Stream const &stream, size_t index, FrameView const &frame)
+{
+    size_t offset = stream.frames[index];
+    if (frame.Size() != stream.bytes[offset + 1] + FrameReader::FRAME_OVERHEAD)
+        return false;
+    for (size_t i = 0; i < frame.Size(); ++i) {
+        if (frame[i] != stream.bytes[offset + i])
+            return false;
+    }
+    return true;
+}
+
+
+// Feeds the stream in random sized chunks, like reads of a tty would return
+// it, and checks every frame comes back in order
+void check_stream(Stream const &stream, bool batch)
+{
+    std::mt19937 random(7);
+    FrameReader framer;
+    FrameView frames[32];
+    size_t recovered = 0;
+
+    size_t offset = 0;
+    while (offset < stream.bytes.size()) {
+        size_t chunk = std::min<size_t>(1 + random() % 700, stream.bytes.size() - offset);
+        offset += framer.Write(&stream.bytes[offset], chunk);
+
+        size_t count;
+        do {
+            if (batch) {
+                count = framer.NextBatch(frames, 1 + random() % 32);
+            } else {
+                count = framer.Next(frames[0]) ? 1 : 0;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                CHECK(recovered < stream.frames.size());
+                CHECK(same_frame(stream, recovered, frames[i]));
+                ++recovered;
+            }
+        } while (count > 0);
+    }
+
+    auto stats = framer.Stats();
+    CHECK(recovered == stream.frames.size());
+    CHECK(stats.frames == stream.frames.size());
+    CHECK(stats.corrupt_frames == stream.corrupt_frames);
+    CHECK(stats.dropped_bytes == stream.dropped_bytes);
+    CHECK(framer.Size() == 0);
+}
+
+} // namespace
+
+
+TEST(framing_clean_stream)
+{
+    auto stream = make_stream(0, 0);
+    CHECK(stream.dropped_bytes == 0);
+    check_stream(stream, false);
+}
+
+
+TEST(framing_clean_stream_batch)
+{
+    check_stream(make_stream(0, 0), true);
+}
+
+
+TEST(framing_noisy_stream)
+{
+    auto stream = make_stream(10, 5);
+    CHECK(stream.corrupt_frames > 0);
+    check_stream(stream, false);
+}
+
+
+TEST(framing_noisy_stream_batch)
+{
+    check_stream(make_stream(10, 5), true);
+}
+
+
+TEST(framing_implausible_length)
+{
+    // A sync byte with a too long length must not hold back the good frame
+    // right behind it
+    std::vector<uint8_t> bytes {ant::SYNC_BYTE, ant::MAX_DATA_LENGTH + 1};
+    auto frame = Message(ant::BROADCAST_DATA, {1, 2, 3, 4, 5, 6, 7, 8});
+    bytes.insert(bytes.end(), frame.begin(), frame.end());
+
+    FrameReader framer;
+    FrameView view;
+    framer.Write(bytes.data(), bytes.size());
+    CHECK(framer.Next(view));
+    CHECK(view.Size() == frame.size());
+    CHECK(view.Id() == ant::BROADCAST_DATA);
+    CHECK(!framer.Next(view));
+
+    auto stats = framer.Stats();
+    CHECK(stats.frames == 1);
+    CHECK(stats.corrupt_frames == 1);
+    CHECK(stats.dropped_bytes == 2);
+}
+
+
+TEST(framing_resync_inside_bad_frame)
+{
+    // A line error turned a data byte into a sync byte. The phantom frame
+    // it starts reaches into the good frame behind it and fails its checksum,
+    // the good frame must still come out
+    auto frame = Message(ant::BROADCAST_DATA, {1, 2, 3, 4, 5, 6, 7, 8, 9});
+    std::vector<uint8_t> bytes {ant::SYNC_BYTE, 9, 0x4E, 0x11};
+    bytes.insert(bytes.end(), frame.begin(), frame.end());
+
+    for (bool batch : {false, true}) {
+        FrameReader framer;
+        FrameView views[4];
+        framer.Write(bytes.data(), bytes.size());
+
+        size_t count = batch ? framer.NextBatch(views, 4) : framer.Next(views[0]);
+        CHECK(count == 1);
+        CHECK(views[0].Size() == frame.size());
+        for (size_t i = 0; i < frame.size(); ++i)
+            CHECK(views[0][i] == frame[i]);
+
+        auto stats = framer.Stats();
+        CHECK(stats.frames == 1);
+        CHECK(stats.corrupt_frames == 1);
+        CHECK(stats.dropped_bytes == 4);
+    }
+}
+
+
+TEST(framing_build_message)
+{
+    // Short data is padded, like the last packet of a burst
+    const uint8_t data[] = {1, 2, 3, 4, 5};
+    auto frame = BuildMessage<9>(ant::BURST_TRANSFER_DATA, 0xA1, data, sizeof(data));
+    auto expected = Message(ant::BURST_TRANSFER_DATA, {0xA1, 1, 2, 3, 4, 5, 0, 0, 0});
+
+    CHECK(std::vector<uint8_t>(frame.begin(), frame.end()) == expected);
+}
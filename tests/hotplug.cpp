@@ -0,0 +1,193 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "StickEmulator.h"
+#include "StickPool.h"
+#include "TtyUsbDevice.h"
+
+#include <chrono>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Directory for the "ttyUSBN" links of a test, removed with them
+class LinkDirectory {
+public:
+    explicit LinkDirectory(std::string const &name) : path_(test::TempPath(name)) { mkdir(path_.c_str(), 0700); }
+    ~LinkDirectory() { rmdir(path_.c_str()); }
+
+    std::string Node(size_t index) const { return path_ + "/ttyUSB" + std::to_string(index); }
+    std::string Prefix() const { return path_ + "/ttyUSB"; }
+
+private:
+    std::string path_;
+};
+
+// Waits for a message of the stick, longest gap between messages of any
+// stick meanwhile in gap_s
+bool read_from(StickPool &pool, size_t stick, double timeout_s, double &gap_s)
+{
+    PoolMessage msg;
+    auto start = Clock::now();
+    auto last = start;
+    gap_s = 0;
+    while (seconds_since(start) < timeout_s) {
+        if (!pool.Read(msg, 50))
+            continue;
+        gap_s = std::max(gap_s, seconds_since(last));
+        last = Clock::now();
+        if (msg.stick == stick)
+            return true;
+    }
+    return false;
+}
+
+} // namespace
+
+TEST(hotplug_reconnect)
+{
+    LinkDirectory directory("hotplug");
+    EmulatedDevices devices;
+    devices.count = 4;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(directory.Node(0)));
+
+    StickPool pool;
+    auto stick = std::make_unique<Stick>();
+    stick->AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(directory.Node(0), true)));
+    pool.Add(std::move(stick));
+    CHECK(pool.Init() == 1);
+    CHECK(pool.WatchHotPlug(directory.Prefix()));
+    CHECK(pool.Start());
+
+    double gap;
+    CHECK(read_from(pool, 0, 2.0, gap));
+
+    // Unplugged: the link goes away and the pty hangs up
+    emulator.Stop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(!pool[0].IsConnected());
+
+    // Plugged in again: a fresh stick without open channels on a new pty
+    CHECK(emulator.Start(directory.Node(0)));
+    PoolMessage msg;
+    while (pool.Read(msg, 0));
+    CHECK(read_from(pool, 0, 2.0, gap));
+    CHECK(pool[0].Snapshot().reconnects == 1);
+
+    pool.Stop();
+}
+
+
+TEST(hotplug_wildcard_searches_again)
+{
+    LinkDirectory directory("wildcard");
+    EmulatedDevices devices;
+    devices.count = 4;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(directory.Node(0)));
+
+    StickPool pool;
+    auto stick = std::make_unique<Stick>();
+    stick->AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(directory.Node(0), true)));
+    pool.Add(std::move(stick));
+    CHECK(pool.Init() == 1);
+    CHECK(pool.WatchHotPlug(directory.Prefix()));
+    CHECK(pool.Start());
+
+    double gap;
+    CHECK(read_from(pool, 0, 2.0, gap));
+
+    // Another stick with other sensors is plugged in: the search channel of
+    // Init has to find one of them rather than wait for its old device
+    emulator.Stop();
+    devices.first_device_number = 1000;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(directory.Node(0)));
+
+    PoolMessage msg;
+    while (pool.Read(msg, 0));
+    auto start = Clock::now();
+    bool found = false;
+    while (!found && seconds_since(start) < 2.0)
+        found = pool.Read(msg, 50) && msg.message.device_number >= devices.first_device_number;
+    CHECK(found);
+
+    pool.Stop();
+}
+
+
+TEST(hotplug_unresponsive_stick)
+{
+    LinkDirectory directory("unresponsive");
+    EmulatedDevices devices;
+    devices.count = 4;
+
+    StickEmulator emulators[2];
+    StickPool pool;
+    for (size_t index = 0; index < 2; ++index) {
+        emulators[index].SetDevices(devices);
+        CHECK(emulators[index].Start(directory.Node(index)));
+
+        auto stick = std::make_unique<Stick>();
+        stick->AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(directory.Node(index), true)));
+        pool.Add(std::move(stick));
+    }
+    CHECK(pool.Init() == 2);
+    CHECK(pool.WatchHotPlug(directory.Prefix()));
+    CHECK(pool.Start());
+
+    double gap;
+    CHECK(read_from(pool, 0, 2.0, gap));
+
+    // The stick comes back but never answers a command, its reconnect keeps
+    // timing out while the other stick is served as usual
+    emulators[0].Stop();
+    EmulatorFaults faults;
+    faults.lost_response = 1.0;
+    emulators[0].SetFaults(faults);
+    CHECK(emulators[0].Start(directory.Node(0)));
+
+    auto start = Clock::now();
+    while (seconds_since(start) < 3.0) {
+        CHECK(read_from(pool, 1, 1.0, gap));
+        CHECK(gap < 0.5);
+    }
+    CHECK(!pool[0].IsConnected());
+
+    // Waits for the reconnect in progress, bounded by the response timeout
+    start = Clock::now();
+    pool.Stop();
+    CHECK(seconds_since(start) < 3.0);
+
+    for (auto &emulator : emulators)
+        emulator.Stop();
+}
@@ -0,0 +1,123 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "Log.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// Runs log calls with stdout redirected to a file, returns what was written
+template <typename Function>
+std::string captured(Function function)
+{
+    auto path = test::TempPath("log");
+    antlog::Flush();
+    std::fflush(stdout);
+
+    int saved = dup(STDOUT_FILENO);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+
+    function();
+    antlog::Flush();
+    std::fflush(stdout);
+
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    std::ifstream file(path);
+    std::stringstream text;
+    text << file.rdbuf();
+    unlink(path.c_str());
+
+    return text.str();
+}
+
+enum Color { RED = 3 };
+
+} // namespace
+
+
+TEST(log_arguments)
+{
+    std::string name = "stick";
+    const char *error = "No such device";
+    uint8_t letter = 'A';
+
+    auto text = captured([&] () {
+        LOG_MSG("Open " << name << ": " << error << " " << -42 << " " << 2.5 << " " << letter);
+        LOG_MSG(std::hex << 255 << std::dec << " " << 255u << " " << RED << (name.empty() ? " yes" : " no"));
+    });
+
+    CHECK(text == "Open stick: No such device -42 2.5 A\nff 255 3 no\n");
+}
+
+
+TEST(log_buffer_copied)
+{
+    char buffer[16];
+    std::strcpy(buffer, "ttyUSB0");
+
+    // The buffer is reused before the logger thread gets to the record
+    auto text = captured([&] () {
+        LOG_MSG("Device " << buffer);
+        std::strcpy(buffer, "changed");
+    });
+
+    CHECK(text == "Device ttyUSB0\n");
+}
+
+
+TEST(log_truncated)
+{
+    std::string long_text(300, 'x');
+
+    auto text = captured([&] () {
+        LOG_MSG("Start " << long_text << " end " << 1);
+        LOG_MSG("Next");
+    });
+
+    // The cut message is marked, the next one is complete
+    CHECK(text.compare(0, 6, "Start ") == 0);
+    CHECK(text.find(" [truncated]\nNext\n") != std::string::npos);
+    CHECK(text.find(" end ") == std::string::npos);
+}
+
+
+TEST(log_wakes_up)
+{
+    // A record pushed to a sleeping logger is written right away
+    captured([] () {});
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    auto start = std::chrono::steady_clock::now();
+    auto text = captured([] () { LOG_MSG("Wake up"); });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    CHECK(text == "Wake up\n");
+    CHECK(elapsed.count() < 0.1);
+}
@@ -0,0 +1,123 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "PairingCache.h"
+#include "Stick.h"
+#include "StickEmulator.h"
+#include "TtyUsbDevice.h"
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <set>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+PairedDevice make_device(uint16_t device_number, int64_t last_seen)
+{
+    ChannelConfig config;
+    return PairedDevice {device_number, config.device_type, 1, config.period,
+                         config.frequency, config.network, last_seen};
+}
+
+} // namespace
+
+TEST(pairing_save_load)
+{
+    std::string path = test::TempPath("pairing.txt");
+    std::remove(path.c_str());
+
+    PairingCache cache(path);
+    CHECK(cache.Load() && cache.Size() == 0);   // A missing file is empty
+    cache.Record(make_device(10, 100));
+    cache.Record(make_device(11, 300));
+    cache.Record(make_device(12, 200));
+    cache.Record(make_device(10, 400));         // Refreshed, not added
+    CHECK(cache.Size() == 3);
+    CHECK(cache.Save());
+
+    PairingCache loaded(path);
+    CHECK(loaded.Load());
+    auto recent = loaded.Recent();
+    CHECK(recent.size() == 3);
+    CHECK(recent[0].device_number == 10 && recent[0].last_seen == 400);
+    CHECK(recent[1].device_number == 11);
+    CHECK(recent[2].device_number == 12);
+    CHECK(recent[0].Key() == make_device(10, 0).Key());
+    CHECK(recent[0].period == ChannelConfig {}.period);
+    CHECK(loaded.Recent(1).size() == 1);
+
+    CHECK(loaded.Expire(150, 400) == 1);        // Device 12
+    CHECK(loaded.Forget(make_device(11, 0).Key()));
+    CHECK(!loaded.Forget(make_device(11, 0).Key()));
+    CHECK(loaded.Size() == 1);
+
+    std::remove(path.c_str());
+}
+
+
+TEST(pairing_init_exact_ids)
+{
+    EmulatedDevices devices;
+    devices.count = 8;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("pairing")));
+
+    std::string path = test::TempPath("pairing-init.txt");
+    std::remove(path.c_str());
+    auto cache = std::make_shared<PairingCache>(path);
+    cache->Record(make_device(5, 1));
+    cache->Record(make_device(7, 2));
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+    stick.SetPairingCache(cache);
+    CHECK(stick.Connect() && stick.Reset() && stick.Init());
+
+    // Cached devices get channels of their own, the search channel excludes
+    // them and pairs with another device
+    std::map<uint8_t, std::set<uint16_t>> received;
+    ExtendedMessage ext_msg;
+    auto start = Clock::now();
+    while (seconds_since(start) < 0.5) {
+        if (stick.PollExtendedMsg(ext_msg))
+            received[ext_msg.channel_number].insert(ext_msg.device_number);
+    }
+
+    std::set<uint16_t> seen;
+    for (auto const &channel : received) {
+        CHECK(channel.second.size() == 1);
+        seen.insert(*channel.second.begin());
+    }
+    CHECK(received.size() == 3);
+    CHECK(seen.count(5) && seen.count(7));
+
+    // The searched device is recorded too
+    CHECK(cache->Size() == 3);
+
+    std::remove(path.c_str());
+}
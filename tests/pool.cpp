@@ -0,0 +1,57 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "StickEmulator.h"
+#include "StickPool.h"
+#include "TtyUsbDevice.h"
+
+TEST(pool_pty_reactor)
+{
+    EmulatedDevices devices;
+    devices.count = 4;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("pool")));
+
+    StickPool pool;
+    auto stick = std::make_unique<Stick>();
+    stick->AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+    pool.Add(std::move(stick));
+
+    CHECK(pool.Init() == 1);
+
+    size_t index;
+    uint8_t channel;
+    CHECK(pool.OpenChannel(ChannelConfig {}, index, channel));
+    CHECK(pool.Start());
+
+    // Init opened a channel too, both pair with emulated transmitters
+    PoolMessage msg;
+    for (uint64_t sequence = 0; sequence < 4; ++sequence) {
+        CHECK(pool.Read(msg, 2000));
+        CHECK(msg.stick == 0);
+        CHECK(msg.sequence == sequence);
+        CHECK(msg.message.channel_number <= channel);
+        CHECK(msg.message.device_number >= devices.first_device_number);
+        CHECK(msg.message.device_number < devices.first_device_number + devices.count);
+    }
+
+    pool.Stop();
+    CHECK(pool.Dropped() == 0);
+}
@@ -0,0 +1,234 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "Stick.h"
+#include "StickEmulator.h"
+#include "TtyUsbDevice.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+/* Blocking device on the read end of a pipe: Read waits for data and returns
+ * everything the pipe holds, commands are discarded.
+ */
+class PipeDevice: public Device {
+public:
+    explicit PipeDevice(int fd) : fd_(fd) {}
+    using Device::Write;
+
+    virtual bool Read(std::vector<uint8_t> &buff) override {
+        uint8_t data[65536];
+        ssize_t size = read(fd_, data, sizeof(data));
+        if (size <= 0)
+            return false;
+        buff.insert(buff.end(), data, data + size);
+        return true;
+    }
+    virtual bool Write(std::vector<uint8_t> const &) override { return true; }
+    virtual bool Connect() override { return true; }
+    virtual bool IsConnected() override { return true; }
+    virtual bool Disconnect() override { return true; }
+    virtual int Handle() override { return fd_; }
+    virtual bool ReadMayBlock() const override { return true; }
+
+    virtual ~PipeDevice() override { close(fd_); }
+
+private:
+    int fd_;
+};
+
+} // namespace
+
+
+TEST(stick_poll_blocking_device)
+{
+    // A silent stick: scan mode without any transmitter in range
+    EmulatedDevices devices;
+    devices.count = 0;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("poll")));
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path())));
+    CHECK(stick.Connect() && stick.Reset() && stick.InitScanMode());
+
+    std::vector<uint8_t> message;
+    ExtendedMessage ext_msg;
+
+    auto start = Clock::now();
+    for (int i = 0; i < 10; ++i) {
+        CHECK(!stick.PollMessage(message));
+        CHECK(!stick.PollExtendedMsg(ext_msg));
+    }
+    CHECK(seconds_since(start) < 0.5);
+}
+
+
+TEST(stick_batch_blocking_device)
+{
+    // One transmitter, so a message is followed by a full period of silence
+    EmulatedDevices devices;
+    devices.count = 1;
+    double period = devices.period / 32768.0;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("batch")));
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path())));
+    CHECK(stick.Connect() && stick.Reset() && stick.InitScanMode());
+
+    // Every batch returns right after its first message instead of waiting
+    // in Read for the next one
+    std::vector<ExtendedMessage> batch;
+    auto start = Clock::now();
+    for (int i = 0; i < 4; ++i) {
+        CHECK(stick.ReadExtendedBatch(batch, 256) == 1);
+        CHECK(batch[0].device_number == devices.first_device_number);
+    }
+    CHECK(seconds_since(start) < 4.5 * period);
+}
+
+
+
+
+TEST(stick_stop_io_blocking_device)
+{
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new PipeDevice(fds[0])));
+    CHECK(stick.Connect());
+
+    std::mutex mutex;
+    std::condition_variable delivered;
+    size_t messages = 0;
+    CHECK(stick.Subscribe(MessageFilter {}, [&] (ExtendedMessage const &) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++messages;
+        delivered.notify_one();
+    }) >= 0);
+
+    // Exactly one full batch of the io thread in one read, then silence:
+    // draining the next batch must not wait in Read
+    constexpr size_t BATCH_SIZE = 256;
+    std::vector<uint8_t> stream;
+    for (size_t i = 0; i < BATCH_SIZE; ++i) {
+        auto frame = Message(ant::BROADCAST_DATA, {0, 1, 2, 3, 4, 5, 6, 7, 8, ant::EXT_CHANNEL_ID,
+                                                   static_cast<uint8_t>(i), 0, HRM::ANT_DEVICE_TYPE, 1});
+        stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    CHECK(write(fds[1], stream.data(), stream.size()) == static_cast<ssize_t>(stream.size()));
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        CHECK(delivered.wait_for(lock, std::chrono::seconds(3), [&] () { return messages == BATCH_SIZE; }));
+    }
+
+    auto start = Clock::now();
+    stick.StopIo();
+    CHECK(seconds_since(start) < 0.5);
+
+    close(fds[1]);
+}
+
+
+TEST(stick_resync_after_corruption)
+{
+    EmulatedDevices devices;
+    devices.count = 200;
+    EmulatorFaults faults;
+    faults.corrupt_frame = 0.05;
+    faults.garbage = 0.05;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    emulator.SetFaults(faults);
+    CHECK(emulator.Start(test::TempPath("corrupt")));
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+    CHECK(stick.Connect() && stick.Reset() && stick.InitScanMode());
+
+    std::vector<ExtendedMessage> batch;
+    uint64_t received = 0;
+    uint64_t sent_before = emulator.Stats().data_frames;
+    auto start = Clock::now();
+
+    while (seconds_since(start) < 1.0) {
+        stick.ReadExtendedBatch(batch, 256);
+        received += batch.size();
+    }
+
+    // Only the corrupted frames are lost, the stream does not fall apart
+    uint64_t sent = emulator.Stats().data_frames - sent_before;
+    auto framing = stick.FramingStats();
+    CHECK(framing.corrupt_frames > 0);
+    CHECK(framing.dropped_bytes > 0);
+    CHECK(received <= sent);
+    CHECK(received >= sent * 0.85);
+}
+
+
+TEST(stick_burst_keeps_data)
+{
+    EmulatedDevices devices;
+    devices.count = 2000;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("burst")));
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+    CHECK(stick.Connect() && stick.Reset() && stick.InitScanMode());
+
+    // Broadcasts pile up while nobody reads, SendBurst reads them on its way
+    // to the end of the transfer
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    uint8_t data[64] {};
+    CHECK(stick.SendBurst(0, data, sizeof(data)) == ant::NO_ERROR);
+
+    size_t kept = 0;
+    ExtendedMessage ext_msg;
+    while (stick.PollExtendedMsg(ext_msg)) {
+        CHECK(ext_msg.device_number >= devices.first_device_number);
+        CHECK(ext_msg.device_number < devices.first_device_number + devices.count);
+        ++kept;
+    }
+    CHECK(kept >= 100);
+    CHECK(stick.DroppedMessages() == 0);
+}
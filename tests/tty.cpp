@@ -0,0 +1,102 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "TtyUsbDevice.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace {
+
+// Both ends of a raw pseudo terminal, the slave is what a TtyUsbDevice opens
+class Pty {
+public:
+    Pty() {
+        master_ = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master_ < 0 || grantpt(master_) != 0 || unlockpt(master_) != 0)
+            return;
+        char name[128];
+        if (ptsname_r(master_, name, sizeof(name)) == 0)
+            slave_path_ = name;
+
+        // Raw, a pty would otherwise echo and translate line endings
+        int slave = open(slave_path_.c_str(), O_RDWR | O_NOCTTY);
+        termios tty {};
+        if (slave >= 0 && tcgetattr(slave, &tty) == 0) {
+            cfmakeraw(&tty);
+            tcsetattr(slave, TCSANOW, &tty);
+        }
+        if (slave >= 0)
+            close(slave);
+    }
+    ~Pty() { if (master_ >= 0) close(master_); }
+
+    int Master() const { return master_; }
+    std::string const &SlavePath() const { return slave_path_; }
+
+private:
+    int master_ = -1;
+    std::string slave_path_ {};
+};
+
+} // namespace
+
+TEST(tty_write_full_buffer)
+{
+    Pty pty;
+    CHECK(!pty.SlavePath().empty());
+
+    TtyUsbDevice device(pty.SlavePath(), true);
+    CHECK(device.Connect());
+
+    // Much more than the pty buffers, the non-blocking write has to wait
+    // for the reader and continue where it stopped
+    std::vector<uint8_t> data(256 * 1024);
+    for (size_t index = 0; index < data.size(); ++index)
+        data[index] = static_cast<uint8_t>(index * 7 + index / 251);
+
+    std::vector<uint8_t> received;
+    std::thread reader([&] {
+        uint8_t buffer[1024];
+        while (received.size() < data.size()) {
+            // Nothing more coming, a part of the data was lost
+            pollfd descriptor {pty.Master(), POLLIN, 0};
+            if (poll(&descriptor, 1, 1000) <= 0)
+                break;
+            ssize_t bytes = read(pty.Master(), buffer, sizeof(buffer));
+            if (bytes <= 0)
+                break;
+            received.insert(received.end(), buffer, buffer + bytes);
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    });
+
+    bool written = device.Write(data.data(), data.size());
+    reader.join();
+
+    CHECK(written);
+    CHECK(received == data);
+    device.Disconnect();
+}
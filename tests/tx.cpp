@@ -0,0 +1,154 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "Stick.h"
+#include "StickEmulator.h"
+#include "TxScheduler.h"
+#include "TtyUsbDevice.h"
+
+#include <chrono>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+TxScheduler::Payload make_payload(bool acknowledged, uint32_t tag)
+{
+    TxScheduler::Payload payload {};
+    payload.acknowledged = acknowledged;
+    payload.tag = tag;
+    return payload;
+}
+
+} // namespace
+
+TEST(tx_acknowledged_in_flight)
+{
+    TxScheduler tx;
+    tx.Open(1, 8192);
+
+    TxScheduler::Payload payload;
+    CHECK(tx.Queue(1, make_payload(true, 7)));
+    CHECK(tx.Take(1, payload) && payload.acknowledged && payload.tag == 7);
+
+    // The next payload waits for the end of the acknowledged one
+    CHECK(tx.Queue(1, make_payload(true, 8)));
+    CHECK(!tx.Take(1, payload));
+
+    uint32_t tag = 0;
+    CHECK(tx.Complete(1, tag) && tag == 7);
+    CHECK(!tx.Complete(1, tag));
+    CHECK(tx.Take(1, payload) && payload.tag == 8);
+}
+
+
+TEST(tx_during_commands)
+{
+    EmulatedDevices devices;
+    devices.count = 0;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("tx")));
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+    CHECK(stick.Connect() && stick.Reset() && stick.Init());
+
+    // A master channel at 32 Hz
+    ChannelConfig master;
+    master.device_number = 100;
+    master.trans_type = 1;
+    master.period = 1024;
+    master.type = ant::BIDIRECTIONAL_TRANSMIT;
+    int channel = stick.OpenChannel(master);
+    CHECK(channel >= 0);
+
+    uint8_t payload[8] {};
+    CHECK(stick.QueueBroadcast(channel, payload));
+
+    // Nothing but commands for half a second: EVENT_TX arriving while their
+    // responses are waited for must still be served
+    auto start = Clock::now();
+    while (seconds_since(start) < 0.5) {
+        int receive = stick.OpenChannel(ChannelConfig {});
+        CHECK(receive >= 0);
+        CHECK(stick.CloseChannel(receive));
+        stick.QueueBroadcast(channel, payload);
+    }
+
+    CHECK(stick.Snapshot().tx_messages >= 8);
+}
+
+
+TEST(tx_burst_keeps_acknowledged)
+{
+    EmulatedDevices devices;
+    devices.count = 0;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("tx-burst")));
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+    CHECK(stick.Connect() && stick.Reset() && stick.Init());
+
+    // A master channel at 4 Hz
+    ChannelConfig master;
+    master.device_number = 100;
+    master.trans_type = 1;
+    master.period = 8192;
+    master.type = ant::BIDIRECTIONAL_TRANSMIT;
+    int channel = stick.OpenChannel(master);
+    CHECK(channel >= 0);
+
+    size_t outcomes = 0;
+    uint32_t last_tag = 0;
+    stick.SetTxCallback([&] (uint8_t, uint32_t tag, bool) {
+        ++outcomes;
+        last_tag = tag;
+    });
+
+    // Written at the next EVENT_TX, it ends a period later
+    uint8_t payload[8] {};
+    CHECK(stick.QueueAcknowledged(channel, payload, 1));
+    ExtendedMessage ext_msg;
+    auto start = Clock::now();
+    while (stick.Snapshot().tx_messages == 0 && seconds_since(start) < 1.0)
+        if (!stick.PollExtendedMsg(ext_msg))
+            stick.WaitInput(10);
+    CHECK(stick.Snapshot().tx_messages == 1);
+
+    // The end of the burst is not the end of the acknowledged message
+    uint8_t data[16] {};
+    CHECK(stick.SendBurst(channel, data, sizeof(data)) == ant::NO_ERROR);
+    CHECK(outcomes == 0);
+
+    start = Clock::now();
+    while (outcomes == 0 && seconds_since(start) < 1.0)
+        if (!stick.PollExtendedMsg(ext_msg))
+            stick.WaitInput(10);
+    CHECK(outcomes == 1 && last_tag == 1);
+    CHECK(stick.Snapshot().tx_acknowledged == 1);
+}
@@ -0,0 +1,170 @@
+/**
+ *  AntStick -- communicate with an ANT+ USB stick
+ *  Copyright (C) 2017 - 2020 Alexander Saechnikov (saechnikov.a@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Test.h"
+#include "IdentityCache.h"
+#include "Stick.h"
+#include "StickEmulator.h"
+#include "StickPool.h"
+#include "TtyUsbDevice.h"
+
+#include <chrono>
+#include <cstdio>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Device number received on the channel within timeout_s, 0 if none
+uint16_t received_on(Stick &stick, uint8_t channel, double timeout_s)
+{
+    ExtendedMessage ext_msg;
+    auto start = Clock::now();
+    while (seconds_since(start) < timeout_s) {
+        if (stick.PollExtendedMsg(ext_msg) && ext_msg.channel_number == channel)
+            return ext_msg.device_number;
+    }
+    return 0;
+}
+
+} // namespace
+
+TEST(warm_identity_save_load)
+{
+    std::string path = test::TempPath("identity.txt");
+    std::remove(path.c_str());
+
+    IdentityCache cache(path);
+    CHECK(cache.Load());                        // A missing file is empty
+    cache.Record(StickIdentity {"/dev/ttyUSB0", 1, 8, 3, "AJK1.04RAF"});
+    cache.Record(StickIdentity {"/dev/ttyUSB1", 2, 4, 1, "AOD1.00B00"});
+    cache.Record(StickIdentity {"/dev/ttyUSB0", 3, 8, 8, "AJK1.04RAF"});
+    CHECK(cache.Save());
+
+    IdentityCache loaded(path);
+    CHECK(loaded.Load());
+
+    StickIdentity identity;
+    CHECK(loaded.Find("/dev/ttyUSB0", identity));
+    CHECK(identity.serial == 3 && identity.channels == 8 && identity.networks == 8);
+    CHECK(identity.version == "AJK1.04RAF");
+    CHECK(loaded.Find("/dev/ttyUSB1", identity) && identity.serial == 2);
+    CHECK(!loaded.Find("/dev/ttyUSB2", identity));
+
+    std::remove(path.c_str());
+}
+
+
+TEST(warm_start_takes_over_channels)
+{
+    EmulatedDevices devices;
+    devices.count = 4;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("warm")));
+
+    std::string path = test::TempPath("warm-identity.txt");
+    std::remove(path.c_str());
+    auto cache = std::make_shared<IdentityCache>(path);
+
+    // The first run identifies the stick and leaves a paired channel behind
+    uint16_t device_number;
+    {
+        Stick stick;
+        stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+        stick.SetIdentityCache(cache);
+        CHECK(stick.WarmStart());
+
+        device_number = received_on(stick, 0, 1.0);
+        CHECK(device_number != 0);
+    }
+
+    StickIdentity identity;
+    CHECK(cache->Find(emulator.Path(), identity));
+    CHECK(identity.channels == 8 && !identity.version.empty());
+
+    // The second one finds the channel open and keeps it, a new search
+    // channel joins it
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+    stick.SetIdentityCache(cache);
+    CHECK(stick.WarmStart());
+
+    CHECK(stick.Timings().warm && stick.Timings().reset == 0);
+    CHECK(stick.FreeChannels() == identity.channels - 2);
+    CHECK(received_on(stick, 0, 1.0) == device_number);
+
+    std::remove(path.c_str());
+}
+
+
+TEST(warm_start_other_stick)
+{
+    EmulatedDevices devices;
+    devices.count = 1;
+
+    StickEmulator emulator;
+    emulator.SetDevices(devices);
+    CHECK(emulator.Start(test::TempPath("other")));
+
+    // Another stick was on the path before: identified again, not trusted
+    auto cache = std::make_shared<IdentityCache>(test::TempPath("other-identity.txt"));
+    cache->Record(StickIdentity {emulator.Path(), 1, 4, 1, "OLD"});
+
+    Stick stick;
+    stick.AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulator.Path(), true)));
+    stick.SetIdentityCache(cache);
+    CHECK(stick.WarmStart());
+
+    StickIdentity identity;
+    CHECK(cache->Find(emulator.Path(), identity));
+    CHECK(identity.serial != 1 && identity.channels == 8 && identity.version != "OLD");
+    CHECK(stick.FreeChannels() == identity.channels - 1);
+}
+
+
+TEST(warm_start_pool)
+{
+    EmulatedDevices devices;
+    devices.count = 2;
+
+    auto cache = std::make_shared<IdentityCache>(test::TempPath("pool-identity.txt"));
+    StickEmulator emulators[3];
+    StickPool pool;
+    for (size_t index = 0; index < 3; ++index) {
+        emulators[index].SetDevices(devices);
+        CHECK(emulators[index].Start(test::TempPath("warm-pool" + std::to_string(index))));
+
+        auto stick = std::make_unique<Stick>();
+        stick->AttachDevice(std::unique_ptr<Device>(new TtyUsbDevice(emulators[index].Path(), true)));
+        stick->SetIdentityCache(cache);
+        pool.Add(std::move(stick));
+    }
+
+    // The sticks come up concurrently, each one records its identity
+    CHECK(pool.Init(true) == 3);
+
+    StickIdentity identity;
+    for (auto const &emulator : emulators)
+        CHECK(cache->Find(emulator.Path(), identity));
+}